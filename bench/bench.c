@@ -0,0 +1,312 @@
+/* Microbenchmarks of the hot paths, written as JSON on stdout so that runs
+ * can be compared across releases: make bench
+ *
+ * The hot paths must not allocate once warmed up, the bench fails when one
+ * does. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../emi-alloc.h"
+#include "../emi-decode.h"
+#include "../emi-meter.h"
+#include "../emi-regcache.h"
+#include "../light-modbus/light-modbus-loopback.h"
+#include "../light-modbus/light-modbus-rtu.h"
+#include "../tools/emi-model.h"
+
+#define BENCH_VERSION 1
+/* Each sample runs for at least this long */
+#define SAMPLE_NS 100000000ULL
+#define NB_SAMPLES 5
+
+typedef void (*bench_fn_t)(uint64_t iterations);
+
+typedef struct {
+    const char *name;
+    bench_fn_t run;
+} bench_t;
+
+static modbus_t *ctx;
+static emi_model_t model;
+/* Request and response of a voltage + current read, as on the wire */
+static uint8_t request[_MIN_REQ_LENGTH];
+static int requestLength;
+static uint8_t response[MODBUS_RTU_MAX_ADU_LENGTH];
+static int responseLength;
+static uint8_t payload[MODBUS_RTU_MAX_ADU_LENGTH];
+/* Polled by the poll cycle, as by emi-read */
+static emi_value_t values[] = {
+    {"voltage", 0x006c, 2, -1, 1, FALSE},
+    {"current", 0x006d, 2, -1, 1, FALSE},
+    {"activePower", 0x0079, 4, 0, 0, FALSE},
+    {"activeEnergyImport", 0x0016, 4, 0, 0, TRUE},
+    {"frequency", 0x007F, 2, -1, 1, FALSE},
+    {"powerFactor", 0x007B, 2, -3, 3, FALSE},
+    {"rate1ActiveEnergy", 0x0026, 4, 0, 0, TRUE},
+    {"rate2ActiveEnergy", 0x0027, 4, 0, 0, TRUE},
+    {"rate3ActiveEnergy", 0x0028, 4, 0, 0, TRUE},
+    {"totalRateActiveEnergy", 0x002C, 4, 0, 0, TRUE},
+};
+#define NB_VALUES (int)(sizeof(values) / sizeof(values[0]))
+static emi_meter_t meter;
+static emi_regcache_t regcache;
+
+/* Keeps the compiler from optimising the benchmarked code away */
+static volatile uint64_t sink;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void benchCrc16Request(uint64_t iterations)
+{
+    while (iterations--)
+    {
+        sink += _modbus_rtu_crc16(request, _MODBUS_RTU_PRESET_REQ_LENGTH);
+    }
+}
+
+static void benchCrc16Max(uint64_t iterations)
+{
+    while (iterations--)
+    {
+        sink += _modbus_rtu_crc16(payload, MODBUS_RTU_MAX_ADU_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH);
+    }
+}
+
+static void benchBuildRequest(uint64_t iterations)
+{
+    uint8_t req[_MIN_REQ_LENGTH];
+
+    while (iterations--)
+    {
+        int length = _modbus_rtu_build_request_basis(ctx, MODBUS_FC_READ_INPUT_REGISTERS, 0x006c, 2, 2, req);
+        sink += _modbus_rtu_send_msg_pre(req, length);
+    }
+}
+
+static void benchReceive(uint64_t iterations)
+{
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    while (iterations--)
+    {
+        modbus_loopback_feed(ctx, response, responseLength);
+        sink += _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+    }
+}
+
+static void benchCheckConfirmation(uint64_t iterations)
+{
+    while (iterations--)
+    {
+        sink += _modbus_check_confirmation(ctx, request, response, 2, responseLength);
+    }
+}
+
+static void benchTransaction(uint64_t iterations)
+{
+    uint8_t values[4];
+
+    while (iterations--)
+    {
+        sink += modbus_read_input_registers(ctx, 0x006c, 2, 2, values);
+    }
+}
+
+static void benchDecodeUInt16(uint64_t iterations)
+{
+    while (iterations--)
+    {
+        sink += decodeUInt16(response + 3 + (iterations & 1) * 2, -1);
+    }
+}
+
+static void benchDecodeUInt32(uint64_t iterations)
+{
+    static const uint8_t raw[4] = {0x00, 0x1E, 0x84, 0x80};
+
+    while (iterations--)
+    {
+        sink += decodeUInt32(raw, 0);
+    }
+}
+
+static void benchScaleInt(uint64_t iterations)
+{
+    while (iterations--)
+    {
+        sink += scaleInt(970 + (iterations & 7), -3);
+    }
+}
+
+static void benchFormatDouble(uint64_t iterations)
+{
+    char str[32];
+
+    while (iterations--)
+    {
+        sink += formatDouble(str, sizeof(str), 230.4 + (iterations & 7), 1);
+    }
+}
+
+/* The reads and formatting of a poll cycle of emi-read, without MQTT */
+static void benchPollCycle(uint64_t iterations)
+{
+    char str[32];
+    int i;
+
+    while (iterations--)
+    {
+        sink += readValues(ctx, values, NB_VALUES);
+        for (i = 0; i < NB_VALUES; i++)
+        {
+            sink += formatDouble(str, sizeof(str), values[i].value, values[i].decimals);
+        }
+        sink += getTime(ctx, &meter.clock);
+    }
+}
+
+/* A repeated read served by the register cache */
+static void benchRegcacheHit(uint64_t iterations)
+{
+    uint8_t deviceId[EMI_OCTET_STRING_MAX_LENGTH];
+
+    while (iterations--)
+    {
+        sink += emi_regcache_read(&regcache, ctx, 0x0002, 1, sizeof(deviceId), deviceId);
+    }
+}
+
+static const bench_t benchmarks[] = {
+    {"crc16_request", benchCrc16Request},
+    {"crc16_max_adu", benchCrc16Max},
+    {"build_request", benchBuildRequest},
+    {"receive_msg", benchReceive},
+    {"check_confirmation", benchCheckConfirmation},
+    {"loopback_transaction", benchTransaction},
+    {"decode_uint16", benchDecodeUInt16},
+    {"decode_uint32", benchDecodeUInt32},
+    {"scale_int", benchScaleInt},
+    {"format_double", benchFormatDouble},
+    {"poll_cycle", benchPollCycle},
+    {"regcache_hit", benchRegcacheHit},
+};
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void setUp(void)
+{
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+    int i;
+
+    emi_model_init(&model, 1, 1);
+    ctx = modbus_new_loopback(emi_model_answer, &model);
+    if (ctx == NULL || modbus_set_slave(ctx, 1) == -1 || modbus_connect(ctx) == -1)
+    {
+        fprintf(stderr, "Could not create the loopback context\n");
+        exit(1);
+    }
+    /* A failing cycle would time the error path */
+    if (readValues(ctx, values, NB_VALUES) != NB_VALUES || getTime(ctx, &meter.clock) != 1)
+    {
+        fprintf(stderr, "The poll cycle fails on the model\n");
+        exit(1);
+    }
+
+    requestLength = _modbus_rtu_build_request_basis(ctx, MODBUS_FC_READ_INPUT_REGISTERS, 0x006c, 2, 2, request);
+    requestLength = _modbus_rtu_send_msg_pre(request, requestLength);
+
+    responseLength = emi_model_answer(&model, request, requestLength - _MODBUS_RTU_CHECKSUM_LENGTH, rsp);
+    responseLength = _modbus_rtu_send_msg_pre(rsp, responseLength);
+    memcpy(response, rsp, responseLength);
+
+    emi_regcache_init(&regcache, 0);
+    emi_regcache_set_ttl(&regcache, 0x0002, 0x0006, 3600 * 1000);
+
+    for (i = 0; i < (int)sizeof(payload); i++)
+    {
+        payload[i] = i * 31;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    int first = 1, allocating = 0;
+    size_t i;
+
+    setUp();
+
+    printf("{\n  \"version\": %d,\n  \"compiler\": \"%s\",\n  \"timestamp\": %lld,\n  \"benchmarks\": [", BENCH_VERSION,
+        __VERSION__, (long long)time(NULL));
+
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        const bench_t *bench = &benchmarks[i];
+        double samples[NB_SAMPLES];
+        uint64_t iterations = 1, elapsed, allocations;
+        int s;
+
+        if (filter != NULL && strstr(bench->name, filter) == NULL)
+        {
+            continue;
+        }
+
+        /* Calibrate the number of iterations of a sample, warming up */
+        for (;;)
+        {
+            uint64_t start = nowNs();
+
+            bench->run(iterations);
+            elapsed = nowNs() - start;
+            if (elapsed >= SAMPLE_NS / 10)
+            {
+                break;
+            }
+            iterations *= 2;
+        }
+        iterations = iterations * SAMPLE_NS / (elapsed > 0 ? elapsed : 1) + 1;
+
+        /* Warmed up by the calibration */
+        allocations = emi_alloc_count();
+        for (s = 0; s < NB_SAMPLES; s++)
+        {
+            uint64_t start = nowNs();
+
+            bench->run(iterations);
+            samples[s] = (double)(nowNs() - start) / iterations;
+        }
+        allocations = emi_alloc_count() - allocations;
+        qsort(samples, NB_SAMPLES, sizeof(double), compareDouble);
+
+        printf("%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"ns_per_op_median\": %.2f, "
+               "\"allocations\": %llu}",
+            first ? "" : ",", bench->name, (unsigned long long)iterations, samples[0], samples[NB_SAMPLES / 2],
+            (unsigned long long)allocations);
+        if (allocations > 0)
+        {
+            fprintf(stderr, "%s: %llu heap allocations after warm-up\n", bench->name, (unsigned long long)allocations);
+            allocating = 1;
+        }
+        first = 0;
+        fflush(stdout);
+    }
+
+    printf("\n  ]\n}\n");
+
+    modbus_free(ctx);
+    return allocating;
+}
@@ -0,0 +1,34 @@
+#include <stddef.h>
+
+#include "emi-alloc.h"
+
+/* The C library allocators, which the interposed ones forward to (glibc) */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* Per thread, so that helper threads don't spoil the count of the poll loop */
+static __thread uint64_t allocations;
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+uint64_t emi_alloc_count(void)
+{
+    return allocations;
+}
@@ -0,0 +1,15 @@
+#ifndef EMI_ALLOC_H
+#define EMI_ALLOC_H
+
+#include <stdint.h>
+
+/* Heap allocation accounting for the steady state checks: linking emi-alloc.o
+ * interposes malloc(), calloc() and realloc() of the C library to count
+ * their calls. Only for test and benchmark builds. */
+
+/**
+ * @brief Number of heap allocations made by the calling thread so far.
+ */
+uint64_t emi_alloc_count(void);
+
+#endif
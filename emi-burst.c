@@ -0,0 +1,106 @@
+#include <math.h>
+#include <string.h>
+
+#include "emi-burst.h"
+
+void emi_stats_reset(emi_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void emi_stats_add(emi_stats_t *stats, double value)
+{
+    double delta;
+
+    if (stats->count == 0 || value < stats->min)
+    {
+        stats->min = value;
+    }
+    if (stats->count == 0 || value > stats->max)
+    {
+        stats->max = value;
+    }
+
+    stats->count++;
+    delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+}
+
+double emi_stats_stddev(const emi_stats_t *stats)
+{
+    if (stats->count < 2)
+    {
+        return 0;
+    }
+
+    return sqrt(stats->m2 / (stats->count - 1));
+}
+
+void emi_burst_channel_init(emi_burst_channel_t *channel, double low, double high, double hysteresis)
+{
+    memset(channel, 0, sizeof(*channel));
+    emi_stats_reset(&channel->stats);
+    channel->threshold.low = low;
+    channel->threshold.high = high;
+    channel->threshold.hysteresis = hysteresis;
+    channel->threshold.state = EMI_THRESHOLD_NORMAL;
+}
+
+void emi_burst_channel_reset(emi_burst_channel_t *channel)
+{
+    emi_stats_reset(&channel->stats);
+    channel->threshold.events = 0;
+}
+
+void emi_burst_channel_sample(emi_burst_channel_t *channel, int index, int64_t ts, double value,
+                              emi_threshold_handler_t handler, void *user)
+{
+    emi_threshold_t *threshold = &channel->threshold;
+
+    emi_stats_add(&channel->stats, value);
+
+    switch (threshold->state)
+    {
+    case EMI_THRESHOLD_NORMAL:
+        if (value < threshold->low || value > threshold->high)
+        {
+            threshold->state = value < threshold->low ? EMI_THRESHOLD_LOW : EMI_THRESHOLD_HIGH;
+            threshold->current.type = threshold->state;
+            threshold->current.start = ts;
+            threshold->current.extreme = value;
+            threshold->events++;
+        }
+        break;
+    case EMI_THRESHOLD_LOW:
+        if (value < threshold->current.extreme)
+        {
+            threshold->current.extreme = value;
+        }
+        if (value >= threshold->low + threshold->hysteresis)
+        {
+            threshold->state = EMI_THRESHOLD_NORMAL;
+        }
+        break;
+    case EMI_THRESHOLD_HIGH:
+        if (value > threshold->current.extreme)
+        {
+            threshold->current.extreme = value;
+        }
+        if (value <= threshold->high - threshold->hysteresis)
+        {
+            threshold->state = EMI_THRESHOLD_NORMAL;
+        }
+        break;
+    }
+
+    if (threshold->state == EMI_THRESHOLD_NORMAL && threshold->current.type != EMI_THRESHOLD_NORMAL)
+    {
+        threshold->current.duration = ts - threshold->current.start;
+        if (handler != NULL)
+        {
+            handler(index, &threshold->current, user);
+        }
+        threshold->current.type = EMI_THRESHOLD_NORMAL;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef EMI_BURST_H
+#define EMI_BURST_H
+
+#include <stdint.h>
+
+/* Running statistics over an interval, in constant memory (Welford) */
+typedef struct {
+    uint32_t count;
+    double min;
+    double max;
+    double mean;
+    double m2;
+} emi_stats_t;
+
+typedef enum {
+    EMI_THRESHOLD_NORMAL = 0,
+    /* Below the low threshold (e.g. a voltage sag) */
+    EMI_THRESHOLD_LOW,
+    /* Above the high threshold (e.g. a swell or an inrush current) */
+    EMI_THRESHOLD_HIGH
+} emi_threshold_state_t;
+
+typedef struct {
+    emi_threshold_state_t type;
+    int64_t start;
+    int64_t duration;
+    /* Lowest value of a LOW event, highest value of a HIGH event */
+    double extreme;
+} emi_threshold_event_t;
+
+typedef void (*emi_threshold_handler_t)(int channel, const emi_threshold_event_t* event, void* user);
+
+typedef struct {
+    double low;
+    double high;
+    /* A value must come back this far inside the band to end an event */
+    double hysteresis;
+    emi_threshold_state_t state;
+    emi_threshold_event_t current;
+    /* Events started since the last reset */
+    uint32_t events;
+} emi_threshold_t;
+
+typedef struct {
+    emi_stats_t stats;
+    emi_threshold_t threshold;
+} emi_burst_channel_t;
+
+void emi_stats_reset(emi_stats_t* stats);
+void emi_stats_add(emi_stats_t* stats, double value);
+double emi_stats_stddev(const emi_stats_t* stats);
+
+/**
+ * @brief Set up a channel. Use -INFINITY/INFINITY to disable a threshold.
+ */
+void emi_burst_channel_init(emi_burst_channel_t* channel, double low, double high, double hysteresis);
+
+/**
+ * @brief Account a sample, calling the handler when a threshold event ends.
+ *
+ * @param ts the sample time, in milliseconds
+ */
+void emi_burst_channel_sample(emi_burst_channel_t* channel, int index, int64_t ts, double value,
+    emi_threshold_handler_t handler, void* user);
+
+/**
+ * @brief Start a new summary interval. An event in progress carries over.
+ */
+void emi_burst_channel_reset(emi_burst_channel_t* channel);
+
+#endif
@@ -0,0 +1,52 @@
+#include <time.h>
+
+#include "emi-bus.h"
+
+static uint64_t nowUs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int higherWaiting(const emi_bus_t *bus, int priority)
+{
+    int i;
+
+    for (i = priority + 1; i < EMI_BUS_PRIORITIES; i++)
+    {
+        if (bus->waiting[i] > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t emi_bus_acquire(emi_bus_t *bus, int priority)
+{
+    uint64_t start = nowUs();
+
+    pthread_mutex_lock(&bus->lock);
+    bus->waiting[priority]++;
+    while (bus->busy || higherWaiting(bus, priority))
+    {
+        pthread_cond_wait(&bus->released, &bus->lock);
+    }
+    bus->waiting[priority]--;
+    bus->busy = 1;
+    bus->acquired[priority]++;
+    pthread_mutex_unlock(&bus->lock);
+
+    return nowUs() - start;
+}
+
+void emi_bus_release(emi_bus_t *bus)
+{
+    pthread_mutex_lock(&bus->lock);
+    bus->busy = 0;
+    /* Every waiter checks whether it is the next one */
+    pthread_cond_broadcast(&bus->released);
+    pthread_mutex_unlock(&bus->lock);
+}
@@ -0,0 +1,41 @@
+#ifndef EMI_BUS_H
+#define EMI_BUS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* Scheduler of the serial line: one user of the bus at a time, and when it
+ * releases the bus the waiting user of highest priority goes next. A user
+ * holds the bus for a single transaction or a short group of them, so a
+ * higher priority waits at most that long. */
+
+#define EMI_BUS_PRIORITIES 4
+/* The poll loop, which nothing else can starve */
+#define EMI_BUS_PRIORITY_POLL 3
+/* Local tools, see emi-query.h */
+#define EMI_BUS_PRIORITY_QUERY 1
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    int busy;
+    int waiting[EMI_BUS_PRIORITIES];
+    /* Times a user of each priority got the bus */
+    uint64_t acquired[EMI_BUS_PRIORITIES];
+} emi_bus_t;
+
+#define EMI_BUS_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, {0}, {0}}
+
+/**
+ * @brief Wait for the bus, behind the users of higher priority waiting.
+ *
+ * @return the time waited, in microseconds.
+ */
+uint64_t emi_bus_acquire(emi_bus_t* bus, int priority);
+
+/**
+ * @brief Hand the bus over to the next user.
+ */
+void emi_bus_release(emi_bus_t* bus);
+
+#endif
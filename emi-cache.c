@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "emi-cache.h"
+#include "light-modbus/light-modbus-rtu.h"
+
+static uint32_t checksum(const emi_cache_data_t *data)
+{
+    return _modbus_rtu_crc16((const uint8_t *)data, sizeof(*data));
+}
+
+emi_cache_t *emi_cache_open(const char *path)
+{
+    emi_cache_t *cache;
+    emi_cache_file_t *file;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    file = MAP_FAILED;
+    if (cache->fd != -1 && ftruncate(cache->fd, sizeof(*file)) == 0)
+    {
+        file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    }
+    if (file == MAP_FAILED)
+    {
+        int saved_errno = errno;
+        if (cache->fd != -1)
+        {
+            close(cache->fd);
+        }
+        free(cache);
+        errno = saved_errno;
+        return NULL;
+    }
+    cache->file = file;
+
+    /* A file of another size was truncated or extended, its checksum fails */
+    cache->valid = file->magic == EMI_CACHE_MAGIC && file->version == EMI_CACHE_VERSION &&
+                   file->size == sizeof(*file) && file->checksum == checksum(&file->data);
+    if (!cache->valid)
+    {
+        memset(file, 0, sizeof(*file));
+    }
+    return cache;
+}
+
+emi_cache_data_t *emi_cache_data(emi_cache_t *cache)
+{
+    return &cache->file->data;
+}
+
+void emi_cache_commit(emi_cache_t *cache)
+{
+    emi_cache_file_t *file = cache->file;
+
+    file->magic = EMI_CACHE_MAGIC;
+    file->version = EMI_CACHE_VERSION;
+    file->size = sizeof(*file);
+    file->checksum = checksum(&file->data);
+    /* A crash before the write-back leaves the previous file, or one failing
+       its checksum */
+    msync(file, sizeof(*file), MS_ASYNC);
+    cache->valid = 1;
+}
+
+void emi_cache_invalidate(emi_cache_t *cache)
+{
+    cache->file->magic = 0;
+    msync(cache->file, sizeof(*cache->file), MS_SYNC);
+    cache->valid = 0;
+}
+
+void emi_cache_close(emi_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    munmap(cache->file, sizeof(*cache->file));
+    close(cache->fd);
+    free(cache);
+}
@@ -0,0 +1,71 @@
+#ifndef EMI_CACHE_H
+#define EMI_CACHE_H
+
+#include <stdint.h>
+
+#include "emi-meter.h"
+
+/* Warm-start cache: what the daemon learned about the bus and the meter,
+ * memory-mapped from a small file so that it is saved by writing to it. The
+ * file is only trusted when its magic, version, size and checksum match, a
+ * cache from another build or half written is ignored. */
+
+#define EMI_CACHE_MAGIC 0x43494d45 /* "EMIC" */
+/* Bump when emi_cache_data_t changes */
+#define EMI_CACHE_VERSION 1
+
+typedef struct {
+    /* Bus */
+    char device[64];
+    int32_t slave;
+    int32_t baud;
+    char parity;
+    int8_t stopBit;
+    /* The meter answers multi-register reads */
+    int8_t blockRead;
+    /* Meter identity and settings, as read hourly */
+    emi_meter_t meter;
+    double currentApparentPowerThreshold;
+} emi_cache_data_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    /* CRC-16 of data */
+    uint32_t checksum;
+    emi_cache_data_t data;
+} emi_cache_file_t;
+
+typedef struct {
+    int fd;
+    emi_cache_file_t* file;
+    /* Loaded from a valid file */
+    int valid;
+} emi_cache_t;
+
+/**
+ * @brief Map the cache at path, created empty when missing.
+ *
+ * @return the cache, with valid set when it holds data, or NULL with errno set.
+ */
+emi_cache_t* emi_cache_open(const char* path);
+
+/**
+ * @brief The cached data, to read when valid and to update before a commit.
+ */
+emi_cache_data_t* emi_cache_data(emi_cache_t* cache);
+
+/**
+ * @brief Seal the data written with a checksum and schedule the write-back.
+ */
+void emi_cache_commit(emi_cache_t* cache);
+
+/**
+ * @brief Drop the cached data, the next start is a cold one.
+ */
+void emi_cache_invalidate(emi_cache_t* cache);
+
+void emi_cache_close(emi_cache_t* cache);
+
+#endif
@@ -0,0 +1,32 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "emi-decode.h"
+
+double scaleInt(int num, int scaler)
+{
+    if (scaler == 0)
+    {
+        // No effect
+        return num;
+    }
+    else
+    {
+        return num * pow(10, scaler);
+    }
+}
+
+double decodeUInt16(const uint8_t *raw, signed char scaler)
+{
+    return scaleInt(raw[0] << 8 | raw[1], scaler);
+}
+
+double decodeUInt32(const uint8_t *raw, signed char scaler)
+{
+    return scaleInt((uint32_t)raw[0] << 24 | raw[1] << 16 | raw[2] << 8 | raw[3], scaler);
+}
+
+int formatDouble(char *str, size_t size, double n, uint8_t decimals)
+{
+    return snprintf(str, size, "%.*f", decimals, n);
+}
@@ -0,0 +1,25 @@
+#ifndef EMI_DECODE_H
+#define EMI_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Decoding and formatting of the register values, kept apart from the MQTT
+ * and Modbus I/O so that they can be benchmarked on their own */
+
+double scaleInt(int num, int scaler);
+
+/**
+ * @brief Decode a big endian register value and apply its scaler (* 10 ^ {scaler}).
+ */
+double decodeUInt16(const uint8_t* raw, signed char scaler);
+double decodeUInt32(const uint8_t* raw, signed char scaler);
+
+/**
+ * @brief Format a value for publishing, with the given number of decimals.
+ *
+ * @return the length of the string, as snprintf.
+ */
+int formatDouble(char* str, size_t size, double n, uint8_t decimals);
+
+#endif
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emi-discover.h"
+#include "light-modbus/light-modbus-rtu.h"
+
+#define DEVICE_ID_REGISTER 0x0002
+#define DEVICE_ID_SIZE 10
+
+/* Time a meter takes to start answering, on top of the frames */
+#define DISCOVER_TURNAROUND_US 20000
+
+typedef struct
+{
+    emi_line_t line;
+    int first;
+    int last;
+    emi_discover_callback_t callback;
+    void *user;
+    pthread_mutex_t *lock;
+    int started;
+    int found;
+} bus_t;
+
+static void *sweepBus(void *arg)
+{
+    bus_t *bus = arg;
+    emi_discovered_t meter;
+    modbus_t *ctx;
+    int onebyte, timeout;
+
+    ctx = modbus_new_rtu(bus->line.device, bus->line.baud, bus->line.parity, 8, bus->line.stop_bit);
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+    if (modbus_connect(ctx) == -1)
+    {
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    /* A missing meter costs the response timeout: the request, the response
+       and the turnaround, no more. RS-485 is half-duplex, one request is in
+       flight per bus. */
+    onebyte = 1000000 * (1 + 8 + (bus->line.parity == 'N' ? 0 : 1) + bus->line.stop_bit) / bus->line.baud;
+    timeout = (8 + 5 + DEVICE_ID_SIZE) * onebyte + DISCOVER_TURNAROUND_US;
+    modbus_set_response_timeout(ctx, timeout / 1000000, timeout % 1000000);
+    modbus_set_byte_timeout(ctx, 0, 4 * onebyte + 10000);
+
+    meter.device = bus->line.device;
+    for (meter.slave = bus->first; meter.slave <= bus->last; meter.slave++)
+    {
+        modbus_set_slave(ctx, meter.slave);
+        if (getOctetString(ctx, DEVICE_ID_REGISTER, DEVICE_ID_SIZE, meter.deviceId) == 1)
+        {
+            bus->found++;
+            pthread_mutex_lock(bus->lock);
+            bus->callback(&meter, bus->user);
+            pthread_mutex_unlock(bus->lock);
+        }
+        else
+        {
+            /* A late answer must not be taken for the next slave's */
+            modbus_flush(ctx);
+        }
+    }
+
+    modbus_close(ctx);
+    modbus_free(ctx);
+    return NULL;
+}
+
+int emi_discover(const char *const *patterns,
+                 int nbPatterns,
+                 const emi_line_t *line,
+                 int first,
+                 int last,
+                 emi_discover_callback_t callback,
+                 void *user)
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    glob_t devices;
+    pthread_t *threads;
+    bus_t *buses;
+    int found = 0;
+    size_t i;
+
+    if (first < 1 || last > 247 || first > last)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&devices, 0, sizeof(devices));
+    for (i = 0; i < (size_t)nbPatterns; i++)
+    {
+        glob(patterns[i], i == 0 ? 0 : GLOB_APPEND, NULL, &devices);
+    }
+    if (devices.gl_pathc == 0)
+    {
+        globfree(&devices);
+        errno = ENOENT;
+        return -1;
+    }
+
+    threads = calloc(devices.gl_pathc, sizeof(*threads));
+    buses = calloc(devices.gl_pathc, sizeof(*buses));
+    if (threads == NULL || buses == NULL)
+    {
+        free(threads);
+        free(buses);
+        globfree(&devices);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < devices.gl_pathc; i++)
+    {
+        buses[i].line = *line;
+        buses[i].line.device = devices.gl_pathv[i];
+        buses[i].first = first;
+        buses[i].last = last;
+        buses[i].callback = callback;
+        buses[i].user = user;
+        buses[i].lock = &lock;
+        buses[i].started = pthread_create(&threads[i], NULL, sweepBus, &buses[i]) == 0;
+        if (!buses[i].started)
+        {
+            sweepBus(&buses[i]);
+        }
+    }
+
+    for (i = 0; i < devices.gl_pathc; i++)
+    {
+        if (buses[i].started)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        found += buses[i].found;
+    }
+
+    free(threads);
+    free(buses);
+    globfree(&devices);
+    return found;
+}
@@ -0,0 +1,40 @@
+#ifndef EMI_DISCOVER_H
+#define EMI_DISCOVER_H
+
+#include "emi-meter.h"
+#include "emi-probe.h"
+
+/* Commissioning: finding the meters on every serial port at once. Each bus is
+ * swept by its own thread, reading the device id of each slave address with a
+ * timeout just long enough for the frames, since a missing meter costs the
+ * whole timeout. */
+
+/* Ports scanned by default */
+#define EMI_DISCOVER_DEVICES "/dev/ttyUSB*", "/dev/ttyACM*"
+
+typedef struct {
+    const char* device;
+    int slave;
+    /* Device id 1 (0x0002) */
+    char deviceId[EMI_OCTET_STRING_MAX_LENGTH + 1];
+} emi_discovered_t;
+
+/* Called for each meter found, from one bus thread at a time */
+typedef void (*emi_discover_callback_t)(const emi_discovered_t* meter, void* user);
+
+/**
+ * @brief Sweep slaves first to last on every device matching the glob patterns,
+ * all buses in parallel, at the baud rate and framing of line.
+ *
+ * @return the number of meters found, or -1 with errno set when no device
+ * matches (ENOENT).
+ */
+int emi_discover(const char* const* patterns,
+    int nbPatterns,
+    const emi_line_t* line,
+    int first,
+    int last,
+    emi_discover_callback_t callback,
+    void* user);
+
+#endif
@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "emi-gateway.h"
+#include "emi-net.h"
+
+/* Slave address and CRC around the PDU of an RTU response */
+#define RTU_FRAMING_LENGTH 3
+
+/* Only the serving thread closes connections, under the lock as the worker
+   may be replying */
+static void closeClient(emi_gateway_t *gateway, int client)
+{
+    pthread_mutex_lock(&gateway->lock);
+    close(gateway->clients[client].fd);
+    gateway->clients[client].fd = -1;
+    gateway->clients[client].generation++;
+    pthread_mutex_unlock(&gateway->lock);
+}
+
+static void reply(emi_gateway_t *gateway, int client, uint32_t generation, uint16_t transaction, uint8_t unit,
+                  const uint8_t *pdu, int pduLength)
+{
+    uint8_t frame[EMI_GATEWAY_MBAP_LENGTH + EMI_GATEWAY_MAX_PDU];
+    emi_gateway_client_t *c = &gateway->clients[client];
+
+    frame[0] = transaction >> 8;
+    frame[1] = transaction & 0xFF;
+    /* Protocol identifier, Modbus */
+    frame[2] = 0;
+    frame[3] = 0;
+    frame[4] = (pduLength + 1) >> 8;
+    frame[5] = (pduLength + 1) & 0xFF;
+    frame[6] = unit;
+    memcpy(frame + EMI_GATEWAY_MBAP_LENGTH, pdu, pduLength);
+
+    pthread_mutex_lock(&gateway->lock);
+    /* A client that doesn't read its responses is hung up on, and closed by
+       the serving thread */
+    if (c->fd != -1 && c->generation == generation &&
+        send(c->fd, frame, EMI_GATEWAY_MBAP_LENGTH + pduLength, MSG_NOSIGNAL | MSG_DONTWAIT) == -1)
+    {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&gateway->lock);
+}
+
+static void replyException(emi_gateway_t *gateway, const emi_gateway_request_t *request, int code)
+{
+    uint8_t pdu[2];
+
+    pdu[0] = request->pdu[0] | 0x80;
+    pdu[1] = code;
+    reply(gateway, request->client, request->generation, request->transaction, request->unit, pdu, 2);
+}
+
+/* The response built from the cache, each register padded to 16 bits as the
+   meter sends it */
+static int replyFromCache(emi_gateway_t *gateway, const emi_gateway_request_t *request)
+{
+    uint8_t value[EMI_REGCACHE_MAX_VALUE];
+    uint8_t pdu[EMI_GATEWAY_MAX_PDU];
+    int addr = request->pdu[1] << 8 | request->pdu[2];
+    int nb = request->pdu[3] << 8 | request->pdu[4];
+    int paddedSize, i;
+    uint8_t size;
+
+    if (emi_regcache_peek(gateway->cache, request->unit, addr, nb, gateway->max_age_ms, value, &size) == -1)
+    {
+        return 0;
+    }
+    paddedSize = size + size % 2;
+    if (2 + nb * paddedSize > EMI_GATEWAY_MAX_PDU)
+    {
+        return 0;
+    }
+
+    pdu[0] = MODBUS_FC_READ_INPUT_REGISTERS;
+    pdu[1] = nb * paddedSize;
+    for (i = 0; i < nb; i++)
+    {
+        memcpy(pdu + 2 + i * paddedSize, value + i * size, size);
+        if (paddedSize != size)
+        {
+            pdu[2 + i * paddedSize + size] = 0;
+        }
+    }
+    reply(gateway, request->client, request->generation, request->transaction, request->unit, pdu,
+          2 + nb * paddedSize);
+    return 1;
+}
+
+static void forward(emi_gateway_t *gateway, const emi_gateway_request_t *request)
+{
+    uint8_t req[1 + EMI_GATEWAY_MAX_PDU];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int previous, rc;
+
+    req[0] = request->unit;
+    memcpy(req + 1, request->pdu, request->pdu_length);
+
+    emi_rt_enter(&gateway->rt);
+    emi_metrics_observe(&gateway->counters->bus_wait, emi_bus_acquire(gateway->bus, gateway->priority));
+    previous = modbus_get_slave(gateway->ctx);
+    modbus_set_slave(gateway->ctx, request->unit);
+    rc = modbus_send_raw_request(gateway->ctx, req, 1 + request->pdu_length);
+    if (rc != -1)
+    {
+        rc = modbus_receive_confirmation(gateway->ctx, rsp);
+    }
+    modbus_set_slave(gateway->ctx, previous);
+    emi_bus_release(gateway->bus);
+    emi_rt_leave(&gateway->rt);
+
+    gateway->forwarded++;
+    if (rc == -1 || rc <= RTU_FRAMING_LENGTH || (rsp[1] & 0x7F) != request->pdu[0])
+    {
+        replyException(gateway, request, MODBUS_EXCEPTION_GATEWAY_TARGET);
+        return;
+    }
+    /* The response of the meter as it is, exceptions included */
+    reply(gateway, request->client, request->generation, request->transaction, request->unit, rsp + 1,
+          rc - RTU_FRAMING_LENGTH);
+}
+
+static void *work(void *arg)
+{
+    emi_gateway_t *gateway = arg;
+    emi_gateway_request_t request;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&gateway->lock);
+        while (gateway->nb_queued == 0)
+        {
+            pthread_cond_wait(&gateway->queued, &gateway->lock);
+        }
+        request = gateway->queue[gateway->head];
+        gateway->head = (gateway->head + 1) % EMI_GATEWAY_QUEUE;
+        gateway->nb_queued--;
+        pthread_mutex_unlock(&gateway->lock);
+
+        forward(gateway, &request);
+    }
+
+    return NULL;
+}
+
+/* Answer a request at once, or queue it for the bus */
+static void handleRequest(emi_gateway_t *gateway, int client, const uint8_t *frame, int length)
+{
+    emi_gateway_request_t request;
+    int queued = 0;
+
+    request.client = client;
+    request.generation = gateway->clients[client].generation;
+    request.transaction = frame[0] << 8 | frame[1];
+    request.unit = frame[6];
+    request.pdu_length = length - EMI_GATEWAY_MBAP_LENGTH;
+    memcpy(request.pdu, frame + EMI_GATEWAY_MBAP_LENGTH, request.pdu_length);
+
+    if (request.pdu[0] != MODBUS_FC_READ_INPUT_REGISTERS)
+    {
+        replyException(gateway, &request, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+        return;
+    }
+    if (request.pdu_length != 5 || (request.pdu[3] == 0 && request.pdu[4] == 0))
+    {
+        replyException(gateway, &request, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+        return;
+    }
+    if (request.unit < 1 || request.unit > 247)
+    {
+        replyException(gateway, &request, MODBUS_EXCEPTION_GATEWAY_PATH);
+        return;
+    }
+    if (gateway->cache != NULL && replyFromCache(gateway, &request))
+    {
+        gateway->cached++;
+        return;
+    }
+
+    pthread_mutex_lock(&gateway->lock);
+    if (gateway->nb_queued < EMI_GATEWAY_QUEUE)
+    {
+        gateway->queue[(gateway->head + gateway->nb_queued) % EMI_GATEWAY_QUEUE] = request;
+        gateway->nb_queued++;
+        pthread_cond_signal(&gateway->queued);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&gateway->lock);
+
+    if (!queued)
+    {
+        gateway->busy++;
+        replyException(gateway, &request, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    }
+}
+
+static void receive(emi_gateway_t *gateway, int client)
+{
+    emi_gateway_client_t *c = &gateway->clients[client];
+    int length;
+    ssize_t n;
+
+    n = recv(c->fd, c->frame + c->length, sizeof(c->frame) - c->length, MSG_DONTWAIT);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            closeClient(gateway, client);
+        }
+        return;
+    }
+    c->length += n;
+
+    while (c->length >= EMI_GATEWAY_MBAP_LENGTH)
+    {
+        /* Length field: the unit identifier and the PDU */
+        length = 6 + (c->frame[4] << 8 | c->frame[5]);
+        if (c->frame[2] != 0 || c->frame[3] != 0 || length < EMI_GATEWAY_MBAP_LENGTH + 1 ||
+            length > (int)sizeof(c->frame))
+        {
+            /* Not Modbus, no way to find the next frame */
+            closeClient(gateway, client);
+            return;
+        }
+        if (c->length < length)
+        {
+            break;
+        }
+        handleRequest(gateway, client, c->frame, length);
+        c->length -= length;
+        memmove(c->frame, c->frame + length, c->length);
+    }
+}
+
+static void acceptClient(emi_gateway_t *gateway)
+{
+    int fd, i;
+
+    fd = accept(gateway->listen_fd, NULL, NULL);
+    if (fd == -1)
+    {
+        return;
+    }
+    for (i = 0; i < EMI_GATEWAY_MAX_CLIENTS; i++)
+    {
+        if (gateway->clients[i].fd == -1)
+        {
+            gateway->clients[i].fd = fd;
+            gateway->clients[i].length = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void *serve(void *arg)
+{
+    emi_gateway_t *gateway = arg;
+    struct pollfd fds[1 + EMI_GATEWAY_MAX_CLIENTS];
+    int i;
+
+    for (;;)
+    {
+        fds[0].fd = gateway->listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < EMI_GATEWAY_MAX_CLIENTS; i++)
+        {
+            fds[1 + i].fd = gateway->clients[i].fd;
+            fds[1 + i].events = POLLIN;
+        }
+
+        if (poll(fds, 1 + EMI_GATEWAY_MAX_CLIENTS, -1) == -1 && errno != EINTR)
+        {
+            fprintf(stderr, "gateway: poll failed: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            acceptClient(gateway);
+        }
+
+        for (i = 0; i < EMI_GATEWAY_MAX_CLIENTS; i++)
+        {
+            if (gateway->clients[i].fd != -1 && (fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                receive(gateway, i);
+            }
+        }
+    }
+}
+
+int emi_gateway_start(emi_gateway_t *gateway, const char *address, modbus_t *ctx, emi_bus_t *bus, int priority,
+                      const emi_rt_t *rt, emi_metrics_counters_t *counters, emi_regcache_t *cache,
+                      uint32_t max_age_ms)
+{
+    int rc, i;
+
+    if (priority < 0 || priority >= EMI_BUS_PRIORITY_POLL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(gateway, 0, sizeof(*gateway));
+    gateway->ctx = ctx;
+    gateway->bus = bus;
+    gateway->priority = priority;
+    gateway->counters = counters;
+    /* A copy, as it keeps the scheduling to restore of its thread */
+    gateway->rt.priority = rt != NULL ? rt->priority : 0;
+    gateway->rt.cpu = rt != NULL ? rt->cpu : -1;
+    gateway->cache = cache;
+    gateway->max_age_ms = max_age_ms;
+    pthread_mutex_init(&gateway->lock, NULL);
+    pthread_cond_init(&gateway->queued, NULL);
+    for (i = 0; i < EMI_GATEWAY_MAX_CLIENTS; i++)
+    {
+        gateway->clients[i].fd = -1;
+    }
+
+    gateway->listen_fd = emi_listen(address);
+    if (gateway->listen_fd == -1)
+    {
+        return -1;
+    }
+
+    rc = pthread_create(&gateway->worker, NULL, work, gateway);
+    if (rc == 0)
+    {
+        rc = pthread_create(&gateway->thread, NULL, serve, gateway);
+        if (rc != 0)
+        {
+            pthread_cancel(gateway->worker);
+            pthread_join(gateway->worker, NULL);
+        }
+    }
+    if (rc != 0)
+    {
+        close(gateway->listen_fd);
+        gateway->listen_fd = -1;
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef EMI_GATEWAY_H
+#define EMI_GATEWAY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "emi-bus.h"
+#include "emi-metrics.h"
+#include "emi-regcache.h"
+#include "emi-rt.h"
+#include "light-modbus/light-modbus.h"
+
+/* Modbus TCP server in front of the RTU bus, so that SCADA tools reach the
+ * meters while emi-read keeps the serial port. The requests of every client
+ * are queued and forwarded one at a time, at the priority given on the bus
+ * scheduler, and their responses relayed as they are. A read of registers
+ * that went through the register cache less than max_age_ms ago is answered
+ * from it, without a bus transaction.
+ *
+ * Only function 4 (read input registers) is forwarded, the one the meters
+ * answer. The unit identifier is the slave address. */
+
+#define EMI_GATEWAY_MAX_CLIENTS 32
+#define EMI_GATEWAY_QUEUE 64
+/* MBAP header, unit identifier included */
+#define EMI_GATEWAY_MBAP_LENGTH 7
+#define EMI_GATEWAY_MAX_PDU 253
+
+typedef struct {
+    int fd;
+    /* Tells the connection from a later one reusing the slot */
+    uint32_t generation;
+    uint8_t frame[EMI_GATEWAY_MBAP_LENGTH + EMI_GATEWAY_MAX_PDU];
+    int length;
+} emi_gateway_client_t;
+
+typedef struct {
+    int client;
+    uint32_t generation;
+    uint16_t transaction;
+    uint8_t unit;
+    uint8_t pdu[EMI_GATEWAY_MAX_PDU];
+    int pdu_length;
+} emi_gateway_request_t;
+
+typedef struct {
+    modbus_t* ctx;
+    emi_bus_t* bus;
+    int priority;
+    /* The real-time mode of the poll loop, held as long as the bus so that
+       the poll doesn't wait on a descheduled thread */
+    emi_rt_t rt;
+    /* Block of the worker thread, its waits for the bus */
+    emi_metrics_counters_t* counters;
+    /* NULL for every read to go to the bus */
+    emi_regcache_t* cache;
+    uint32_t max_age_ms;
+    int listen_fd;
+    /* One thread serves the connections, another makes the bus transactions */
+    pthread_t thread;
+    pthread_t worker;
+    /* Guards the queue and the replies sent by both threads */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    emi_gateway_client_t clients[EMI_GATEWAY_MAX_CLIENTS];
+    emi_gateway_request_t queue[EMI_GATEWAY_QUEUE];
+    int head;
+    int nb_queued;
+    /* Requests answered from the cache, forwarded to the bus, and refused as
+       the queue was full */
+    uint64_t cached;
+    uint64_t forwarded;
+    uint64_t busy;
+} emi_gateway_t;
+
+/**
+ * @brief Serve Modbus TCP on address ("host:port", or ":port" for
+ * localhost), forwarding to the bus of ctx at priority (below
+ * EMI_BUS_PRIORITY_POLL), under the scheduling of rt (initialised, or NULL
+ * for none). The slave set on ctx is restored after each transaction. The
+ * waits for the bus go to counters, registered for the worker thread.
+ */
+int emi_gateway_start(emi_gateway_t* gateway, const char* address, modbus_t* ctx, emi_bus_t* bus, int priority,
+                      const emi_rt_t* rt, emi_metrics_counters_t* counters, emi_regcache_t* cache,
+                      uint32_t max_age_ms);
+
+#endif
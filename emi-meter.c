@@ -0,0 +1,134 @@
+#include <byteswap.h>
+#include <string.h>
+
+#include "emi-decode.h"
+#include "emi-meter.h"
+
+/* Reads go through it when set */
+static emi_regcache_t *regcache = NULL;
+
+static int readRegisters(modbus_t *ctx, uint16_t registerAddress, int nb, uint8_t size, void *dest)
+{
+    if (regcache != NULL)
+    {
+        return emi_regcache_read(regcache, ctx, registerAddress, nb, size, dest);
+    }
+    return modbus_read_input_registers(ctx, registerAddress, nb, size, dest);
+}
+
+void emi_meter_use_regcache(emi_regcache_t *cache)
+{
+    regcache = cache;
+}
+
+int getOctetString(modbus_t *ctx, uint16_t registerAddress, uint8_t nb, char *string)
+{
+    int rc = readRegisters(ctx, registerAddress, 1, nb, string);
+
+    string[nb] = 0; // set string terminator
+    if (rc != 1)
+    {
+        string[0] = '\0';
+    }
+
+    return rc;
+}
+
+int getDoubleFromUInt16(modbus_t *ctx, uint16_t registerAddress, signed char scaler, double *res)
+{
+    uint8_t buffer[2];
+    int rc = readRegisters(ctx, registerAddress, 1, 2, buffer);
+    *res = decodeUInt16(buffer, scaler);
+    return rc;
+}
+
+int getDoubleFromUInt32(modbus_t *ctx, uint16_t registerAddress, signed char scaler, double *res)
+{
+    uint8_t buffer[4];
+    int rc = readRegisters(ctx, registerAddress, 1, 4, buffer);
+    *res = decodeUInt32(buffer, scaler);
+    return rc;
+}
+
+int getTime(modbus_t *ctx, emi_clock_t *emiClock)
+{
+    int rc = readRegisters(ctx, 0x0001, 1, sizeof(emi_clock_t), emiClock);
+    if (rc == 1)
+    {
+        emiClock->year = __bswap_16(emiClock->year);
+        emiClock->deviation = __bswap_16(emiClock->deviation);
+    }
+    return rc;
+}
+
+static void decodeValue(emi_value_t *value)
+{
+    value->value = value->size == 2 ? decodeUInt16(value->raw, value->scaler) : decodeUInt32(value->raw, value->scaler);
+}
+
+int readValues(modbus_t *ctx, emi_value_t *values, int nb)
+{
+    int read = 0;
+    int i;
+
+    for (i = 0; i < nb; i++)
+    {
+        emi_value_t *value = &values[i];
+        if (readRegisters(ctx, value->registerAddress, 1, value->size, value->raw) != 1)
+        {
+            continue;
+        }
+        decodeValue(value);
+        read++;
+    }
+
+    return read;
+}
+
+static int findValue(const emi_value_t *values, int nb, int registerAddress)
+{
+    int i;
+
+    for (i = 0; i < nb; i++)
+    {
+        if (values[i].registerAddress == registerAddress)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int readSniffedValues(const uint8_t *req, const uint8_t *rsp, int rspLength, emi_value_t *values, int nb, uint8_t *seen)
+{
+    int address = req[2] << 8 | req[3];
+    int count = req[4] << 8 | req[5];
+    const uint8_t *data = rsp + 3;
+    const uint8_t *end = rsp + rspLength - 2;
+    int updated = 0;
+    int r, i;
+
+    /* Exceptions aren't values */
+    if (req[1] != MODBUS_FC_READ_INPUT_REGISTERS || rsp[1] != MODBUS_FC_READ_INPUT_REGISTERS)
+    {
+        return 0;
+    }
+
+    for (r = 0; r < count; r++)
+    {
+        i = findValue(values, nb, address + r);
+        /* The size of a register that isn't a value is unknown, nor where the
+           next one starts */
+        if (i == -1 || data + values[i].size > end)
+        {
+            break;
+        }
+        memcpy(values[i].raw, data, values[i].size);
+        decodeValue(&values[i]);
+        seen[i] = 1;
+        updated++;
+        data += values[i].size + values[i].size % 2;
+    }
+
+    return updated;
+}
@@ -0,0 +1,114 @@
+#ifndef EMI_METER_H
+#define EMI_METER_H
+
+#include <stdint.h>
+
+#include "emi-regcache.h"
+#include "light-modbus/light-modbus.h"
+
+/* Reading the registers of a meter, without MQTT. Nothing here allocates:
+ * values go to buffers owned by the caller, reused from a cycle to the next. */
+
+typedef struct __attribute__ ((__packed__)) {
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t weekday;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+    uint8_t hundredthOfSecond;
+    uint16_t deviation;
+    uint8_t clockStatus;
+} emi_clock_t;
+
+/* A value polled from the meter and published on its own topic */
+typedef struct {
+    const char* topic;
+    uint16_t registerAddress;
+    /* 2 or 4 bytes */
+    uint8_t size;
+    signed char scaler;
+    uint8_t decimals;
+    /* Cumulative counter (energy registers) */
+    uint8_t counter;
+    /* Last value read, and its registers as received */
+    double value;
+    uint8_t raw[4];
+} emi_value_t;
+
+/* Longest octet string register (device id 1) */
+#define EMI_OCTET_STRING_MAX_LENGTH 10
+
+/* What is read from a meter besides the instant values */
+typedef struct {
+    emi_clock_t clock;
+    double currentlyActiveTariff;
+    char activityCalendarActiveName[EMI_OCTET_STRING_MAX_LENGTH + 1];
+    char deviceId1[EMI_OCTET_STRING_MAX_LENGTH + 1];
+    char deviceId2[EMI_OCTET_STRING_MAX_LENGTH + 1];
+    char activeCoreFirmwareId[EMI_OCTET_STRING_MAX_LENGTH + 1];
+    char activeAppFirmwareId[EMI_OCTET_STRING_MAX_LENGTH + 1];
+    char activeComFirmwareId[EMI_OCTET_STRING_MAX_LENGTH + 1];
+} emi_meter_t;
+
+/**
+ * @brief Read the registers through cache from now on, NULL to read the bus
+ * directly.
+ */
+void emi_meter_use_regcache(emi_regcache_t* cache);
+
+/**
+ * @brief Read an octet string register into string, nb + 1 bytes, left empty
+ * when the read fails.
+ *
+ * @return the return value from the inner modbus_read_input_registers call.
+ */
+int getOctetString(modbus_t* ctx, uint16_t registerAddress, uint8_t nb, char* string);
+
+/**
+ * @brief Get the Double From U Int16 object
+ *
+ * @param ctx the modbus context.
+ * @param registerAddress the register address to read from
+ * @param scaller the scaller to apply (* 10 ^ {scaller})
+ * @param res the palce to store the result
+ * @return the return value from the inner modbus_read_input_registers call.
+ */
+int getDoubleFromUInt16(modbus_t* ctx, uint16_t registerAddress, signed char scaller, double* res);
+
+/**
+ * @brief Get the Double From U Int32 object
+ *
+ * @param ctx the modbus context.
+ * @param registerAddress the register address to read from
+ * @param scaller the scaller to apply (* 10 ^ {scaller})
+ * @param res the palce to store the result
+ * @return the return value from the inner modbus_read_input_registers call.
+ */
+int getDoubleFromUInt32(modbus_t* ctx, uint16_t registerAddress, signed char scaler, double* res);
+
+/**
+ * @brief Read the clock of the meter, in host byte order.
+ *
+ * @return the return value from the inner modbus_read_input_registers call.
+ */
+int getTime(modbus_t* ctx, emi_clock_t* emiClock);
+
+/**
+ * @brief Read nb values into their value field.
+ *
+ * @return the number of values read successfully.
+ */
+int readValues(modbus_t* ctx, emi_value_t* values, int nb);
+
+/**
+ * @brief Update the values read by a transaction of another master, seen on
+ * the line (see light-modbus-sniff.h), and set their seen flag. A block read
+ * is split with the sizes of values, up to the first register not among them.
+ *
+ * @return the number of values updated.
+ */
+int readSniffedValues(const uint8_t* req, const uint8_t* rsp, int rspLength, emi_value_t* values, int nb, uint8_t* seen);
+
+#endif
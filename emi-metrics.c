@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "emi-metrics.h"
+#include "emi-net.h"
+
+#define REQUEST_MAX_LENGTH 2048
+
+/* Scrapes run one at a time on the listener thread */
+static modbus_stats_t busStats;
+
+void emi_metrics_init(emi_metrics_t *metrics, modbus_t *ctx)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->ctx = ctx;
+    metrics->listen_fd = -1;
+}
+
+emi_metrics_counters_t *emi_metrics_register(emi_metrics_t *metrics, const char *thread)
+{
+    emi_metrics_counters_t *counters;
+
+    if (metrics->nb_threads == EMI_METRICS_MAX_THREADS)
+    {
+        return NULL;
+    }
+
+    counters = &metrics->threads[metrics->nb_threads++];
+    counters->thread = thread;
+    return counters;
+}
+
+int emi_metrics_add_gauge(emi_metrics_t *metrics, const char *name, const char *help,
+                          emi_metrics_gauge_t read, void *user)
+{
+    emi_metrics_gauge_entry_t *gauge;
+
+    if (metrics->nb_gauges == EMI_METRICS_MAX_GAUGES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    gauge = &metrics->gauges[metrics->nb_gauges++];
+    gauge->name = name;
+    gauge->help = help;
+    gauge->read = read;
+    gauge->user = user;
+    return 0;
+}
+
+void emi_metrics_observe(modbus_histogram_t *histogram, uint64_t duration_us)
+{
+    int bucket = duration_us == 0 ? 0 : 64 - __builtin_clzll(duration_us);
+
+    if (bucket >= MODBUS_STATS_LATENCY_BUCKETS)
+    {
+        bucket = MODBUS_STATS_LATENCY_BUCKETS - 1;
+    }
+
+    emi_metrics_add(histogram->count, 1);
+    emi_metrics_add(histogram->sum_us, duration_us);
+    emi_metrics_add(histogram->sum_sq_us, duration_us * duration_us);
+    if (duration_us > histogram->max_us)
+    {
+        __atomic_store_n(&histogram->max_us, duration_us, __ATOMIC_RELAXED);
+    }
+    emi_metrics_add(histogram->buckets[bucket], 1);
+}
+
+double emi_metrics_jitter_us(const modbus_histogram_t *histogram)
+{
+    double mean, variance;
+
+    if (histogram->count < 2)
+    {
+        return 0;
+    }
+
+    mean = (double)histogram->sum_us / histogram->count;
+    variance = (double)histogram->sum_sq_us / histogram->count - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+static void write_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Writes the series of a histogram, without the HELP/TYPE header. labels is
+ * either empty or a list like `slave="1"`. */
+static void write_histogram(FILE *out, const char *name, const char *labels, const modbus_histogram_t *histogram)
+{
+    uint64_t cumulated = 0;
+    int i;
+
+    for (i = 0; i < MODBUS_STATS_LATENCY_BUCKETS - 1; i++)
+    {
+        cumulated += histogram->buckets[i];
+        /* Bucket i holds durations below 2^i us */
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, *labels ? "," : "",
+                (double)(1ULL << i) / 1e6, (unsigned long long)cumulated);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, *labels ? "," : "",
+            (unsigned long long)histogram->count);
+    if (*labels)
+    {
+        fprintf(out, "%s_sum{%s} %g\n", name, labels, histogram->sum_us / 1e6);
+        fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)histogram->count);
+    }
+    else
+    {
+        fprintf(out, "%s_sum %g\n", name, histogram->sum_us / 1e6);
+        fprintf(out, "%s_count %llu\n", name, (unsigned long long)histogram->count);
+    }
+}
+
+static void load_histogram(modbus_histogram_t *dest, modbus_histogram_t *src)
+{
+    uint64_t max_us;
+    int i;
+
+    dest->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dest->sum_us += __atomic_load_n(&src->sum_us, __ATOMIC_RELAXED);
+    dest->sum_sq_us += __atomic_load_n(&src->sum_sq_us, __ATOMIC_RELAXED);
+    max_us = __atomic_load_n(&src->max_us, __ATOMIC_RELAXED);
+    if (max_us > dest->max_us)
+    {
+        dest->max_us = max_us;
+    }
+    for (i = 0; i < MODBUS_STATS_LATENCY_BUCKETS; i++)
+    {
+        dest->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value)
+{
+    write_header(out, name, "counter", help);
+    fprintf(out, "%s %llu\n", name, (unsigned long long)value);
+}
+
+static void write_daemon_metrics(emi_metrics_t *metrics, FILE *out)
+{
+    emi_metrics_counters_t total;
+    char labels[48];
+    int i;
+
+    /* Sum the per-thread blocks */
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < metrics->nb_threads; i++)
+    {
+        emi_metrics_counters_t *counters = &metrics->threads[i];
+
+        total.cycles += __atomic_load_n(&counters->cycles, __ATOMIC_RELAXED);
+        total.samples_read += __atomic_load_n(&counters->samples_read, __ATOMIC_RELAXED);
+        total.samples_dropped += __atomic_load_n(&counters->samples_dropped, __ATOMIC_RELAXED);
+        total.publishes += __atomic_load_n(&counters->publishes, __ATOMIC_RELAXED);
+        total.publish_errors += __atomic_load_n(&counters->publish_errors, __ATOMIC_RELAXED);
+        load_histogram(&total.cycle_duration, &counters->cycle_duration);
+        load_histogram(&total.publish_latency, &counters->publish_latency);
+    }
+
+    write_counter(out, "emi_cycles_total", "Poll cycles run.", total.cycles);
+    write_counter(out, "emi_samples_read_total", "Values read from the meter.", total.samples_read);
+    write_counter(out, "emi_samples_dropped_total", "Values not published because a read of their cycle failed.",
+                  total.samples_dropped);
+    write_counter(out, "emi_publish_total", "MQTT messages published.", total.publishes);
+    write_counter(out, "emi_publish_errors_total", "MQTT publishes that failed.", total.publish_errors);
+    write_header(out, "emi_cycle_duration_seconds", "histogram", "Duration of a poll cycle.");
+    write_histogram(out, "emi_cycle_duration_seconds", "", &total.cycle_duration);
+    write_header(out, "emi_publish_latency_seconds", "histogram", "Duration of an MQTT publish call.");
+    write_histogram(out, "emi_publish_latency_seconds", "", &total.publish_latency);
+
+    /* Not summed, the contention shows between the users of the bus */
+    write_header(out, "emi_bus_wait_seconds", "histogram", "Time waited for the bus, by thread.");
+    for (i = 0; i < metrics->nb_threads; i++)
+    {
+        modbus_histogram_t wait;
+
+        memset(&wait, 0, sizeof(wait));
+        load_histogram(&wait, &metrics->threads[i].bus_wait);
+        snprintf(labels, sizeof(labels), "thread=\"%s\"", metrics->threads[i].thread);
+        write_histogram(out, "emi_bus_wait_seconds", labels, &wait);
+    }
+
+    for (i = 0; i < metrics->nb_gauges; i++)
+    {
+        emi_metrics_gauge_entry_t *gauge = &metrics->gauges[i];
+
+        write_header(out, gauge->name, "gauge", gauge->help);
+        fprintf(out, "%s %g\n", gauge->name, gauge->read(gauge->user));
+    }
+}
+
+static void write_bus_metrics(emi_metrics_t *metrics, FILE *out)
+{
+    char labels[32];
+    int i;
+
+    if (metrics->ctx == NULL || modbus_get_stats(metrics->ctx, &busStats) == -1)
+    {
+        return;
+    }
+
+    write_counter(out, "modbus_requests_total", "Transactions started.", busStats.requests);
+    write_header(out, "modbus_bytes_total", "counter", "Bytes written to and read from the bus.");
+    fprintf(out, "modbus_bytes_total{direction=\"tx\"} %llu\n", (unsigned long long)busStats.bytes_tx);
+    fprintf(out, "modbus_bytes_total{direction=\"rx\"} %llu\n", (unsigned long long)busStats.bytes_rx);
+    write_counter(out, "modbus_crc_errors_total", "Responses with an invalid CRC.", busStats.crc_errors);
+    write_counter(out, "modbus_timeouts_total", "Responses not received in time.", busStats.timeouts);
+    write_counter(out, "modbus_bad_responses_total", "Responses not matching their request.", busStats.bad_data);
+    write_header(out, "modbus_exceptions_total", "counter", "Exception responses, by exception code.");
+    for (i = 1; i < MODBUS_STATS_MAX_EXCEPTION; i++)
+    {
+        fprintf(out, "modbus_exceptions_total{code=\"%d\"} %llu\n", i, (unsigned long long)busStats.exceptions[i]);
+    }
+    write_counter(out, "modbus_retries_total", "Writes repeated by the link error recovery.", busStats.retries);
+    write_counter(out, "modbus_flushes_total", "Bus flushes.", busStats.flushes);
+    write_counter(out, "modbus_reconnects_total", "Reconnections of the bus.", busStats.reconnects);
+
+    write_header(out, "modbus_transaction_latency_seconds", "histogram", "Latency of successful transactions, by slave.");
+    for (i = 0; i < MODBUS_STATS_MAX_SLAVE; i++)
+    {
+        if (busStats.slave_latency[i].count > 0)
+        {
+            snprintf(labels, sizeof(labels), "slave=\"%d\"", i);
+            write_histogram(out, "modbus_transaction_latency_seconds", labels, &busStats.slave_latency[i]);
+        }
+    }
+    write_header(out, "modbus_transaction_jitter_seconds", "gauge",
+                 "Standard deviation of the latency of successful transactions, by slave.");
+    for (i = 0; i < MODBUS_STATS_MAX_SLAVE; i++)
+    {
+        if (busStats.slave_latency[i].count > 0)
+        {
+            fprintf(out, "modbus_transaction_jitter_seconds{slave=\"%d\"} %g\n", i,
+                    emi_metrics_jitter_us(&busStats.slave_latency[i]) / 1e6);
+        }
+    }
+    write_header(out, "modbus_transaction_latency_max_seconds", "gauge", "Highest latency of a successful transaction, by slave.");
+    for (i = 0; i < MODBUS_STATS_MAX_SLAVE; i++)
+    {
+        if (busStats.slave_latency[i].count > 0)
+        {
+            fprintf(out, "modbus_transaction_latency_max_seconds{slave=\"%d\"} %g\n", i,
+                    busStats.slave_latency[i].max_us / 1e6);
+        }
+    }
+    write_header(out, "modbus_function_latency_seconds", "histogram", "Latency of successful transactions, by function code.");
+    for (i = 0; i < MODBUS_STATS_MAX_FUNCTION; i++)
+    {
+        if (busStats.function_latency[i].count > 0)
+        {
+            snprintf(labels, sizeof(labels), "function=\"0x%02X\"", i);
+            write_histogram(out, "modbus_function_latency_seconds", labels, &busStats.function_latency[i]);
+        }
+    }
+    write_header(out, "modbus_turnaround_seconds", "histogram", "Time slaves took to start answering.");
+    write_histogram(out, "modbus_turnaround_seconds", "", &busStats.turnaround);
+    write_header(out, "modbus_rx_overhead_seconds", "histogram", "Time to receive responses beyond their wire time.");
+    write_histogram(out, "modbus_rx_overhead_seconds", "", &busStats.rx_overhead);
+    write_header(out, "modbus_wire_seconds_total", "counter", "Theoretical time spent shifting frames on the line.");
+    fprintf(out, "modbus_wire_seconds_total{direction=\"tx\"} %g\n", busStats.tx_wire_us / 1e6);
+    fprintf(out, "modbus_wire_seconds_total{direction=\"rx\"} %g\n", busStats.rx_wire_us / 1e6);
+}
+
+static void serve(emi_metrics_t *metrics, int fd)
+{
+    char request[REQUEST_MAX_LENGTH];
+    struct timeval tv = {2, 0};
+    size_t length = 0;
+    ssize_t rc;
+    FILE *out;
+
+    /* Don't let a silent client block the listener */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (length < sizeof(request) - 1)
+    {
+        rc = read(fd, request + length, sizeof(request) - 1 - length);
+        if (rc <= 0)
+        {
+            break;
+        }
+        length += rc;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL)
+        {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    out = fdopen(fd, "w");
+    if (out == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0)
+    {
+        fprintf(out, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nNot found\n");
+    }
+    else
+    {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+        write_daemon_metrics(metrics, out);
+        write_bus_metrics(metrics, out);
+    }
+
+    fclose(out);
+}
+
+static void *listener(void *arg)
+{
+    emi_metrics_t *metrics = arg;
+
+    for (;;)
+    {
+        int fd = accept(metrics->listen_fd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "metrics: accept failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        serve(metrics, fd);
+    }
+}
+
+int emi_metrics_start(emi_metrics_t *metrics, const char *address)
+{
+    int rc;
+
+    metrics->listen_fd = emi_listen(address);
+    if (metrics->listen_fd == -1)
+    {
+        return -1;
+    }
+
+    rc = pthread_create(&metrics->listener, NULL, listener, metrics);
+    if (rc != 0)
+    {
+        close(metrics->listen_fd);
+        metrics->listen_fd = -1;
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef EMI_METRICS_H
+#define EMI_METRICS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "light-modbus/light-modbus.h"
+
+#define EMI_METRICS_MAX_THREADS 8
+#define EMI_METRICS_MAX_GAUGES 16
+
+/* Counters owned by one thread. Only that thread writes them, with
+ * emi_metrics_add() and emi_metrics_observe(); scrapes sum all the blocks. */
+typedef struct {
+    const char* thread;
+    uint64_t cycles;
+    uint64_t samples_read;
+    uint64_t samples_dropped;
+    uint64_t publishes;
+    uint64_t publish_errors;
+    /* Same log2 microsecond buckets as the modbus statistics */
+    modbus_histogram_t cycle_duration;
+    modbus_histogram_t publish_latency;
+    /* Time waited for the bus by the thread, see emi-bus.h */
+    modbus_histogram_t bus_wait;
+} emi_metrics_counters_t;
+
+typedef double (*emi_metrics_gauge_t)(void* user);
+
+typedef struct {
+    const char* name;
+    const char* help;
+    emi_metrics_gauge_t read;
+    void* user;
+} emi_metrics_gauge_entry_t;
+
+typedef struct {
+    int nb_threads;
+    emi_metrics_counters_t threads[EMI_METRICS_MAX_THREADS];
+    int nb_gauges;
+    emi_metrics_gauge_entry_t gauges[EMI_METRICS_MAX_GAUGES];
+    /* Bus statistics are exported from this context */
+    modbus_t* ctx;
+    int listen_fd;
+    pthread_t listener;
+} emi_metrics_t;
+
+#define emi_metrics_add(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+void emi_metrics_init(emi_metrics_t* metrics, modbus_t* ctx);
+
+/**
+ * @brief Get the counters block of the calling thread. Must be called before
+ * emi_metrics_start.
+ */
+emi_metrics_counters_t* emi_metrics_register(emi_metrics_t* metrics, const char* thread);
+
+/**
+ * @brief Export a value computed at scrape time (e.g. a queue depth).
+ */
+int emi_metrics_add_gauge(emi_metrics_t* metrics, const char* name, const char* help,
+    emi_metrics_gauge_t read, void* user);
+
+/**
+ * @brief Account a duration in a histogram of a counters block.
+ */
+void emi_metrics_observe(modbus_histogram_t* histogram, uint64_t duration_us);
+
+/**
+ * @brief Standard deviation of the durations of a histogram, in microseconds.
+ */
+double emi_metrics_jitter_us(const modbus_histogram_t* histogram);
+
+/**
+ * @brief Serve the metrics in the Prometheus text format from a background
+ * thread.
+ *
+ * @param address "unix:/path/to/socket", "host:port" or ":port" (localhost)
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int emi_metrics_start(emi_metrics_t* metrics, const char* address);
+
+#endif
@@ -0,0 +1,103 @@
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "emi-net.h"
+
+int emi_listen(const char *address)
+{
+    int fd;
+
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(sun.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, address + 5);
+        unlink(sun.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    else
+    {
+        struct addrinfo hints, *result;
+        char host[256];
+        const char *port = strrchr(address, ':');
+        int on = 1;
+        int rc;
+
+        if (port == NULL || port - address >= (long)sizeof(host))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        /* Only listen on localhost unless told otherwise */
+        if (port == address)
+        {
+            strcpy(host, "127.0.0.1");
+        }
+        else
+        {
+            memcpy(host, address, port - address);
+            host[port - address] = '\0';
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        rc = getaddrinfo(host, port + 1, &hints, &result);
+        if (rc != 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        fd = socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            freeaddrinfo(result);
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, result->ai_addr, result->ai_addrlen) == -1)
+        {
+            int saved_errno = errno;
+            freeaddrinfo(result);
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        freeaddrinfo(result);
+    }
+
+    if (listen(fd, 8) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
@@ -0,0 +1,12 @@
+#ifndef EMI_NET_H
+#define EMI_NET_H
+
+/**
+ * @brief Open a listening stream socket.
+ *
+ * @param address "unix:/path/to/socket", "host:port", or ":port" for localhost
+ * @return the socket, or -1 with errno set.
+ */
+int emi_listen(const char* address);
+
+#endif
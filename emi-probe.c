@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "emi-probe.h"
+#include "light-modbus/light-modbus-rtu.h"
+
+/* Voltage, present on every meter */
+#define PROBE_REGISTER 0x006c
+#define PROBE_SIZE 2
+
+/* Time the meter and a USB adapter (latency timer) take to answer, on top of
+   the frames themselves */
+#define PROBE_TURNAROUND_US 50000
+
+/* Fastest first */
+static const int bauds[] = {115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200};
+
+/* Modbus over serial line: 2 stop bits without parity */
+static const struct
+{
+    char parity;
+    int stop_bit;
+} framings[] = {{'N', 2}, {'E', 1}, {'O', 1}};
+
+int emi_line_check(const emi_line_t *line)
+{
+    modbus_t *ctx;
+    uint8_t value[PROBE_SIZE];
+    int onebyte, timeout;
+    int rc = -1;
+
+    ctx = modbus_new_rtu(line->device, line->baud, line->parity, 8, line->stop_bit);
+    if (ctx == NULL)
+    {
+        return 0;
+    }
+
+    /* Request and response of the read, with a margin for the meter */
+    onebyte = 1000000 * (1 + 8 + (line->parity == 'N' ? 0 : 1) + line->stop_bit) / line->baud;
+    timeout = (8 + 5 + PROBE_SIZE) * onebyte + PROBE_TURNAROUND_US;
+    modbus_set_response_timeout(ctx, timeout / 1000000, timeout % 1000000);
+    modbus_set_byte_timeout(ctx, 0, 4 * onebyte + 10000);
+
+    if (modbus_set_slave(ctx, line->slave) == 0 && modbus_connect(ctx) == 0)
+    {
+        /* Leftovers of the previous settings */
+        modbus_flush(ctx);
+        rc = modbus_read_input_registers(ctx, PROBE_REGISTER, 1, PROBE_SIZE, value);
+        modbus_close(ctx);
+    }
+    modbus_free(ctx);
+
+    return rc == 1;
+}
+
+static void *probeLine(void *arg)
+{
+    emi_line_t *line = arg;
+    size_t i, j;
+
+    for (i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++)
+    {
+        for (j = 0; j < sizeof(framings) / sizeof(framings[0]); j++)
+        {
+            line->baud = bauds[i];
+            line->parity = framings[j].parity;
+            line->stop_bit = framings[j].stop_bit;
+            if (emi_line_check(line))
+            {
+                return NULL;
+            }
+        }
+    }
+
+    line->baud = 0;
+    return NULL;
+}
+
+int emi_probe(emi_line_t *lines, int nb)
+{
+    pthread_t threads[nb];
+    int started[nb];
+    int found = 0;
+    int i;
+
+    for (i = 0; i < nb; i++)
+    {
+        started[i] = pthread_create(&threads[i], NULL, probeLine, &lines[i]) == 0;
+        if (!started[i])
+        {
+            probeLine(&lines[i]);
+        }
+    }
+
+    for (i = 0; i < nb; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        found += lines[i].baud != 0;
+    }
+
+    return found;
+}
+
+int emi_line_load(const char *path, emi_line_t *line)
+{
+    char device[256];
+    FILE *file;
+    int rc;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    rc = fscanf(file, "%255s %d %c %d", device, &line->baud, &line->parity, &line->stop_bit);
+    fclose(file);
+
+    if (rc != 4 || strcmp(device, line->device) != 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (line->baud <= 0 || (line->parity != 'N' && line->parity != 'E' && line->parity != 'O') ||
+        (line->stop_bit != 1 && line->stop_bit != 2))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int emi_line_save(const char *path, const emi_line_t *line)
+{
+    char tmp[4096];
+    FILE *file;
+    int rc;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    file = fopen(tmp, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    rc = fprintf(file, "%s %d %c %d\n", line->device, line->baud, line->parity, line->stop_bit);
+    if (fclose(file) != 0 || rc < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    return rename(tmp, path);
+}
@@ -0,0 +1,46 @@
+#ifndef EMI_PROBE_H
+#define EMI_PROBE_H
+
+/* Finding the line settings of a meter: a read of a register every meter has
+ * is tried at each candidate baud rate and parity with short timeouts, from
+ * the fastest rate down, so that a meter answering at several rates is polled
+ * at the fastest one. The result is saved to start at once the next time. */
+
+typedef struct {
+    /* Set by the caller */
+    const char* device;
+    int slave;
+    /* Settings the meter answered at, baud 0 when none */
+    int baud;
+    char parity;
+    int stop_bit;
+} emi_line_t;
+
+/**
+ * @brief Probe the devices of nb lines in parallel, one thread each.
+ *
+ * @return the number of lines a meter answered on.
+ */
+int emi_probe(emi_line_t* lines, int nb);
+
+/**
+ * @brief Check that the meter answers at the settings of line.
+ *
+ * @return 1 when it does, 0 otherwise.
+ */
+int emi_line_check(const emi_line_t* line);
+
+/**
+ * @brief Load the settings saved by emi_line_save for line->device.
+ *
+ * @return 0 on success, -1 with errno set otherwise (ENOENT when the file
+ * holds no settings for the device).
+ */
+int emi_line_load(const char* path, emi_line_t* line);
+
+/**
+ * @brief Save the settings of line, replacing the file atomically.
+ */
+int emi_line_save(const char* path, const emi_line_t* line);
+
+#endif
@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emi-net.h"
+#include "emi-query.h"
+
+static int64_t nowUs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Its pending requests are still made, for the other clients, but not
+   answered */
+static void closeClient(emi_query_t *query, int client)
+{
+    int i;
+
+    close(query->clients[client].fd);
+    query->clients[client].fd = -1;
+    for (i = 0; i < query->nb_pending; i++)
+    {
+        if (query->pending[i].client == client)
+        {
+            query->pending[i].client = -1;
+        }
+    }
+}
+
+static void reply(emi_query_t *query, int client, const char *line)
+{
+    /* A client that doesn't read its answers is dropped */
+    if (client != -1 && query->clients[client].fd != -1 &&
+        send(query->clients[client].fd, line, strlen(line), MSG_NOSIGNAL | MSG_DONTWAIT) == -1)
+    {
+        closeClient(query, client);
+    }
+}
+
+static void replyData(emi_query_t *query, const emi_query_request_t *request, const uint8_t *data)
+{
+    char line[4 + 2 * EMI_QUERY_MAX_READ + 2];
+    int length = request->nb * request->size;
+    int i;
+
+    strcpy(line, "OK ");
+    for (i = 0; i < length; i++)
+    {
+        sprintf(line + 3 + 2 * i, "%02x", data[i]);
+    }
+    strcpy(line + 3 + 2 * length, "\n");
+    reply(query, request->client, line);
+}
+
+static void replyError(emi_query_t *query, const emi_query_request_t *request, int error)
+{
+    char line[128];
+
+    snprintf(line, sizeof(line), "ERR %s\n", modbus_strerror(error));
+    reply(query, request->client, line);
+}
+
+static int compareRequests(const void *a, const void *b)
+{
+    const emi_query_request_t *x = a, *y = b;
+
+    if (x->slave != y->slave)
+    {
+        return x->slave - y->slave;
+    }
+    if (x->size != y->size)
+    {
+        return x->size - y->size;
+    }
+    return x->addr - y->addr;
+}
+
+/* One bus read from slave, the slave set on ctx is left as it was */
+static int readRegisters(emi_query_t *query, int slave, int addr, int nb, uint8_t size, uint8_t *dest)
+{
+    int previous, rc, error;
+
+    emi_rt_enter(&query->rt);
+    emi_metrics_observe(&query->counters->bus_wait, emi_bus_acquire(query->bus, EMI_BUS_PRIORITY_QUERY));
+    previous = modbus_get_slave(query->ctx);
+    modbus_set_slave(query->ctx, slave);
+    rc = modbus_read_input_registers(query->ctx, addr, nb, size, dest);
+    error = errno;
+    modbus_set_slave(query->ctx, previous);
+    emi_bus_release(query->bus);
+    emi_rt_leave(&query->rt);
+
+    query->transactions++;
+    errno = error;
+    return rc;
+}
+
+/* Requests first to last share a slave and size and cover first->addr..end */
+static void executeGroup(emi_query_t *query, emi_query_request_t *first, emi_query_request_t *last, int end)
+{
+    uint8_t data[EMI_QUERY_MAX_READ];
+    emi_query_request_t *request;
+    int nb = end - first->addr + 1;
+    int rc;
+
+    rc = readRegisters(query, first->slave, first->addr, nb, first->size, data);
+    if (rc == -1 && nb > 1 && (errno == EMBXILADD || errno == EMBXILVAL || errno == EMBMDATA))
+    {
+        /* The meter, or the length of a frame, refuses this block read, each
+           request on its own */
+        for (request = first; request <= last; request++)
+        {
+            if (readRegisters(query, request->slave, request->addr, request->nb, request->size, data) == -1)
+            {
+                replyError(query, request, errno);
+            }
+            else
+            {
+                replyData(query, request, data);
+            }
+        }
+        return;
+    }
+
+    for (request = first; request <= last; request++)
+    {
+        if (rc == -1)
+        {
+            replyError(query, request, errno);
+        }
+        else
+        {
+            replyData(query, request, data + (request->addr - first->addr) * request->size);
+        }
+    }
+}
+
+static void executePending(emi_query_t *query)
+{
+    emi_query_request_t *pending = query->pending;
+    int first = 0, end, i;
+
+    qsort(pending, query->nb_pending, sizeof(pending[0]), compareRequests);
+
+    while (first < query->nb_pending)
+    {
+        end = pending[first].addr + pending[first].nb - 1;
+        for (i = first + 1; i < query->nb_pending; i++)
+        {
+            int requestEnd = pending[i].addr + pending[i].nb - 1;
+            int mergedEnd = requestEnd > end ? requestEnd : end;
+
+            if (pending[i].slave != pending[first].slave || pending[i].size != pending[first].size ||
+                pending[i].addr > end + 1 ||
+                (mergedEnd - pending[first].addr + 1) * (pending[first].size + pending[first].size % 2) >
+                    EMI_QUERY_MAX_READ)
+            {
+                break;
+            }
+            end = mergedEnd;
+        }
+        executeGroup(query, &pending[first], &pending[i - 1], end);
+        query->requests += i - first;
+        first = i;
+    }
+
+    query->nb_pending = 0;
+}
+
+/* Parse a request line of the client */
+static void parseLine(emi_query_t *query, int client, const char *line)
+{
+    emi_query_request_t *request;
+    int slave, addr, nb, size;
+
+    if (sscanf(line, "READ %d %i %d %d", &slave, &addr, &nb, &size) != 4)
+    {
+        reply(query, client, "ERR expected READ <slave> <address> <count> <size>\n");
+        return;
+    }
+    if (slave < 1 || slave > 247 || addr < 0 || addr > 0xffff || nb < 1 || size < 1 || size > 255 ||
+        nb > EMI_QUERY_MAX_READ / (size + size % 2))
+    {
+        reply(query, client, "ERR invalid request\n");
+        return;
+    }
+    if (query->nb_pending == EMI_QUERY_MAX_PENDING)
+    {
+        reply(query, client, "ERR busy\n");
+        return;
+    }
+
+    request = &query->pending[query->nb_pending++];
+    request->client = client;
+    request->slave = slave;
+    request->addr = addr;
+    request->nb = nb;
+    request->size = size;
+}
+
+static void receive(emi_query_t *query, int client)
+{
+    emi_query_client_t *c = &query->clients[client];
+    char *newline;
+    ssize_t n;
+
+    n = recv(c->fd, c->line + c->length, sizeof(c->line) - 1 - c->length, MSG_DONTWAIT);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            closeClient(query, client);
+        }
+        return;
+    }
+    c->length += n;
+    c->line[c->length] = '\0';
+
+    while ((newline = strchr(c->line, '\n')) != NULL)
+    {
+        *newline = '\0';
+        parseLine(query, client, c->line);
+        c->length -= newline + 1 - c->line;
+        memmove(c->line, newline + 1, c->length + 1);
+    }
+    if (c->length == sizeof(c->line) - 1)
+    {
+        reply(query, client, "ERR line too long\n");
+        c->length = 0;
+    }
+}
+
+static void acceptClient(emi_query_t *query)
+{
+    int fd, i;
+
+    fd = accept(query->listen_fd, NULL, NULL);
+    if (fd == -1)
+    {
+        return;
+    }
+    for (i = 0; i < EMI_QUERY_MAX_CLIENTS; i++)
+    {
+        if (query->clients[i].fd == -1)
+        {
+            query->clients[i].fd = fd;
+            query->clients[i].length = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void *serve(void *arg)
+{
+    emi_query_t *query = arg;
+    struct pollfd fds[1 + EMI_QUERY_MAX_CLIENTS];
+    int64_t deadline = 0;
+    int i, timeout;
+
+    for (;;)
+    {
+        fds[0].fd = query->listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < EMI_QUERY_MAX_CLIENTS; i++)
+        {
+            fds[1 + i].fd = query->clients[i].fd;
+            fds[1 + i].events = POLLIN;
+        }
+
+        timeout = -1;
+        if (query->nb_pending > 0)
+        {
+            timeout = (deadline - nowUs() + 999) / 1000;
+            timeout = timeout < 0 ? 0 : timeout;
+        }
+        if (poll(fds, 1 + EMI_QUERY_MAX_CLIENTS, timeout) == -1 && errno != EINTR)
+        {
+            fprintf(stderr, "query: poll failed: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            acceptClient(query);
+        }
+
+        for (i = 0; i < EMI_QUERY_MAX_CLIENTS; i++)
+        {
+            if (query->clients[i].fd != -1 && (fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                int hadPending = query->nb_pending;
+                receive(query, i);
+                if (hadPending == 0 && query->nb_pending > 0)
+                {
+                    deadline = nowUs() + EMI_QUERY_WINDOW_US;
+                }
+            }
+        }
+
+        if (query->nb_pending > 0 && nowUs() >= deadline)
+        {
+            executePending(query);
+        }
+    }
+}
+
+int emi_query_start(emi_query_t *query, const char *address, modbus_t *ctx, emi_bus_t *bus, const emi_rt_t *rt,
+                    emi_metrics_counters_t *counters)
+{
+    int rc, i;
+
+    memset(query, 0, sizeof(*query));
+    query->ctx = ctx;
+    query->bus = bus;
+    query->counters = counters;
+    /* A copy, as it keeps the scheduling to restore of its thread */
+    query->rt.priority = rt != NULL ? rt->priority : 0;
+    query->rt.cpu = rt != NULL ? rt->cpu : -1;
+    for (i = 0; i < EMI_QUERY_MAX_CLIENTS; i++)
+    {
+        query->clients[i].fd = -1;
+    }
+
+    query->listen_fd = emi_listen(address);
+    if (query->listen_fd == -1)
+    {
+        return -1;
+    }
+
+    rc = pthread_create(&query->thread, NULL, serve, query);
+    if (rc != 0)
+    {
+        close(query->listen_fd);
+        query->listen_fd = -1;
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
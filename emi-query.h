@@ -0,0 +1,72 @@
+#ifndef EMI_QUERY_H
+#define EMI_QUERY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "emi-bus.h"
+#include "emi-metrics.h"
+#include "emi-rt.h"
+#include "light-modbus/light-modbus.h"
+
+/* Local query API: tools ask emi-read for registers of any meter on its bus
+ * over a Unix socket, instead of opening the serial port themselves. One
+ * request per line:
+ *
+ *     READ <slave> <address> <count> <size>
+ *
+ * answered by "OK <count * size bytes in hex>" or "ERR <reason>". Requests
+ * arriving within EMI_QUERY_WINDOW_US of each other for the same slave and
+ * size, and overlapping or adjacent ranges, are merged into a single read and
+ * each gets its slice. */
+
+#define EMI_QUERY_MAX_CLIENTS 16
+#define EMI_QUERY_MAX_PENDING 64
+/* How long the first request waits for others to merge with */
+#define EMI_QUERY_WINDOW_US 5000
+/* Largest read, bytes, each value padded to 16 bits as on the wire */
+#define EMI_QUERY_MAX_READ 240
+
+typedef struct {
+    int client;
+    int slave;
+    int addr;
+    int nb;
+    uint8_t size;
+} emi_query_request_t;
+
+typedef struct {
+    int fd;
+    char line[128];
+    int length;
+} emi_query_client_t;
+
+typedef struct {
+    /* Shared with the poll loop, reads are made at EMI_BUS_PRIORITY_QUERY */
+    modbus_t* ctx;
+    emi_bus_t* bus;
+    /* The real-time mode of the poll loop, held as long as the bus so that
+       the poll doesn't wait on a descheduled thread */
+    emi_rt_t rt;
+    /* Block of the thread, its waits for the bus */
+    emi_metrics_counters_t* counters;
+    int listen_fd;
+    pthread_t thread;
+    emi_query_client_t clients[EMI_QUERY_MAX_CLIENTS];
+    emi_query_request_t pending[EMI_QUERY_MAX_PENDING];
+    int nb_pending;
+    /* Requests answered and the bus reads made for them */
+    uint64_t requests;
+    uint64_t transactions;
+} emi_query_t;
+
+/**
+ * @brief Serve queries on address ("unix:/path/to/socket"), from a thread of
+ * its own. The slave set on ctx is restored after each read, made under the
+ * scheduling of rt (initialised, or NULL for none). The waits for the bus go
+ * to counters, registered for the thread.
+ */
+int emi_query_start(emi_query_t* query, const char* address, modbus_t* ctx, emi_bus_t* bus, const emi_rt_t* rt,
+                    emi_metrics_counters_t* counters);
+
+#endif
@@ -1,6 +1,9 @@
-#include <byteswap.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,33 +11,434 @@
 #include <unistd.h>
 
 #include "MQTTClient.h"
+#include "emi-bus.h"
+#include "emi-cache.h"
+#include "emi-discover.h"
+#include "emi-gateway.h"
+#include "emi-metrics.h"
+#include "emi-probe.h"
+#include "emi-query.h"
 #include "emi-read.h"
+#include "emi-rt.h"
+#include "emi-shadow.h"
+#include "emi-tsdb.h"
 #include <systemd/sd-daemon.h>
 
 #define SERVER_ID 0x01
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+#define DEFAULT_LINE_FILE "/var/lib/emi-read/line"
+#define DEFAULT_CACHE_FILE "/var/lib/emi-read/cache"
+/* Identity and firmware strings, read by several consumers */
+#define IDENTITY_TTL_MS (10 * 60 * 1000)
+/* Hourly reads of the device id that may fail before a cache is dropped */
+#define CACHE_VERIFY_ATTEMPTS 3
 
-double instVoltageL1, instCurrentL1, instActivePower, activeEnergyImport;
-double instFrequency, instPowerFactor, currentApparentPowerThreshold;
-double rate1ActiveEnergy, rate2ActiveEnergy, rate3ActiveEnergy, totalRateActiveEnergy;
+#define TOPIC_PREFIX "emi/"
+#define POLL_INTERVAL_MS 5000
+/* The open chunks of the history are rewritten at this pace, closed ones when
+   they fill up */
+#define HISTORY_FLUSH_INTERVAL_MS (15 * 60 * 1000)
+/* Gateway reads of polled registers are answered from the last poll */
+#define GATEWAY_MAX_AGE_MS POLL_INTERVAL_MS
+
+/* Burst mode polls voltage and current (0x006c, 0x006d) in a single request */
+#define BURST_FIRST_REGISTER 0x006c
+/* EN 50160 allows +-10% around the 230 V nominal voltage */
+#define SAG_VOLTAGE 207.0
+#define SWELL_VOLTAGE 253.0
+#define VOLTAGE_HYSTERESIS 2.0
+#define INRUSH_CURRENT 40.0
+#define CURRENT_HYSTERESIS 1.0
+
+/* Values polled by runContinuously() */
+emi_value_t instantValues[] = {
+    {"emi/L1/voltage", 0x006c, 2, -1, 1, FALSE},
+    {"emi/L1/current", 0x006d, 2, -1, 1, FALSE},
+    {"emi/L1/activePower", 0x0079, 4, 0, 0, FALSE},
+    {"emi/L1/activeEnergyImport", 0x0016, 4, 0, 0, TRUE},
+    {"emi/L1/frequency", 0x007F, 2, -1, 1, FALSE},
+    {"emi/L1/powerFactor", 0x007B, 2, -3, 3, FALSE},
+    {"emi/tariff/rate1ActiveEnergy", 0x0026, 4, 0, 0, TRUE},
+    {"emi/tariff/rate2ActiveEnergy", 0x0027, 4, 0, 0, TRUE},
+    {"emi/tariff/rate3ActiveEnergy", 0x0028, 4, 0, 0, TRUE},
+    {"emi/tariff/totalRateActiveEnergy", 0x002C, 4, 0, 0, TRUE},
+};
+#define NB_INSTANT_VALUES (int)(sizeof(instantValues) / sizeof(instantValues[0]))
+
+double currentApparentPowerThreshold;
 modbus_t *ctx = NULL;
+int serverId = SERVER_ID;
+emi_line_t meterLine = {DEFAULT_DEVICE, SERVER_ID, 9600, 'N', 2};
 int rc, mqttrc;
 MQTTClient client;
-emi_clock_t *emiClock;
+/* Filled in place every cycle, polling doesn't allocate */
+emi_meter_t meter;
+emi_tsdb_t *history = NULL;
+/* Set by SIGTERM and SIGINT, for the loops to end and the history to be
+   flushed */
+volatile sig_atomic_t stopping = FALSE;
+emi_rollup_t *rollups = NULL;
+
+enum
+{
+    BURST_VOLTAGE = 0,
+    BURST_CURRENT,
+    NB_BURST_CHANNELS
+};
+static const char *burstTopics[NB_BURST_CHANNELS] = {"emi/L1/voltage", "emi/L1/current"};
+emi_burst_channel_t burstChannels[NB_BURST_CHANNELS];
+int burst = FALSE;
+/* Cleared when the meter refuses multi-register requests */
+int burstBlockRead = TRUE;
+const char *traceFile = NULL;
+emi_metrics_t metrics;
+emi_metrics_counters_t *pollCounters;
+emi_metrics_counters_t *queryCounters;
+emi_metrics_counters_t *gatewayCounters;
+/* Publish every sample, not only the rollups */
+int publishInstant = TRUE;
+emi_rt_t rt;
+emi_cache_t *cache = NULL;
+/* Instant values aren't cached, only what is read at most hourly */
+emi_regcache_t regcache;
+/* Instant values in shared memory, same indexes as instantValues */
+emi_shadow_t *shadow = NULL;
+/* Held around the bus I/O, shared with the query API and the gateway */
+emi_bus_t bus = EMI_BUS_INITIALIZER;
+emi_query_t query;
+emi_gateway_t gateway;
+/* Started from the cache, the meter hasn't been read yet, and the reads of
+   its id that failed since */
+int cacheUnverified = FALSE;
+int cacheVerifyFailures = 0;
+/* Values read by the last poll cycle */
+int lastCycleReads = 0;
+/* Listen-only: the transactions of another master, how many times they read
+   each value since the last publication, and when that round started */
+modbus_sniff_t *sniff = NULL;
+uint8_t sniffedValues[NB_INSTANT_VALUES];
+struct timespec sniffRoundStart;
+
+static const struct option longOptions[] = {
+    {"device", required_argument, NULL, 'd'},
+    {"history", required_argument, NULL, 'H'},
+    {"rollups", no_argument, NULL, 'R'},
+    {"rollups-only", no_argument, NULL, 'r'},
+    {"burst", no_argument, NULL, 'b'},
+    {"inrush-current", required_argument, NULL, 'i'},
+    {"trace", required_argument, NULL, 'T'},
+    {"metrics", required_argument, NULL, 'M'},
+    {"capture", required_argument, NULL, 'C'},
+    {"realtime", required_argument, NULL, 'p'},
+    {"cpu", required_argument, NULL, 'c'},
+    {"rts", required_argument, NULL, 'S'},
+    {"low-latency", optional_argument, NULL, 'l'},
+    {"probe", optional_argument, NULL, 'P'},
+    {"slave", required_argument, NULL, 's'},
+    {"discover", no_argument, NULL, 'D'},
+    {"cache", optional_argument, NULL, 'K'},
+    {"shadow", optional_argument, NULL, 'O'},
+    {"query", required_argument, NULL, 'Q'},
+    {"gateway", required_argument, NULL, 'G'},
+    {"gateway-priority", required_argument, NULL, 'g'},
+    {"gateway-max-age", required_argument, NULL, 'a'},
+    {"listen-only", no_argument, NULL, 'L'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] mqtt://<mqtt-host> <mqtt-user> <mqtt-pwd>\n", name);
+    fprintf(stderr, "  -d, --device PATH   serial device of the meter (default %s)\n", DEFAULT_DEVICE);
+    fprintf(stderr, "  -H, --history DIR   keep a local compressed history of the polled values in DIR\n");
+    fprintf(stderr, "  -R, --rollups       publish 1m/15m/1h/1d rollups of the polled values\n");
+    fprintf(stderr, "      --rollups-only  publish the rollups instead of every sample\n");
+    fprintf(stderr, "  -b, --burst         poll voltage and current continuously between cycles and publish summaries\n");
+    fprintf(stderr, "      --inrush-current A  current threshold of burst mode events (default %.0f)\n", INRUSH_CURRENT);
+    fprintf(stderr, "  -T, --trace FILE    record bus events in a ring, dumped to FILE on SIGUSR1\n");
+    fprintf(stderr, "  -C, --capture FILE  append every raw frame sent and received to FILE\n");
+    fprintf(stderr, "  -M, --metrics ADDR  serve Prometheus metrics on ADDR (unix:/path, host:port or :port)\n");
+    fprintf(stderr, "      --realtime PRIO talk to the meter under SCHED_FIFO at PRIO (1-99), with memory locked\n");
+    fprintf(stderr, "      --cpu N         pin the bus I/O to CPU N\n");
+    fprintf(stderr, "      --rts up|down   drive the direction of an RS-485 transceiver with RTS, at this level while sending\n");
+    fprintf(stderr, "      --low-latency[=MS] push received bytes to emi-read at once, with a USB adapter latency timer of MS ms (default 1)\n");
+    fprintf(stderr, "      --probe[=FILE]  find the baud rate and parity of the meter, saved to FILE (default %s)\n", DEFAULT_LINE_FILE);
+    fprintf(stderr, "      --slave ID      slave id of the meter (default %d)\n", SERVER_ID);
+    fprintf(stderr, "      --discover      list the meters on every USB serial port and exit\n");
+    fprintf(stderr, "      --cache[=FILE]  start from what was learned about the meter, kept in FILE (default %s)\n", DEFAULT_CACHE_FILE);
+    fprintf(stderr, "      --shadow[=NAME] keep the polled values in the shared memory segment NAME (default /emi-<slave id>)\n");
+    fprintf(stderr, "      --query ADDR    answer register reads of local tools on ADDR (unix:/path/to/socket)\n");
+    fprintf(stderr, "      --gateway ADDR  serve Modbus TCP on ADDR (host:port or :port), forwarded to the bus\n");
+    fprintf(stderr, "      --gateway-priority N  bus priority of the gateway, 0-%d (default 0, local tools are at %d)\n",
+            EMI_BUS_PRIORITY_POLL - 1, EMI_BUS_PRIORITY_QUERY);
+    fprintf(stderr, "      --gateway-max-age MS  answer gateway reads of registers polled less than MS ms ago from the cache (default %d, 0 never)\n",
+            GATEWAY_MAX_AGE_MS);
+    fprintf(stderr, "      --listen-only   never transmit, publish the values another master reads from the meter\n");
+}
+
+static void printDiscovered(const emi_discovered_t *meter, void *user)
+{
+    printf("%s slave %d device id %s\n", meter->device, meter->slave, meter->deviceId);
+}
 
 int main(int argc, char *argv[])
 {
-    // UPDATE THE DEVICE NAME AS NECESSARY
-    ctx = modbus_new_rtu("/dev/ttyUSB0", 9600, 'N', 8, 2);
+    const char *device = DEFAULT_DEVICE;
+    const char *historyDir = NULL;
+    const char *metricsAddress = NULL;
+    const char *captureFile = NULL;
+    static emi_rollup_t rollupState;
+    int enableRollups = FALSE;
+    double inrushCurrent = INRUSH_CURRENT;
+    int rtPriority = 0, rtCpu = -1;
+    int rts = MODBUS_RTU_RTS_NONE;
+    int latencyTimer = 0;
+    const char *lineFile = NULL;
+    int discover = FALSE;
+    const char *cacheFile = NULL;
+    emi_cache_data_t *cached = NULL;
+    int warmStart = FALSE;
+    int enableShadow = FALSE;
+    const char *shadowName = NULL;
+    const char *queryAddress = NULL;
+    const char *gatewayAddress = NULL;
+    int gatewayPriority = 0;
+    int gatewayMaxAge = GATEWAY_MAX_AGE_MS;
+    int listenOnly = FALSE;
+    char defaultShadowName[32];
+    modbus_rtu_line_t line;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "d:H:RbT:C:M:h", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'H':
+            historyDir = optarg;
+            break;
+        case 'r':
+            publishInstant = FALSE;
+            /* fall through */
+        case 'R':
+            enableRollups = TRUE;
+            break;
+        case 'b':
+            burst = TRUE;
+            break;
+        case 'i':
+            inrushCurrent = atof(optarg);
+            break;
+        case 'T':
+            traceFile = optarg;
+            break;
+        case 'C':
+            captureFile = optarg;
+            break;
+        case 'M':
+            metricsAddress = optarg;
+            break;
+        case 'p':
+            rtPriority = atoi(optarg);
+            break;
+        case 'c':
+            rtCpu = atoi(optarg);
+            break;
+        case 'S':
+            if (strcmp(optarg, "up") == 0)
+            {
+                rts = MODBUS_RTU_RTS_UP;
+            }
+            else if (strcmp(optarg, "down") == 0)
+            {
+                rts = MODBUS_RTU_RTS_DOWN;
+            }
+            else
+            {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'l':
+            latencyTimer = 1;
+            if (optarg != NULL)
+            {
+                char *end;
+                long ms = strtol(optarg, &end, 10);
+
+                /* 0 would turn the option off */
+                if (end == optarg || *end != '\0' || ms < -1 || ms == 0 || ms > 255)
+                {
+                    fprintf(stderr, "Invalid latency timer: %s ms\n", optarg);
+                    return -1;
+                }
+                latencyTimer = ms;
+            }
+            break;
+        case 'P':
+            lineFile = optarg != NULL ? optarg : DEFAULT_LINE_FILE;
+            break;
+        case 's':
+            serverId = atoi(optarg);
+            break;
+        case 'D':
+            discover = TRUE;
+            break;
+        case 'K':
+            cacheFile = optarg != NULL ? optarg : DEFAULT_CACHE_FILE;
+            break;
+        case 'O':
+            enableShadow = TRUE;
+            shadowName = optarg;
+            break;
+        case 'Q':
+            queryAddress = optarg;
+            break;
+        case 'G':
+            gatewayAddress = optarg;
+            break;
+        case 'g':
+            gatewayPriority = atoi(optarg);
+            break;
+        case 'a':
+            gatewayMaxAge = atoi(optarg);
+            break;
+        case 'L':
+            listenOnly = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (listenOnly && (burst || lineFile != NULL || discover || queryAddress != NULL || gatewayAddress != NULL))
+    {
+        fprintf(stderr, "--burst, --probe, --discover, --query and --gateway transmit, not in --listen-only mode\n");
+        return -1;
+    }
+
+    if (discover)
+    {
+        static const char *const patterns[] = {EMI_DISCOVER_DEVICES};
+        int found = emi_discover(patterns, sizeof(patterns) / sizeof(patterns[0]), &meterLine, 1, 247, printDiscovered, NULL);
+
+        if (found == -1)
+        {
+            fprintf(stderr, "No serial port found: %s\n", strerror(errno));
+            return -1;
+        }
+        printf("%d meters found\n", found);
+        return 0;
+    }
+
+    if (argc - optind < 3)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    /* From here on argv[1..3] are the positional mqtt arguments */
+    argv += optind - 1;
+
+    if (historyDir != NULL)
+    {
+        history = emi_tsdb_open(historyDir);
+        if (history == NULL)
+        {
+            fprintf(stderr, "Could not open history store %s: %s\n", historyDir, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (enableShadow)
+    {
+        if (shadowName == NULL)
+        {
+            snprintf(defaultShadowName, sizeof(defaultShadowName), "/emi-%d", serverId);
+            shadowName = defaultShadowName;
+        }
+        shadow = emi_shadow_create(shadowName, serverId);
+        if (shadow == NULL)
+        {
+            fprintf(stderr, "Could not create the shared memory segment %s: %s\n", shadowName, strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < NB_INSTANT_VALUES; i++)
+        {
+            emi_shadow_add(shadow, instantValues[i].topic, instantValues[i].registerAddress, instantValues[i].size);
+        }
+    }
+
+    if (enableRollups)
+    {
+        rollups = &rollupState;
+        emi_rollup_init(rollups, publishRollup, NULL);
+        for (i = 0; i < NB_INSTANT_VALUES; i++)
+        {
+            emi_rollup_add_series(rollups, instantValues[i].counter);
+        }
+    }
+
+    emi_burst_channel_init(&burstChannels[BURST_VOLTAGE], SAG_VOLTAGE, SWELL_VOLTAGE, VOLTAGE_HYSTERESIS);
+    emi_burst_channel_init(&burstChannels[BURST_CURRENT], -INFINITY, inrushCurrent, CURRENT_HYSTERESIS);
+
+    meterLine.device = device;
+    meterLine.slave = serverId;
+    if (cacheFile != NULL)
+    {
+        cache = emi_cache_open(cacheFile);
+        if (cache == NULL)
+        {
+            fprintf(stderr, "Could not open the cache %s: %s\n", cacheFile, strerror(errno));
+            return -1;
+        }
+        cached = emi_cache_data(cache);
+        warmStart = cache->valid && strcmp(cached->device, device) == 0 && cached->slave == serverId;
+    }
+
+    if (warmStart)
+    {
+        /* Checked by the first hourly read */
+        meterLine.baud = cached->baud;
+        meterLine.parity = cached->parity;
+        meterLine.stop_bit = cached->stopBit;
+        printf("Warm start from %s: meter %s at %d bauds (%c, 8, %d)\n", cacheFile, cached->meter.deviceId1,
+               meterLine.baud, meterLine.parity, meterLine.stop_bit);
+    }
+    else if (lineFile != NULL)
+    {
+        if (emi_line_load(lineFile, &meterLine) == 0 && emi_line_check(&meterLine))
+        {
+            printf("Line settings from %s\n", lineFile);
+        }
+        else if (emi_probe(&meterLine, 1) == 1)
+        {
+            if (emi_line_save(lineFile, &meterLine) == -1)
+            {
+                fprintf(stderr, "Could not save the line settings to %s: %s\n", lineFile, strerror(errno));
+            }
+        }
+        else
+        {
+            fprintf(stderr, "No meter answered on %s\n", device);
+            return -1;
+        }
+        printf("Meter on %s at %d bauds (%c, 8, %d)\n", device, meterLine.baud, meterLine.parity, meterLine.stop_bit);
+    }
+
+    ctx = modbus_new_rtu(device, meterLine.baud, meterLine.parity, 8, meterLine.stop_bit);
     if (ctx == NULL)
     {
         fprintf(stderr, "Could not connect to MODBUS: %s\n", modbus_strerror(errno));
         return -1;
     }
 
-    rc = modbus_set_slave(ctx, SERVER_ID);
+    rc = modbus_set_slave(ctx, serverId);
     if (rc == -1)
     {
-        fprintf(stderr, "server_id=%d Invalid slave ID: %s\n", SERVER_ID, modbus_strerror(errno));
+        fprintf(stderr, "server_id=%d Invalid slave ID: %s\n", serverId, modbus_strerror(errno));
         modbus_free(ctx);
         return -1;
     }
@@ -49,12 +453,42 @@ int main(int argc, char *argv[])
     //mqtt_connect(&client, argv);
 
     modbus_set_debug(ctx, FALSE);
+    modbus_rtu_set_listen_only(ctx, listenOnly);
+
+    if (traceFile != NULL)
+    {
+        if (modbus_set_trace(ctx, MODBUS_TRACE_DEFAULT_EVENTS) == -1)
+        {
+            fprintf(stderr, "Could not enable the trace: %s\n", modbus_strerror(errno));
+            modbus_free(ctx);
+            return -1;
+        }
+        signal(SIGUSR1, dumpTrace);
+    }
+
+    if (captureFile != NULL)
+    {
+        int fd = open(captureFile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1 || modbus_set_capture(ctx, fd) == -1)
+        {
+            fprintf(stderr, "Could not capture to %s: %s\n", captureFile, strerror(errno));
+            modbus_free(ctx);
+            return -1;
+        }
+    }
 
     modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL);
 
     /* Define a new timeout of 50ms */
     modbus_set_response_timeout(ctx, 0, 200 * 1000);
 
+    if (latencyTimer != 0 && modbus_rtu_set_low_latency(ctx, latencyTimer) == -1)
+    {
+        fprintf(stderr, "Invalid latency timer: %d ms\n", latencyTimer);
+        modbus_free(ctx);
+        return -1;
+    }
+
     int con = modbus_connect(ctx);
     if (con == -1)
     {
@@ -63,15 +497,122 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (rts != MODBUS_RTU_RTS_NONE)
+    {
+        if (modbus_rtu_set_rts(ctx, rts) == -1)
+        {
+            fprintf(stderr, "Could not drive RTS: %s\n", modbus_strerror(errno));
+            modbus_free(ctx);
+            return -1;
+        }
+        printf("RTS driven by %s\n", modbus_rtu_is_kernel_rts(ctx) == TRUE ? "the kernel RS-485 support" : "emi-read");
+    }
+
+    modbus_rtu_get_line(ctx, &line);
+    printf("Line: low latency %s, latency timer %d ms, VMIN %d, VTIME %d\n",
+           line.low_latency ? "on" : "off", line.latency_timer, line.vmin, line.vtime);
+
+    emi_regcache_init(&regcache, 0);
+    emi_regcache_set_ttl(&regcache, 0x0002, 0x0006, IDENTITY_TTL_MS);
+    emi_meter_use_regcache(&regcache);
+
+    emi_metrics_init(&metrics, ctx);
+    /* A block per user of the bus */
+    pollCounters = emi_metrics_register(&metrics, "poll");
+    queryCounters = emi_metrics_register(&metrics, "query");
+    gatewayCounters = emi_metrics_register(&metrics, "gateway");
+    if (metricsAddress != NULL)
+    {
+        emi_metrics_add_gauge(&metrics, "emi_mqtt_pending_deliveries", "MQTT messages not yet acknowledged.",
+                              pendingDeliveries, NULL);
+        if (queryAddress != NULL)
+        {
+            emi_metrics_add_gauge(&metrics, "emi_query_pending_requests", "Queries waiting to be read from the bus.",
+                                  queryPending, NULL);
+        }
+        if (gatewayAddress != NULL)
+        {
+            emi_metrics_add_gauge(&metrics, "emi_gateway_queued_requests",
+                                  "Modbus TCP requests waiting to be forwarded to the bus.", gatewayQueued, NULL);
+        }
+        if (emi_metrics_start(&metrics, metricsAddress) == -1)
+        {
+            fprintf(stderr, "Could not serve metrics on %s: %s\n", metricsAddress, strerror(errno));
+            modbus_free(ctx);
+            return -1;
+        }
+    }
+
+    /* Before the threads sharing the bus, which hold it in the real-time mode
+       too. Memory allocated later is locked as it is touched */
+    if (emi_rt_init(&rt, rtPriority, rtCpu) == -1)
+    {
+        fprintf(stderr, "Could not set up the real-time mode: %s\n", strerror(errno));
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if (queryAddress != NULL && emi_query_start(&query, queryAddress, ctx, &bus, &rt, queryCounters) == -1)
+    {
+        fprintf(stderr, "Could not answer queries on %s: %s\n", queryAddress, strerror(errno));
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if (gatewayAddress != NULL &&
+        emi_gateway_start(&gateway, gatewayAddress, ctx, &bus, gatewayPriority, &rt, gatewayCounters,
+                          gatewayMaxAge > 0 ? &regcache : NULL, gatewayMaxAge) == -1)
+    {
+        fprintf(stderr, "Could not serve Modbus TCP on %s: %s\n", gatewayAddress, strerror(errno));
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if (history != NULL)
+    {
+        signal(SIGTERM, stop);
+        signal(SIGINT, stop);
+    }
+
     sd_notify(FALSE, "READY=1");
 
-    // fire runHourly just once before entering the loop.
-    runHourly();
-    unsigned char hourlyLastRanAt = getCurrentHour();
+    if (listenOnly)
+    {
+        runSniffer(argv);
+        modbus_close(ctx);
+        modbus_free(ctx);
+        emi_tsdb_close(history);
+        emi_cache_close(cache);
+        return 0;
+    }
 
-    while (TRUE)
+    unsigned char hourlyLastRanAt;
+    if (warmStart)
     {
+        /* The identity is published from the cache, and read again after the
+           first poll cycle rather than before */
+        meter = cached->meter;
+        currentApparentPowerThreshold = cached->currentApparentPowerThreshold;
+        burstBlockRead = cached->blockRead;
+        cacheUnverified = TRUE;
+        hourlyLastRanAt = 0xff;
+    }
+    else
+    {
+        // fire runHourly just once before entering the loop.
+        runHourly();
+        hourlyLastRanAt = getCurrentHour();
+    }
+    struct timespec nextCycle;
+
+    clock_gettime(CLOCK_MONOTONIC, &nextCycle);
+    while (!stopping)
+    {
+        struct timespec cycleStart, cycleEnd;
+
         mqtt_connect(client, argv);
+
+        clock_gettime(CLOCK_MONOTONIC, &cycleStart);
         runContinuously();
 
         if (getCurrentHour() != hourlyLastRanAt)
@@ -79,160 +620,611 @@ int main(int argc, char *argv[])
             runHourly();
             hourlyLastRanAt = getCurrentHour();
         }
+
+        clock_gettime(CLOCK_MONOTONIC, &cycleEnd);
+        emi_metrics_add(pollCounters->cycles, 1);
+        emi_metrics_observe(&pollCounters->cycle_duration, elapsedMicroseconds(&cycleStart, &cycleEnd));
+
+        if (burst)
+        {
+            /* Burst mode uses the whole interval to sample */
+            runBurst(POLL_INTERVAL_MS);
+            mqtt_disconnect(client);
+            continue;
+        }
+
         mqtt_disconnect(client);
-        usleep(5000 * 1000);
+        if (rtPriority > 0)
+        {
+            /* On a fixed period, the wake-up lateness tells the scheduling jitter */
+            nextCycle.tv_sec += POLL_INTERVAL_MS / 1000;
+            nextCycle.tv_nsec += (POLL_INTERVAL_MS % 1000) * 1000000;
+            if (nextCycle.tv_nsec >= 1000000000)
+            {
+                nextCycle.tv_sec++;
+                nextCycle.tv_nsec -= 1000000000;
+            }
+            emi_rt_sleep_until(&rt, &nextCycle);
+        }
+        else
+        {
+            usleep(POLL_INTERVAL_MS * 1000);
+        }
     }
 
     /* Close the connection */
     modbus_close(ctx);
     modbus_free(ctx);
+    emi_tsdb_close(history);
+    emi_cache_close(cache);
 
     return 0;
 }
 
 void runContinuously()
 {
-    int localRc = 0;
-    localRc += getDoubleFromUInt16(ctx, 0x006c, -1, &instVoltageL1);
-    localRc += getDoubleFromUInt16(ctx, 0x006d, -1, &instCurrentL1);
-    localRc += getDoubleFromUInt32(ctx, 0x0079, 0, &instActivePower);
-    localRc += getDoubleFromUInt32(ctx, 0x0016, 0, &activeEnergyImport);
-    localRc += getDoubleFromUInt16(ctx, 0x007F, -1, &instFrequency);
-    localRc += getDoubleFromUInt16(ctx, 0x007B, -3, &instPowerFactor);
-    localRc += getDoubleFromUInt32(ctx, 0x0026, 0, &rate1ActiveEnergy);
-    localRc += getDoubleFromUInt32(ctx, 0x0027, 0, &rate2ActiveEnergy);
-    localRc += getDoubleFromUInt32(ctx, 0x0028, 0, &rate3ActiveEnergy);
-    localRc += getDoubleFromUInt32(ctx, 0x002C, 0, &totalRateActiveEnergy);
-
-    if (localRc != 10)
+    int localRc, clockRc;
+
+    emi_rt_enter(&rt);
+    emi_metrics_observe(&pollCounters->bus_wait, emi_bus_acquire(&bus, EMI_BUS_PRIORITY_POLL));
+    localRc = readValues(ctx, instantValues, NB_INSTANT_VALUES);
+    clockRc = getTime(ctx, &meter.clock);
+    emi_bus_release(&bus);
+    emi_rt_leave(&rt);
+
+    lastCycleReads = localRc;
+    emi_metrics_add(pollCounters->samples_read, localRc);
+    if (localRc != NB_INSTANT_VALUES)
     {
+        emi_metrics_add(pollCounters->samples_dropped, NB_INSTANT_VALUES);
         // we should re-read;
-        printf("read bad values. Expected 10, but got only %d successful reads.\n", localRc);
+        printf("read bad values. Expected %d, but got only %d successful reads.\n", NB_INSTANT_VALUES, localRc);
+        return;
+    }
+
+    publishValues(clockRc == 1);
+}
+
+/* The instant values just read go down the pipeline */
+void publishValues(int clockRead)
+{
+    int i;
+
+    if (shadow != NULL)
+    {
+        struct timespec now;
+        int64_t ts;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        for (i = 0; i < NB_INSTANT_VALUES; i++)
+        {
+            emi_shadow_update(shadow, i, instantValues[i].raw, instantValues[i].value, ts);
+        }
+    }
+
+    for (i = 0; publishInstant && i < NB_INSTANT_VALUES; i++)
+    {
+        mqttrc = _MQTTClient_publishDouble(client, instantValues[i].topic, instantValues[i].value, instantValues[i].decimals);
+    }
+
+    if (history != NULL)
+    {
+        recordHistory();
+    }
+
+    if (rollups != NULL)
+    {
+        recordRollups();
+    }
+
+    if (clockRead)
+    {
+        char clockTime[64];
+        snprintf(clockTime, sizeof(clockTime), "%02d-%02d-%02dT%02d:%02d:%02dZ\n", meter.clock.year, meter.clock.month,
+                 meter.clock.day, meter.clock.hour, meter.clock.minute, meter.clock.second);
+        mqttrc = _MQTTClient_publishString(client, "emi/clockTime", clockTime);
+    }
+}
+
+/* Listen-only: the other master reads the instant values at its own pace. The
+   shadow is updated by each of its transactions, and the values of a round
+   are published when it has read all of them, or a value a third time (two
+   cycles of a master that doesn't read them all) */
+void runSniffer(char **argv)
+{
+    static modbus_sniff_t sniffState;
+    unsigned char statsLastPrintedAt = getCurrentHour();
+
+    sniff = &sniffState;
+    modbus_sniff_init(sniff);
+    clock_gettime(CLOCK_MONOTONIC, &sniffRoundStart);
+    while (!stopping)
+    {
+        if (modbus_sniff_receive(ctx, sniff, sniffedTransaction, argv) == -1 && errno != ETIMEDOUT && errno != EINTR)
+        {
+            fprintf(stderr, "Could not listen to the line: %s\n", modbus_strerror(errno));
+            sleep(1);
+        }
+
+        if (getCurrentHour() != statsLastPrintedAt)
+        {
+            printModbusStats();
+            statsLastPrintedAt = getCurrentHour();
+        }
+    }
+}
+
+void sniffedTransaction(const uint8_t *req, int reqLength, const uint8_t *rsp, int rspLength, void *user)
+{
+    uint8_t updated[NB_INSTANT_VALUES] = {0};
+    struct timespec now;
+    int64_t ts;
+    int repeated = FALSE, seen = 0;
+    int i;
+
+    if (req[0] != serverId || readSniffedValues(req, rsp, rspLength, instantValues, NB_INSTANT_VALUES, updated) == 0)
+    {
         return;
     }
 
-    mqttrc = _MQTTClient_publishDouble(client, "emi/L1/voltage", instVoltageL1, 1);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/L1/activeEnergyImport", activeEnergyImport, 0);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/L1/current", instCurrentL1, 1);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/L1/activePower", instActivePower, 0);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/L1/frequency", instFrequency, 1);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/L1/powerFactor", instPowerFactor, 3);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/tariff/rate1ActiveEnergy", rate1ActiveEnergy, 0);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/tariff/rate2ActiveEnergy", rate2ActiveEnergy, 0);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/tariff/rate3ActiveEnergy", rate3ActiveEnergy, 0);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/tariff/totalRateActiveEnergy", totalRateActiveEnergy, 0);
-
-    emiClock = getTime(ctx);
-    char clockTime[64];
-    sprintf(clockTime, "%02d-%02d-%02dT%02d:%02d:%02dZ\n", emiClock->year, emiClock->month, emiClock->day, emiClock->hour, emiClock->minute, emiClock->second);
-    mqttrc = _MQTTClient_publishString(client, "emi/clockTime", clockTime);
-    free(emiClock);
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    for (i = 0; i < NB_INSTANT_VALUES; i++)
+    {
+        if (updated[i])
+        {
+            sniffedValues[i]++;
+            repeated |= sniffedValues[i] == 3;
+            if (shadow != NULL)
+            {
+                emi_shadow_update(shadow, i, instantValues[i].raw, instantValues[i].value, ts);
+            }
+        }
+        seen += sniffedValues[i] > 0;
+    }
+    if (seen == NB_INSTANT_VALUES || repeated)
+    {
+        publishSniffedValues(user);
+    }
+}
+
+/* The values read in the round of the other master. History and rollups keep
+   all the series aligned, so only complete rounds are recorded */
+void publishSniffedValues(char **argv)
+{
+    static uint8_t lastRound[NB_INSTANT_VALUES];
+    static int rounds = 0;
+    uint8_t round[NB_INSTANT_VALUES];
+    struct timespec roundEnd;
+    int i, seen = 0;
+
+    for (i = 0; i < NB_INSTANT_VALUES; i++)
+    {
+        round[i] = sniffedValues[i] > 0;
+        seen += round[i];
+    }
+    emi_metrics_add(pollCounters->samples_read, seen);
+    emi_metrics_add(pollCounters->samples_dropped, NB_INSTANT_VALUES - seen);
+
+    mqtt_connect(client, argv);
+    for (i = 0; publishInstant && i < NB_INSTANT_VALUES; i++)
+    {
+        if (round[i])
+        {
+            mqttrc = _MQTTClient_publishDouble(client, instantValues[i].topic, instantValues[i].value,
+                                               instantValues[i].decimals);
+        }
+    }
+    /* Before disconnecting, as the rollups closed are published */
+    if (seen == NB_INSTANT_VALUES)
+    {
+        if (history != NULL)
+        {
+            recordHistory();
+        }
+        if (rollups != NULL)
+        {
+            recordRollups();
+        }
+    }
+    mqtt_disconnect(client);
+
+    if (seen < NB_INSTANT_VALUES && rounds > 0 && memcmp(lastRound, round, sizeof(lastRound)) != 0)
+    {
+        /* Told once, not at every round. The first one may have been joined
+           midway */
+        printf("sniff: the other master doesn't read %d of the values, registers", NB_INSTANT_VALUES - seen);
+        for (i = 0; i < NB_INSTANT_VALUES; i++)
+        {
+            if (!round[i])
+            {
+                printf(" 0x%04x", instantValues[i].registerAddress);
+            }
+        }
+        printf("\n");
+    }
+    if (rounds++ > 0)
+    {
+        memcpy(lastRound, round, sizeof(lastRound));
+    }
+    memset(sniffedValues, 0, sizeof(sniffedValues));
+
+    clock_gettime(CLOCK_MONOTONIC, &roundEnd);
+    emi_metrics_add(pollCounters->cycles, 1);
+    emi_metrics_observe(&pollCounters->cycle_duration, elapsedMicroseconds(&sniffRoundStart, &roundEnd));
+    sniffRoundStart = roundEnd;
+}
+
+void printModbusStats()
+{
+    static modbus_stats_t stats;
+    const modbus_histogram_t *latency;
+    uint64_t exceptions = 0;
+    int i;
+
+    modbus_get_stats(ctx, &stats);
+    for (i = 0; i < MODBUS_STATS_MAX_EXCEPTION; i++)
+    {
+        exceptions += stats.exceptions[i];
+    }
+
+    latency = &stats.slave_latency[serverId];
+    printf("modbus: %llu requests, %llu timeouts, %llu crc errors, %llu bad responses, %llu exceptions, "
+           "%llu retries, %llu flushes, %llu reconnects, %llu us mean latency, %.0f us jitter, %llu us max\n",
+           (unsigned long long)stats.requests, (unsigned long long)stats.timeouts,
+           (unsigned long long)stats.crc_errors, (unsigned long long)stats.bad_data,
+           (unsigned long long)exceptions, (unsigned long long)stats.retries,
+           (unsigned long long)stats.flushes, (unsigned long long)stats.reconnects,
+           (unsigned long long)(latency->count ? latency->sum_us / latency->count : 0),
+           emi_metrics_jitter_us(latency), (unsigned long long)latency->max_us);
+
+    /* Where the bus time of a transaction goes */
+    if (latency->count > 0)
+    {
+        printf("modbus: per transaction %llu us tx wire, %llu us turnaround, %llu us rx wire, %llu us rx overhead\n",
+               (unsigned long long)(stats.tx_wire_us / stats.turnaround.count),
+               (unsigned long long)(stats.turnaround.sum_us / stats.turnaround.count),
+               (unsigned long long)(stats.rx_wire_us / stats.turnaround.count),
+               (unsigned long long)(stats.rx_overhead.sum_us / stats.rx_overhead.count));
+    }
+
+    if (rt.wakeup.count > 0)
+    {
+        printf("realtime: wake-up lateness %.0f us mean, %.0f us jitter, %.0f us max\n", rt.wakeup.mean,
+               emi_stats_stddev(&rt.wakeup), rt.wakeup.max);
+    }
+
+    printf("regcache: %llu hits, %llu misses, %llu shared\n", (unsigned long long)regcache.hits,
+           (unsigned long long)regcache.misses, (unsigned long long)regcache.shared);
+    if (query.requests > 0)
+    {
+        printf("query: %llu requests in %llu bus reads\n", (unsigned long long)query.requests,
+               (unsigned long long)query.transactions);
+    }
+    if (sniff != NULL)
+    {
+        printf("sniff: %llu frames, %llu transactions, %llu responses without request, %llu bytes dropped\n",
+               (unsigned long long)sniff->frames, (unsigned long long)sniff->pairs,
+               (unsigned long long)sniff->orphans, (unsigned long long)sniff->dropped);
+    }
+    if (gateway.forwarded + gateway.cached + gateway.busy > 0)
+    {
+        printf("gateway: %llu requests forwarded, %llu answered from the cache, %llu refused as busy\n",
+               (unsigned long long)gateway.forwarded, (unsigned long long)gateway.cached,
+               (unsigned long long)gateway.busy);
+    }
+}
+
+/* SIGUSR1 handler, only async-signal-safe calls */
+void dumpTrace(int signum)
+{
+    int saved_errno = errno;
+    int fd = open(traceFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd != -1)
+    {
+        modbus_trace_dump(ctx, fd);
+        close(fd);
+    }
+    errno = saved_errno;
+}
+
+void recordHistory()
+{
+    static int64_t lastFlush = 0;
+    struct timespec now;
+    int64_t ts;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    for (i = 0; i < NB_INSTANT_VALUES; i++)
+    {
+        /* Series are named after the topic, without the common prefix */
+        const char *series = instantValues[i].topic + strlen(TOPIC_PREFIX);
+        if (emi_tsdb_append(history, serverId, series, ts, instantValues[i].value) == -1)
+        {
+            fprintf(stderr, "Could not record %s: %s\n", series, strerror(errno));
+        }
+    }
+
+    if (ts - lastFlush >= HISTORY_FLUSH_INTERVAL_MS)
+    {
+        emi_tsdb_flush(history);
+        lastFlush = ts;
+    }
+}
+
+void stop(int signum)
+{
+    stopping = TRUE;
 }
 
 void runHourly()
 {
     int localRc = 0;
+    int idRc;
 
-    double currentlyActiveTariff;
-    localRc += getDoubleFromUInt16(ctx, 0x000b, 0, &currentlyActiveTariff);
-    char *activityCalendarActiveName = getOctetString(ctx, 0x0006, 6);
-    char *deviceId2 = getOctetString(ctx, 0x0003, 6);
-    char *deviceId1 = getOctetString(ctx, 0x0002, 10);
-    char *activeCoreFirmwareId = getOctetString(ctx, 0x0004, 5);
-    char *activeAppFirmwareId = getOctetString(ctx, 0x0005, 5);
-    char *activeComFirmwareId = getOctetString(ctx, 0x0006, 5);
+    emi_rt_enter(&rt);
+    emi_metrics_observe(&pollCounters->bus_wait, emi_bus_acquire(&bus, EMI_BUS_PRIORITY_POLL));
+    localRc += getDoubleFromUInt16(ctx, 0x000b, 0, &meter.currentlyActiveTariff);
+    getOctetString(ctx, 0x0006, 6, meter.activityCalendarActiveName);
+    getOctetString(ctx, 0x0003, 6, meter.deviceId2);
+    idRc = getOctetString(ctx, 0x0002, 10, meter.deviceId1);
+    getOctetString(ctx, 0x0004, 5, meter.activeCoreFirmwareId);
+    getOctetString(ctx, 0x0005, 5, meter.activeAppFirmwareId);
+    getOctetString(ctx, 0x0006, 5, meter.activeComFirmwareId);
 
     localRc += getDoubleFromUInt32(ctx, 0x0012, -3, &currentApparentPowerThreshold);
+    emi_bus_release(&bus);
+    emi_rt_leave(&rt);
 
     mqttrc = _MQTTClient_publishDouble(client, "emi/tariff/currentApparentPowerThreshold", currentApparentPowerThreshold, 2);
-    mqttrc = _MQTTClient_publishDouble(client, "emi/currentlyActiveTariff", currentlyActiveTariff, 1);
-    mqttrc = _MQTTClient_publishString(client, "emi/activityCalendarActiveName", activityCalendarActiveName);
-    mqttrc = _MQTTClient_publishString(client, "emi/serialNumber", deviceId1);
-
-    free(deviceId1);
-    free(deviceId2);
-    free(activeCoreFirmwareId);
-    free(activeAppFirmwareId);
-    free(activeComFirmwareId);
-    free(activityCalendarActiveName);
+    mqttrc = _MQTTClient_publishDouble(client, "emi/currentlyActiveTariff", meter.currentlyActiveTariff, 1);
+    mqttrc = _MQTTClient_publishString(client, "emi/activityCalendarActiveName", meter.activityCalendarActiveName);
+    mqttrc = _MQTTClient_publishString(client, "emi/serialNumber", meter.deviceId1);
+
+    if (cache != NULL)
+    {
+        updateCache(idRc == 1, localRc == 2 && idRc == 1);
+    }
+
+    printModbusStats();
 }
 
-char *getOctetString(modbus_t *ctx, uint16_t registerAddress, uint8_t nb)
+void updateCache(int idRead, int readOk)
 {
-    char *string = malloc(nb + 1 * sizeof(char));
-    string[nb] = 0; // set string terminator
-    int rc = modbus_read_input_registers(ctx, registerAddress, 1, nb, string);
+    emi_cache_data_t *cached = emi_cache_data(cache);
 
-    if (rc != 1)
+    if (cacheUnverified)
     {
-        string[0] = '\0';
+        if (!idRead)
+        {
+            /* A transient error proves nothing, but a meter silent since the
+               start doesn't answer at the cached line settings */
+            if (lastCycleReads == 0 || ++cacheVerifyFailures == CACHE_VERIFY_ATTEMPTS)
+            {
+                printf("meter doesn't answer at the cached settings, restarting without the cache.\n");
+                emi_cache_invalidate(cache);
+                exit(EXIT_FAILURE);
+            }
+            printf("couldn't read the device id to verify the cache, retrying next hour.\n");
+            return;
+        }
+        cacheUnverified = FALSE;
+        if (strcmp(cached->meter.deviceId1, meter.deviceId1) != 0)
+        {
+            printf("meter doesn't match the cache, restarting without it.\n");
+            emi_cache_invalidate(cache);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    return string;
+    if (readOk)
+    {
+        snprintf(cached->device, sizeof(cached->device), "%s", meterLine.device);
+        cached->slave = meterLine.slave;
+        cached->baud = meterLine.baud;
+        cached->parity = meterLine.parity;
+        cached->stopBit = meterLine.stop_bit;
+        cached->meter = meter;
+        cached->currentApparentPowerThreshold = currentApparentPowerThreshold;
+        cached->blockRead = burstBlockRead;
+        emi_cache_commit(cache);
+    }
 }
 
-double scaleInt(int num, int scaler)
+void recordRollups()
 {
-    if (scaler == 0)
-    {
-        // No effect
-        return num;
-    }
-    else
+    struct timespec now;
+    int64_t ts;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    /* Series indexes match the instantValues indexes */
+    for (i = 0; i < NB_INSTANT_VALUES; i++)
     {
-        return num * pow(10, scaler);
+        emi_rollup_sample(rollups, i, ts, instantValues[i].value);
     }
 }
 
-int getDoubleFromUInt16(modbus_t *ctx, uint16_t registerAddress, signed char scaler, double *res)
+void publishRollup(int series, emi_rollup_window_length_t window, const emi_rollup_result_t *result, void *user)
 {
-    uint16_t buffer;
-    int rc = modbus_read_input_registers(ctx, registerAddress, 1, 2, &buffer);
-    *res = scaleInt(__bswap_16(buffer), scaler);
-    return rc;
+    const emi_value_t *value = &instantValues[series];
+    char topic[128];
+    char payload[256];
+    int decimals = value->decimals;
+
+    snprintf(topic, sizeof(topic), "%s/%s", value->topic, emi_rollup_window_name(window));
+    snprintf(payload, sizeof(payload),
+             "{\"start\":%lld,\"end\":%lld,\"count\":%u,\"min\":%.*f,\"max\":%.*f,\"mean\":%.*f,\"last\":%.*f,\"delta\":%.*f}",
+             (long long)result->start / 1000, (long long)result->end / 1000, result->count,
+             decimals, result->min, decimals, result->max, decimals + 1, result->mean,
+             decimals, result->last, decimals, value->counter ? result->delta : 0.0);
+    mqttrc = _MQTTClient_publishString(client, topic, payload);
 }
 
-int getDoubleFromUInt32(modbus_t *ctx, uint16_t registerAddress, signed char scaler, double *res)
+int readBurstRegisters(uint16_t *buffer)
 {
-    uint32_t buffer;
-    int rc = modbus_read_input_registers(ctx, registerAddress, 1, 4, &buffer);
-    *res = scaleInt(__bswap_32(buffer), scaler);
-    return rc;
+    if (burstBlockRead)
+    {
+        int rc = modbus_read_input_registers(ctx, BURST_FIRST_REGISTER, NB_BURST_CHANNELS, 2, buffer);
+        if (rc != -1 || (errno != EMBXILADD && errno != EMBXILVAL))
+        {
+            return rc == NB_BURST_CHANNELS;
+        }
+
+        printf("meter refused a block read, falling back to one request per register.\n");
+        burstBlockRead = FALSE;
+    }
+
+    return modbus_read_input_registers(ctx, BURST_FIRST_REGISTER + BURST_VOLTAGE, 1, 2, &buffer[BURST_VOLTAGE]) == 1 &&
+           modbus_read_input_registers(ctx, BURST_FIRST_REGISTER + BURST_CURRENT, 1, 2, &buffer[BURST_CURRENT]) == 1;
 }
 
-emi_clock_t *getTime(modbus_t *ctx)
+void runBurst(int durationMs)
 {
-    emi_clock_t *emiClock = malloc(1 * sizeof(emi_clock_t));
-    int rc = modbus_read_input_registers(ctx, 0x0001, 1, sizeof(emi_clock_t), emiClock);
-    if (rc != 0)
+    struct timespec start, now;
+    int64_t elapsed;
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < NB_BURST_CHANNELS; i++)
     {
+        emi_burst_channel_reset(&burstChannels[i]);
+    }
+
+    emi_rt_enter(&rt);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        uint16_t buffer[NB_BURST_CHANNELS];
+        struct timespec sampledAt;
+        int sampled;
+
+        /* Per sample, so that queries and the gateway get the bus between two */
+        emi_metrics_observe(&pollCounters->bus_wait, emi_bus_acquire(&bus, EMI_BUS_PRIORITY_POLL));
+        sampled = readBurstRegisters(buffer);
+        emi_bus_release(&bus);
+        if (sampled)
+        {
+            clock_gettime(CLOCK_REALTIME, &sampledAt);
+            for (i = 0; i < NB_BURST_CHANNELS; i++)
+            {
+                emi_burst_channel_sample(&burstChannels[i], i,
+                                         (int64_t)sampledAt.tv_sec * 1000 + sampledAt.tv_nsec / 1000000,
+                                         decodeUInt16((uint8_t *)&buffer[i], -1), publishThresholdEvent, NULL);
+            }
+        }
+        else
+        {
+            errors++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (int64_t)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    } while (elapsed < durationMs);
+    emi_rt_leave(&rt);
+
+    for (i = 0; i < NB_BURST_CHANNELS; i++)
+    {
+        const emi_burst_channel_t *channel = &burstChannels[i];
+        char topic[128];
+        char payload[256];
+
+        if (channel->stats.count == 0)
+        {
+            continue;
+        }
+
+        snprintf(topic, sizeof(topic), "%s/burst", burstTopics[i]);
+        snprintf(payload, sizeof(payload),
+                 "{\"count\":%u,\"errors\":%d,\"min\":%.1f,\"max\":%.1f,\"mean\":%.2f,\"stddev\":%.3f,\"events\":%u}",
+                 channel->stats.count, errors, channel->stats.min, channel->stats.max, channel->stats.mean,
+                 emi_stats_stddev(&channel->stats), channel->threshold.events);
+        mqttrc = _MQTTClient_publishString(client, topic, payload);
     }
-    emiClock->year = __bswap_16(emiClock->year);
-    emiClock->deviation = __bswap_16(emiClock->deviation);
-    return emiClock;
+}
+
+void publishThresholdEvent(int channel, const emi_threshold_event_t *event, void *user)
+{
+    char topic[128];
+    char payload[128];
+
+    snprintf(topic, sizeof(topic), "%s/event", burstTopics[channel]);
+    snprintf(payload, sizeof(payload), "{\"type\":\"%s\",\"start\":%lld,\"duration\":%lld,\"extreme\":%.1f}",
+             event->type == EMI_THRESHOLD_LOW ? "low" : "high",
+             (long long)event->start, (long long)event->duration, event->extreme);
+    mqttrc = _MQTTClient_publishString(client, topic, payload);
 }
 
 int _MQTTClient_publishInt(MQTTClient handle, const char *topicName, int n)
 {
-    char *str = malloc(32);
-    sprintf(str, "%d", n);
-    int rc = MQTTClient_publish(handle, topicName, strlen(str), str, 1, 0, NULL);
-    free(str);
-    return rc;
+    char str[32];
+    snprintf(str, sizeof(str), "%d", n);
+    return _MQTTClient_publishString(handle, topicName, str);
 }
 
 int _MQTTClient_publishDouble(MQTTClient handle, const char *topicName, double n, uint8_t decimals)
 {
-    char *str = malloc(32);
-    sprintf(str, "%.*f", decimals, n);
-    int rc = MQTTClient_publish(handle, topicName, strlen(str), str, 1, 0, NULL);
-    free(str);
-    return rc;
+    char str[32];
+    formatDouble(str, sizeof(str), n, decimals);
+    return _MQTTClient_publishString(handle, topicName, str);
 }
 
 int _MQTTClient_publishString(MQTTClient handle, const char *topicName, char *str)
 {
-    return MQTTClient_publish(handle, topicName, strlen(str), str, 1, 0, NULL);
+    struct timespec start, end;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = MQTTClient_publish(handle, topicName, strlen(str), str, 1, 0, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    emi_metrics_add(pollCounters->publishes, 1);
+    if (rc != MQTTCLIENT_SUCCESS)
+    {
+        emi_metrics_add(pollCounters->publish_errors, 1);
+    }
+    emi_metrics_observe(&pollCounters->publish_latency, elapsedMicroseconds(&start, &end));
+
+    return rc;
+}
+
+uint64_t elapsedMicroseconds(const struct timespec *start, const struct timespec *end)
+{
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+double queryPending(void *user)
+{
+    return __atomic_load_n(&query.nb_pending, __ATOMIC_RELAXED);
+}
+
+double gatewayQueued(void *user)
+{
+    return __atomic_load_n(&gateway.nb_queued, __ATOMIC_RELAXED);
+}
+
+double pendingDeliveries(void *user)
+{
+    MQTTClient_deliveryToken *tokens = NULL;
+    int n = 0;
+
+    if (MQTTClient_getPendingDeliveryTokens(client, &tokens) == MQTTCLIENT_SUCCESS && tokens != NULL)
+    {
+        while (tokens[n] != -1)
+        {
+            n++;
+        }
+        MQTTClient_free(tokens);
+    }
+
+    return n;
 }
 
 unsigned char getCurrentHour()
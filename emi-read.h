@@ -1,48 +1,33 @@
 #include "light-modbus/light-modbus-rtu.h"
+#include "light-modbus/light-modbus-sniff.h"
+#include "emi-burst.h"
+#include "emi-decode.h"
+#include "emi-meter.h"
+#include "emi-rollup.h"
 
-typedef struct __attribute__ ((__packed__)) {
-    uint16_t year;
-    uint8_t month;
-    uint8_t day;
-    uint8_t weekday;
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t second;
-    uint8_t hundredthOfSecond;
-    uint16_t deviation;
-    uint8_t clockStatus;
-} emi_clock_t;
-
-char* getOctetString(modbus_t* ctx, uint16_t registerAddress, uint8_t nb);
-
-/**
- * @brief Get the Double From U Int16 object
- * 
- * @param ctx the modbus context.
- * @param registerAddress the register address to read from
- * @param scaller the scaller to apply (* 10 ^ {scaller})
- * @param res the palce to store the result
- * @return the return value from the inner modbus_read_input_registers call.
- */
-int getDoubleFromUInt16(modbus_t* ctx, uint16_t registerAddress, signed char scaller, double* res);
-
-/**
- * @brief Get the Double From U Int32 object
- * 
- * @param ctx the modbus context.
- * @param registerAddress the register address to read from
- * @param scaller the scaller to apply (* 10 ^ {scaller})
- * @param res the palce to store the result
- * @return the return value from the inner modbus_read_input_registers call.
- */
-int getDoubleFromUInt32(modbus_t* ctx, uint16_t registerAddress, signed char scaler, double* res);
-
-emi_clock_t* getTime(modbus_t* ctx);
 int _MQTTClient_publishInt(MQTTClient handle, const char* topicName, int n);
 int _MQTTClient_publishDouble(MQTTClient handle, const char* topicName, double n, uint8_t decimals);
 int _MQTTClient_publishString(MQTTClient handle, const char* topicName, char* str);
+uint64_t elapsedMicroseconds(const struct timespec* start, const struct timespec* end);
+double pendingDeliveries(void* user);
+double queryPending(void* user);
+double gatewayQueued(void* user);
 void runContinuously();
+void publishValues(int clockRead);
+void runSniffer(char** argv);
+void sniffedTransaction(const uint8_t* req, int reqLength, const uint8_t* rsp, int rspLength, void* user);
+void publishSniffedValues(char** argv);
 void runHourly();
+void updateCache(int idRead, int readOk);
+void printModbusStats();
+void dumpTrace(int signum);
+void recordHistory();
+void stop(int signum);
+void recordRollups();
+void publishRollup(int series, emi_rollup_window_length_t window, const emi_rollup_result_t* result, void* user);
+void runBurst(int durationMs);
+int readBurstRegisters(uint16_t* buffer);
+void publishThresholdEvent(int channel, const emi_threshold_event_t* event, void* user);
 unsigned char getCurrentHour();
 
 void mqtt_connect(MQTTClient client, char** argv);
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "emi-regcache.h"
+
+static int64_t nowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint32_t ttlOf(const emi_regcache_t *cache, int addr)
+{
+    int i;
+
+    for (i = 0; i < cache->nbRules; i++)
+    {
+        if (addr >= cache->rules[i].first && addr <= cache->rules[i].last)
+        {
+            return cache->rules[i].ttlMs;
+        }
+    }
+    return cache->defaultTtlMs;
+}
+
+/* The entry holding the read, or the one of the same register read at a
+   greater length */
+static emi_regcache_entry_t *lookup(emi_regcache_t *cache, int slave, int addr, int nb, uint8_t size)
+{
+    emi_regcache_entry_t *found = NULL;
+    int i;
+
+    for (i = 0; i < cache->nbEntries; i++)
+    {
+        emi_regcache_entry_t *entry = &cache->entries[i];
+        if (entry->slave != slave || entry->address != addr || entry->nb != nb || entry->size < size)
+        {
+            continue;
+        }
+        if (entry->size == size)
+        {
+            return entry;
+        }
+        found = entry;
+    }
+    return found;
+}
+
+/* A free entry, or the least recently used one not being read */
+static emi_regcache_entry_t *allocate(emi_regcache_t *cache)
+{
+    emi_regcache_entry_t *oldest = NULL;
+    int i;
+
+    if (cache->nbEntries < EMI_REGCACHE_ENTRIES)
+    {
+        return &cache->entries[cache->nbEntries++];
+    }
+    for (i = 0; i < cache->nbEntries; i++)
+    {
+        emi_regcache_entry_t *entry = &cache->entries[i];
+        if (!entry->inFlight && (oldest == NULL || entry->lastUsed < oldest->lastUsed))
+        {
+            oldest = entry;
+        }
+    }
+    return oldest;
+}
+
+static int copyResult(const emi_regcache_entry_t *entry, int nb, uint8_t size, void *dest)
+{
+    if (entry->rc == -1)
+    {
+        errno = entry->error;
+        return -1;
+    }
+    memcpy(dest, entry->value, nb * size);
+    return entry->rc;
+}
+
+/* Keeps a read that isn't cached, for emi_regcache_peek() */
+static void record(emi_regcache_t *cache, int slave, int addr, int nb, uint8_t size, const void *value)
+{
+    emi_regcache_entry_t *entry;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = lookup(cache, slave, addr, nb, size);
+    if (entry == NULL || entry->size != size)
+    {
+        entry = allocate(cache);
+    }
+    if (entry != NULL && !entry->inFlight)
+    {
+        entry->slave = slave;
+        entry->address = addr;
+        entry->nb = nb;
+        entry->size = size;
+        entry->rc = nb;
+        entry->fetchedAt = nowMs();
+        entry->lastUsed = entry->fetchedAt;
+        memcpy(entry->value, value, nb * size);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void emi_regcache_init(emi_regcache_t *cache, uint32_t defaultTtlMs)
+{
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->done, NULL);
+    cache->defaultTtlMs = defaultTtlMs;
+}
+
+int emi_regcache_set_ttl(emi_regcache_t *cache, uint16_t first, uint16_t last, uint32_t ttlMs)
+{
+    if (first > last)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (cache->nbRules == EMI_REGCACHE_RULES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->rules[cache->nbRules].first = first;
+    cache->rules[cache->nbRules].last = last;
+    cache->rules[cache->nbRules].ttlMs = ttlMs;
+    cache->nbRules++;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+int emi_regcache_read(emi_regcache_t *cache, modbus_t *ctx, int addr, int nb, uint8_t size, void *dest)
+{
+    emi_regcache_entry_t *entry;
+    uint32_t ttl;
+    int slave = modbus_get_slave(ctx);
+    int rc, error;
+
+    ttl = ttlOf(cache, addr);
+    if (ttl == 0 || nb * size > EMI_REGCACHE_MAX_VALUE)
+    {
+        rc = modbus_read_input_registers(ctx, addr, nb, size, dest);
+        if (rc != -1 && nb * size <= EMI_REGCACHE_MAX_VALUE)
+        {
+            record(cache, slave, addr, nb, size, dest);
+        }
+        return rc;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    while ((entry = lookup(cache, slave, addr, nb, size)) != NULL && entry->inFlight)
+    {
+        /* Single flight: the result of the request being made is ours too */
+        pthread_cond_wait(&cache->done, &cache->lock);
+        entry = lookup(cache, slave, addr, nb, size);
+        if (entry != NULL && !entry->inFlight)
+        {
+            cache->shared++;
+            entry->lastUsed = nowMs();
+            rc = copyResult(entry, nb, size, dest);
+            pthread_mutex_unlock(&cache->lock);
+            return rc;
+        }
+    }
+
+    if (entry != NULL && entry->rc != -1 && nowMs() - entry->fetchedAt < ttl)
+    {
+        cache->hits++;
+        entry->lastUsed = nowMs();
+        rc = copyResult(entry, nb, size, dest);
+        pthread_mutex_unlock(&cache->lock);
+        return rc;
+    }
+
+    if (entry == NULL || entry->size != size)
+    {
+        entry = allocate(cache);
+    }
+    if (entry == NULL)
+    {
+        /* Every entry is being read */
+        pthread_mutex_unlock(&cache->lock);
+        return modbus_read_input_registers(ctx, addr, nb, size, dest);
+    }
+    entry->slave = slave;
+    entry->address = addr;
+    entry->nb = nb;
+    entry->size = size;
+    entry->inFlight = 1;
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    rc = modbus_read_input_registers(ctx, addr, nb, size, dest);
+    error = errno;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->rc = rc;
+    entry->error = error;
+    entry->fetchedAt = nowMs();
+    entry->lastUsed = entry->fetchedAt;
+    if (rc != -1)
+    {
+        memcpy(entry->value, dest, nb * size);
+    }
+    entry->inFlight = 0;
+    pthread_cond_broadcast(&cache->done);
+    pthread_mutex_unlock(&cache->lock);
+
+    errno = error;
+    return rc;
+}
+
+int emi_regcache_peek(emi_regcache_t *cache, int slave, int addr, int nb, uint32_t maxAgeMs, void *dest,
+                      uint8_t *size)
+{
+    emi_regcache_entry_t *found = NULL;
+    int64_t now = nowMs();
+    int i;
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < cache->nbEntries; i++)
+    {
+        emi_regcache_entry_t *entry = &cache->entries[i];
+        if (entry->slave == slave && entry->address == addr && entry->nb == nb && !entry->inFlight &&
+            entry->rc != -1 && now - entry->fetchedAt <= maxAgeMs && (found == NULL || entry->size > found->size))
+        {
+            found = entry;
+        }
+    }
+    if (found == NULL)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    *size = found->size;
+    memcpy(dest, found->value, nb * found->size);
+    pthread_mutex_unlock(&cache->lock);
+    return nb;
+}
+
+void emi_regcache_invalidate(emi_regcache_t *cache, int slave)
+{
+    int i;
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < cache->nbEntries; i++)
+    {
+        if (cache->entries[i].slave == slave && !cache->entries[i].inFlight)
+        {
+            /* Expired for any time to live, refetched at the next read */
+            cache->entries[i].fetchedAt = INT64_MIN / 2;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
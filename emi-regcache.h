@@ -0,0 +1,95 @@
+#ifndef EMI_REGCACHE_H
+#define EMI_REGCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "light-modbus/light-modbus.h"
+
+/* Read-through cache of input registers, keyed by slave, address and count.
+ * A register read again within its time to live is served from the cache,
+ * and concurrent reads of the same register share a single request. Reads
+ * with a time to live of 0 go straight to the bus, their results are only
+ * kept for emi_regcache_peek().
+ *
+ * A read of fewer bytes than a cached one is served from its first bytes, as
+ * the octet strings read at different lengths. The cache doesn't serialise
+ * the requests themselves: callers sharing a modbus_t still take turns. */
+
+#define EMI_REGCACHE_ENTRIES 64
+#define EMI_REGCACHE_RULES 16
+/* Largest read cached, bytes */
+#define EMI_REGCACHE_MAX_VALUE 32
+
+typedef struct {
+    int slave;
+    uint16_t address;
+    int nb;
+    uint8_t size;
+    /* Being read by a thread, the others wait for its result */
+    int inFlight;
+    /* Result of the read, -1 with the errno */
+    int rc;
+    int error;
+    /* CLOCK_MONOTONIC, ms */
+    int64_t fetchedAt;
+    int64_t lastUsed;
+    uint8_t value[EMI_REGCACHE_MAX_VALUE];
+} emi_regcache_entry_t;
+
+typedef struct {
+    uint16_t first;
+    uint16_t last;
+    uint32_t ttlMs;
+} emi_regcache_rule_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint32_t defaultTtlMs;
+    emi_regcache_rule_t rules[EMI_REGCACHE_RULES];
+    int nbRules;
+    emi_regcache_entry_t entries[EMI_REGCACHE_ENTRIES];
+    int nbEntries;
+    /* Reads served from the cache, from the bus, and from another thread's
+       request */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t shared;
+} emi_regcache_t;
+
+/**
+ * @brief Initialise an empty cache, registers living defaultTtlMs unless a
+ * rule says otherwise.
+ */
+void emi_regcache_init(emi_regcache_t* cache, uint32_t defaultTtlMs);
+
+/**
+ * @brief Set the time to live of the registers first to last, of every slave.
+ * The first matching rule wins.
+ *
+ * @return 0 on success, -1 with errno set to ENOSPC when the rules are full.
+ */
+int emi_regcache_set_ttl(emi_regcache_t* cache, uint16_t first, uint16_t last, uint32_t ttlMs);
+
+/**
+ * @brief modbus_read_input_registers() through the cache, for the slave set
+ * on ctx.
+ */
+int emi_regcache_read(emi_regcache_t* cache, modbus_t* ctx, int addr, int nb, uint8_t size, void* dest);
+
+/**
+ * @brief The register read at most maxAgeMs ago, whatever its time to live,
+ * without going to the bus. The longest read of the register is taken, and
+ * its size set.
+ *
+ * @return nb, or -1 with errno set to ENOENT when there is none.
+ */
+int emi_regcache_peek(emi_regcache_t* cache, int slave, int addr, int nb, uint32_t maxAgeMs, void* dest, uint8_t* size);
+
+/**
+ * @brief Forget the registers of a slave, e.g. after reconfiguring it.
+ */
+void emi_regcache_invalidate(emi_regcache_t* cache, int slave);
+
+#endif
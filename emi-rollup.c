@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "emi-rollup.h"
+
+static const int64_t windowLengths[EMI_ROLLUP_NB_WINDOWS] = {
+    60 * 1000,
+    15 * 60 * 1000,
+    60 * 60 * 1000,
+    24 * 60 * 60 * 1000};
+
+static const char *windowNames[EMI_ROLLUP_NB_WINDOWS] = {"1m", "15m", "1h", "1d"};
+
+void emi_rollup_init(emi_rollup_t *rollup, emi_rollup_handler_t handler, void *user)
+{
+    memset(rollup, 0, sizeof(*rollup));
+    rollup->handler = handler;
+    rollup->user = user;
+}
+
+int emi_rollup_add_series(emi_rollup_t *rollup, int counter)
+{
+    emi_rollup_series_t *series;
+    int i;
+
+    if (rollup->nb_series == EMI_ROLLUP_MAX_SERIES)
+    {
+        return -1;
+    }
+
+    series = &rollup->series[rollup->nb_series];
+    memset(series, 0, sizeof(*series));
+    series->counter = counter;
+    for (i = 0; i < EMI_ROLLUP_NB_WINDOWS; i++)
+    {
+        series->windows[i].start = -1;
+    }
+
+    return rollup->nb_series++;
+}
+
+static void close_window(emi_rollup_t *rollup, int index, emi_rollup_window_length_t length)
+{
+    emi_rollup_window_t *window = &rollup->series[index].windows[length];
+    emi_rollup_result_t result;
+
+    result.start = window->start;
+    result.end = window->start + windowLengths[length];
+    result.count = window->count;
+    result.min = window->min;
+    result.max = window->max;
+    result.mean = window->sum / window->count;
+    result.last = window->last;
+    result.delta = window->last - window->baseline;
+
+    if (rollup->handler != NULL)
+    {
+        rollup->handler(index, length, &result, rollup->user);
+    }
+
+    window->start = -1;
+}
+
+void emi_rollup_sample(emi_rollup_t *rollup, int index, int64_t ts, double value)
+{
+    emi_rollup_series_t *series = &rollup->series[index];
+    int i;
+
+    for (i = 0; i < EMI_ROLLUP_NB_WINDOWS; i++)
+    {
+        emi_rollup_window_t *window = &series->windows[i];
+        int64_t start = ts - ts % windowLengths[i];
+
+        if (window->start != -1 && window->start != start)
+        {
+            close_window(rollup, index, i);
+        }
+
+        if (window->start == -1)
+        {
+            window->start = start;
+            window->count = 0;
+            window->min = value;
+            window->max = value;
+            window->sum = 0;
+            /* Counters increase from the last value seen, not from the first
+               sample of the window, so that no increment is lost between windows */
+            window->baseline = series->has_last ? series->last : value;
+        }
+
+        window->count++;
+        window->sum += value;
+        window->last = value;
+        if (value < window->min)
+        {
+            window->min = value;
+        }
+        if (value > window->max)
+        {
+            window->max = value;
+        }
+    }
+
+    series->last = value;
+    series->has_last = 1;
+}
+
+const char *emi_rollup_window_name(emi_rollup_window_length_t window)
+{
+    return windowNames[window];
+}
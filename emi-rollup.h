@@ -0,0 +1,85 @@
+#ifndef EMI_ROLLUP_H
+#define EMI_ROLLUP_H
+
+#include <stdint.h>
+
+#define EMI_ROLLUP_MAX_SERIES 32
+
+/* Windows are aligned on multiples of their length since the epoch (UTC) */
+typedef enum {
+    EMI_ROLLUP_1M = 0,
+    EMI_ROLLUP_15M,
+    EMI_ROLLUP_1H,
+    EMI_ROLLUP_1D,
+    EMI_ROLLUP_NB_WINDOWS
+} emi_rollup_window_length_t;
+
+typedef struct {
+    /* Window start, in milliseconds since the epoch, -1 while empty */
+    int64_t start;
+    uint32_t count;
+    double min;
+    double max;
+    double sum;
+    double last;
+    /* Value the delta is computed from (last sample of the previous window) */
+    double baseline;
+} emi_rollup_window_t;
+
+typedef struct {
+    /* The value is a cumulative counter (e.g. energy) */
+    int counter;
+    int has_last;
+    double last;
+    emi_rollup_window_t windows[EMI_ROLLUP_NB_WINDOWS];
+} emi_rollup_series_t;
+
+typedef struct {
+    int64_t start;
+    int64_t end;
+    uint32_t count;
+    double min;
+    double max;
+    double mean;
+    double last;
+    /* Increase over the window, only meaningful for counters */
+    double delta;
+} emi_rollup_result_t;
+
+/**
+ * @brief Called each time a window of a series is closed.
+ */
+typedef void (*emi_rollup_handler_t)(int series, emi_rollup_window_length_t window,
+    const emi_rollup_result_t* result, void* user);
+
+typedef struct {
+    int nb_series;
+    emi_rollup_series_t series[EMI_ROLLUP_MAX_SERIES];
+    emi_rollup_handler_t handler;
+    void* user;
+} emi_rollup_t;
+
+void emi_rollup_init(emi_rollup_t* rollup, emi_rollup_handler_t handler, void* user);
+
+/**
+ * @brief Register a series.
+ *
+ * @param counter whether the value is a cumulative counter
+ * @return the series index to pass to emi_rollup_sample, or -1 when full.
+ */
+int emi_rollup_add_series(emi_rollup_t* rollup, int counter);
+
+/**
+ * @brief Account a sample in every window of a series, in O(1). Windows the
+ * sample falls after are closed (and handed to the handler) first.
+ *
+ * @param ts the sample time, in milliseconds since the epoch
+ */
+void emi_rollup_sample(emi_rollup_t* rollup, int series, int64_t ts, double value);
+
+/**
+ * @brief The window name used in topics: "1m", "15m", "1h" or "1d".
+ */
+const char* emi_rollup_window_name(emi_rollup_window_length_t window);
+
+#endif
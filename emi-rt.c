@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "emi-rt.h"
+
+/* Stack the poll loop may use, touched once so that it is resident */
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+_Static_assert(sizeof(cpu_set_t) <= sizeof(((emi_rt_t *)0)->affinity), "cpu_set_t doesn't fit in emi_rt_t");
+
+static void __attribute__((noinline)) prefaultStack(void)
+{
+    volatile unsigned char stack[PREFAULT_STACK_SIZE];
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += 4096)
+    {
+        stack[i] = 0;
+    }
+}
+
+int emi_rt_init(emi_rt_t *rt, int priority, int cpu)
+{
+    memset(rt, 0, sizeof(*rt));
+    rt->priority = priority;
+    rt->cpu = cpu;
+    emi_stats_reset(&rt->wakeup);
+
+    if (priority == 0 && cpu == -1)
+    {
+        return 0;
+    }
+
+    if (priority < 0 || priority > sched_get_priority_max(SCHED_FIFO) || cpu < -1 || cpu >= CPU_SETSIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Keep freed memory instead of returning it to the kernel, to fault it in again later */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    /* Everything mapped now is made resident. Later mappings (thread stacks of
+       the MQTT client) are only locked once touched, instead of entirely */
+    if (mlockall(MCL_CURRENT) == -1 || mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == -1)
+    {
+        return -1;
+    }
+    prefaultStack();
+
+    /* Fails now rather than at the first poll without the privileges */
+    if (emi_rt_enter(rt) == -1)
+    {
+        return -1;
+    }
+    return emi_rt_leave(rt);
+}
+
+int emi_rt_enter(emi_rt_t *rt)
+{
+    struct sched_param param;
+    int rc;
+
+    if (rt->priority == 0 && rt->cpu == -1)
+    {
+        return 0;
+    }
+
+    rc = pthread_getschedparam(pthread_self(), &rt->policy, &rt->param);
+    if (rc == 0)
+    {
+        rc = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t *)rt->affinity);
+    }
+    if (rc == 0 && rt->cpu != -1)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(rt->cpu, &set);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (rc == 0 && rt->priority > 0)
+    {
+        param.sched_priority = rt->priority;
+        rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int emi_rt_leave(emi_rt_t *rt)
+{
+    int rc = 0;
+
+    if (rt->priority == 0 && rt->cpu == -1)
+    {
+        return 0;
+    }
+
+    if (rt->priority > 0)
+    {
+        rc = pthread_setschedparam(pthread_self(), rt->policy, &rt->param);
+    }
+    if (rc == 0 && rt->cpu != -1)
+    {
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t *)rt->affinity);
+    }
+
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+void emi_rt_sleep_until(emi_rt_t *rt, const struct timespec *deadline)
+{
+    struct timespec now;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR)
+    {
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    emi_stats_add(&rt->wakeup, (double)(now.tv_sec - deadline->tv_sec) * 1e6 + (now.tv_nsec - deadline->tv_nsec) / 1e3);
+}
@@ -0,0 +1,55 @@
+#ifndef EMI_RT_H
+#define EMI_RT_H
+
+#include <sched.h>
+#include <time.h>
+
+#include "emi-burst.h"
+
+/* Real-time mode of the bus I/O: the polling thread runs under SCHED_FIFO,
+ * optionally pinned to a CPU, while it talks to the meter, so that it isn't
+ * descheduled between the bytes of a frame. Memory is locked and the stack
+ * prefaulted so that the poll loop doesn't page fault after startup. */
+
+typedef struct {
+    /* SCHED_FIFO priority (1-99), 0 when the mode is off */
+    int priority;
+    /* CPU the bus I/O is pinned to, -1 for any */
+    int cpu;
+    /* Scheduling to restore when leaving the bus I/O, so that the threads
+       created meanwhile (MQTT) don't inherit the real-time one */
+    int policy;
+    struct sched_param param;
+    /* A cpu_set_t, which needs _GNU_SOURCE */
+    unsigned char affinity[128];
+    /* Lateness of the periodic wake-ups, microseconds */
+    emi_stats_t wakeup;
+} emi_rt_t;
+
+/**
+ * @brief Lock the memory of the process and prefault the stack of the calling
+ * thread. Does nothing but initialise rt when priority is 0 and cpu -1.
+ *
+ * @return 0 on success, -1 with errno set otherwise (EPERM without
+ * CAP_SYS_NICE or CAP_IPC_LOCK).
+ */
+int emi_rt_init(emi_rt_t* rt, int priority, int cpu);
+
+/**
+ * @brief Switch the calling thread to the real-time scheduling and CPU.
+ */
+int emi_rt_enter(emi_rt_t* rt);
+
+/**
+ * @brief Restore the scheduling and CPUs the calling thread had before
+ * emi_rt_enter.
+ */
+int emi_rt_leave(emi_rt_t* rt);
+
+/**
+ * @brief Sleep until an absolute CLOCK_MONOTONIC deadline and account how
+ * late the thread woke up.
+ */
+void emi_rt_sleep_until(emi_rt_t* rt, const struct timespec* deadline);
+
+#endif
@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "emi-shadow.h"
+
+emi_shadow_t *emi_shadow_create(const char *name, int slave)
+{
+    emi_shadow_t *shadow;
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*shadow)) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    shadow = mmap(NULL, sizeof(*shadow), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shadow == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    /* Readers check the magic last, once the rest is in place */
+    __atomic_store_n(&shadow->magic, 0, __ATOMIC_RELEASE);
+    memset(&shadow->version, 0, sizeof(*shadow) - sizeof(shadow->magic));
+    shadow->version = EMI_SHADOW_VERSION;
+    shadow->size = sizeof(*shadow);
+    shadow->slave = slave;
+    __atomic_store_n(&shadow->magic, EMI_SHADOW_MAGIC, __ATOMIC_RELEASE);
+    return shadow;
+}
+
+int emi_shadow_add(emi_shadow_t *shadow, const char *name, uint16_t registerAddress, uint8_t size)
+{
+    emi_shadow_value_t *value;
+    uint32_t index = shadow->nbValues;
+
+    if (index == EMI_SHADOW_MAX_VALUES || size > EMI_SHADOW_MAX_RAW)
+    {
+        errno = index == EMI_SHADOW_MAX_VALUES ? ENOSPC : EINVAL;
+        return -1;
+    }
+
+    value = &shadow->values[index];
+    value->registerAddress = registerAddress;
+    value->size = size;
+    strncpy(value->name, name, sizeof(value->name) - 1);
+    /* Visible to readers once described */
+    __atomic_store_n(&shadow->nbValues, index + 1, __ATOMIC_RELEASE);
+    return index;
+}
+
+void emi_shadow_update(emi_shadow_t *shadow, int index, const uint8_t *raw, double value, int64_t timestamp)
+{
+    emi_shadow_value_t *slot = &shadow->values[index];
+    uint32_t seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot->raw, raw, slot->size);
+    slot->value = value;
+    slot->timestamp = timestamp;
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+const emi_shadow_t *emi_shadow_open(const char *name)
+{
+    const emi_shadow_t *shadow;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    shadow = mmap(NULL, sizeof(*shadow), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shadow == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&shadow->magic, __ATOMIC_ACQUIRE) != EMI_SHADOW_MAGIC ||
+        shadow->version != EMI_SHADOW_VERSION || shadow->size != sizeof(*shadow))
+    {
+        munmap((void *)shadow, sizeof(*shadow));
+        errno = EPROTO;
+        return NULL;
+    }
+    return shadow;
+}
+
+void emi_shadow_read(const emi_shadow_t *shadow, int index, emi_shadow_value_t *value)
+{
+    const emi_shadow_value_t *slot = &shadow->values[index];
+    uint32_t before, after;
+
+    do
+    {
+        before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        memcpy(value, slot, sizeof(*value));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+}
+
+int emi_shadow_find(const emi_shadow_t *shadow, const char *name)
+{
+    uint32_t nb = __atomic_load_n(&shadow->nbValues, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    for (i = 0; i < nb; i++)
+    {
+        if (strncmp(shadow->values[i].name, name, EMI_SHADOW_NAME_LENGTH) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void emi_shadow_close(const emi_shadow_t *shadow, const char *unlinkName)
+{
+    if (shadow != NULL)
+    {
+        munmap((void *)shadow, sizeof(*shadow));
+    }
+    if (unlinkName != NULL)
+    {
+        shm_unlink(unlinkName);
+    }
+}
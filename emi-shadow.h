@@ -0,0 +1,84 @@
+#ifndef EMI_SHADOW_H
+#define EMI_SHADOW_H
+
+#include <stdint.h>
+
+/* Shadow image of a meter in POSIX shared memory: the registers polled and
+ * their decoded values, for local processes to read at memory speed instead
+ * of through the MQTT broker. emi-read is the only writer. Each value has its
+ * own seqlock, readers retry instead of locking and never block the writer. */
+
+#define EMI_SHADOW_MAGIC 0x57444853 /* "SHDW" */
+/* Bump when the layout changes */
+#define EMI_SHADOW_VERSION 1
+#define EMI_SHADOW_MAX_VALUES 32
+#define EMI_SHADOW_NAME_LENGTH 48
+/* Largest register polled, bytes */
+#define EMI_SHADOW_MAX_RAW 4
+
+typedef struct {
+    /* Odd while the writer updates the value */
+    uint32_t seq;
+    uint16_t registerAddress;
+    uint8_t size;
+    uint8_t raw[EMI_SHADOW_MAX_RAW];
+    double value;
+    /* CLOCK_REALTIME of the read, ms, 0 until the first one */
+    int64_t timestamp;
+    /* MQTT topic of the value, set once */
+    char name[EMI_SHADOW_NAME_LENGTH];
+} emi_shadow_value_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    int32_t slave;
+    uint32_t nbValues;
+    emi_shadow_value_t values[EMI_SHADOW_MAX_VALUES];
+} emi_shadow_t;
+
+/**
+ * @brief Create, or take over, the segment name (e.g. "/emi-1") of a slave.
+ *
+ * @return the mapped segment, or NULL with errno set.
+ */
+emi_shadow_t* emi_shadow_create(const char* name, int slave);
+
+/**
+ * @brief Add a value to the image.
+ *
+ * @return its index, or -1 with errno set to ENOSPC when the image is full.
+ */
+int emi_shadow_add(emi_shadow_t* shadow, const char* name, uint16_t registerAddress, uint8_t size);
+
+/**
+ * @brief Publish a new reading of the value at index.
+ */
+void emi_shadow_update(emi_shadow_t* shadow, int index, const uint8_t* raw, double value, int64_t timestamp);
+
+/**
+ * @brief Map the segment name read-only, for readers.
+ *
+ * @return the segment, or NULL with errno set (EPROTO when it was written by
+ * another version).
+ */
+const emi_shadow_t* emi_shadow_open(const char* name);
+
+/**
+ * @brief Copy a consistent snapshot of the value at index, retrying while the
+ * writer updates it.
+ */
+void emi_shadow_read(const emi_shadow_t* shadow, int index, emi_shadow_value_t* value);
+
+/**
+ * @brief Index of the value called name, -1 when there is none.
+ */
+int emi_shadow_find(const emi_shadow_t* shadow, const char* name);
+
+/**
+ * @brief Unmap a segment, and remove its name when unlinkName isn't NULL.
+ */
+void emi_shadow_close(const emi_shadow_t* shadow, const char* unlinkName);
+
+#endif
@@ -0,0 +1,632 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "emi-tsdb.h"
+
+/* Worst case size of a sample: '1111' + 32 bits of timestamp, '11' + 5 + 6 + 64 bits of value */
+#define MAX_SAMPLE_BITS (4 + 32 + 2 + 5 + 6 + 64)
+#define NO_WINDOW 0xFF
+
+typedef struct {
+    const uint8_t* buf;
+    uint32_t nbits;
+    uint32_t pos;
+} bit_reader_t;
+
+static void put_bits(uint8_t* buf, uint32_t* pos, uint64_t value, int nbits)
+{
+    while (nbits > 0)
+    {
+        int room = 8 - (*pos & 7);
+        int n = nbits < room ? nbits : room;
+        uint8_t chunk = (value >> (nbits - n)) & ((1u << n) - 1);
+
+        buf[*pos >> 3] |= chunk << (room - n);
+        *pos += n;
+        nbits -= n;
+    }
+}
+
+static int get_bits(bit_reader_t* r, int nbits, uint64_t* value)
+{
+    uint64_t v = 0;
+
+    if (r->pos + nbits > r->nbits)
+    {
+        return -1;
+    }
+
+    while (nbits > 0)
+    {
+        int avail = 8 - (r->pos & 7);
+        int n = nbits < avail ? nbits : avail;
+        uint8_t byte = r->buf[r->pos >> 3];
+
+        v = (v << n) | ((byte >> (avail - n)) & ((1u << n) - 1));
+        r->pos += n;
+        nbits -= n;
+    }
+
+    *value = v;
+    return 0;
+}
+
+static uint64_t double_to_bits(double d)
+{
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+static double bits_to_double(uint64_t u)
+{
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+static void reset_chunk(emi_tsdb_series_t* s)
+{
+    memset(s->buf, 0, sizeof(s->buf));
+    s->bits = 0;
+    s->count = 0;
+    s->prev_delta = 0;
+    s->prev_leading = NO_WINDOW;
+    s->prev_trailing = 0;
+}
+
+static void encode_timestamp(emi_tsdb_series_t* s, int64_t dod)
+{
+    if (dod == 0)
+    {
+        put_bits(s->buf, &s->bits, 0x0, 1);
+    }
+    else if (dod >= -63 && dod <= 64)
+    {
+        put_bits(s->buf, &s->bits, 0x2, 2);
+        put_bits(s->buf, &s->bits, dod + 63, 7);
+    }
+    else if (dod >= -255 && dod <= 256)
+    {
+        put_bits(s->buf, &s->bits, 0x6, 3);
+        put_bits(s->buf, &s->bits, dod + 255, 9);
+    }
+    else if (dod >= -2047 && dod <= 2048)
+    {
+        put_bits(s->buf, &s->bits, 0xE, 4);
+        put_bits(s->buf, &s->bits, dod + 2047, 12);
+    }
+    else
+    {
+        put_bits(s->buf, &s->bits, 0xF, 4);
+        put_bits(s->buf, &s->bits, (uint32_t)(int32_t)dod, 32);
+    }
+}
+
+static void encode_value(emi_tsdb_series_t* s, uint64_t value)
+{
+    uint64_t xor = value ^ s->prev_value;
+    int leading, trailing, meaningful;
+
+    if (xor == 0)
+    {
+        put_bits(s->buf, &s->bits, 0x0, 1);
+        return;
+    }
+
+    leading = __builtin_clzll(xor);
+    trailing = __builtin_ctzll(xor);
+    if (leading > 31)
+    {
+        leading = 31;
+    }
+
+    if (s->prev_leading != NO_WINDOW && leading >= s->prev_leading && trailing >= s->prev_trailing)
+    {
+        /* Fits in the previous window */
+        meaningful = 64 - s->prev_leading - s->prev_trailing;
+        put_bits(s->buf, &s->bits, 0x2, 2);
+        put_bits(s->buf, &s->bits, xor >> s->prev_trailing, meaningful);
+    }
+    else
+    {
+        meaningful = 64 - leading - trailing;
+        put_bits(s->buf, &s->bits, 0x3, 2);
+        put_bits(s->buf, &s->bits, leading, 5);
+        /* 64 meaningful bits is stored as 0 */
+        put_bits(s->buf, &s->bits, meaningful & 0x3F, 6);
+        put_bits(s->buf, &s->bits, xor >> trailing, meaningful);
+        s->prev_leading = leading;
+        s->prev_trailing = trailing;
+    }
+}
+
+static void fill_header(const emi_tsdb_series_t* s, emi_tsdb_chunk_header_t* header)
+{
+    memset(header, 0, sizeof(*header));
+    header->magic = EMI_TSDB_CHUNK_MAGIC;
+    header->version = EMI_TSDB_VERSION;
+    header->count = s->count;
+    header->first_ts = s->first_ts;
+    header->last_ts = s->prev_ts;
+    header->nbytes = (s->bits + 7) / 8;
+}
+
+/* Writes the open chunk at the committed offset. When `close` is set, the
+ * chunk becomes part of the committed data and a new one is started. */
+static int write_chunk(emi_tsdb_series_t* s, int close)
+{
+    emi_tsdb_chunk_header_t header;
+    ssize_t rc;
+
+    if (s->count == 0)
+    {
+        return 0;
+    }
+
+    fill_header(s, &header);
+
+    rc = pwrite(s->fd, &header, sizeof(header), s->committed);
+    if (rc != sizeof(header))
+    {
+        return -1;
+    }
+
+    rc = pwrite(s->fd, s->buf, header.nbytes, s->committed + sizeof(header));
+    if (rc != (ssize_t)header.nbytes)
+    {
+        return -1;
+    }
+
+    s->dirty = 0;
+
+    if (close)
+    {
+        s->committed += sizeof(header) + header.nbytes;
+        reset_chunk(s);
+    }
+
+    return 0;
+}
+
+/* Decodes one chunk, calling the visitor for samples within [from, to].
+ * Returns 1 if the visitor asked to stop, 0 otherwise. A corrupted bitstream
+ * silently ends the chunk. */
+static int decode_chunk(const emi_tsdb_chunk_header_t* header, const uint8_t* data, int64_t from,
+    int64_t to, emi_tsdb_visitor_t visitor, void* user, int* visited)
+{
+    bit_reader_t r = { data, header->nbytes * 8, 0 };
+    int64_t ts = header->first_ts;
+    int64_t delta = 0;
+    uint64_t value, bits;
+    int leading = 0, trailing = 0;
+    int i;
+
+    if (get_bits(&r, 64, &value) == -1)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < header->count; i++)
+    {
+        if (i > 0)
+        {
+            int64_t dod;
+            int nbits = 0;
+            int ones = 0;
+
+            /* Timestamp bucket: count the leading ones (up to 4) */
+            while (ones < 4)
+            {
+                if (get_bits(&r, 1, &bits) == -1)
+                {
+                    return 0;
+                }
+                if (bits == 0)
+                {
+                    break;
+                }
+                ones++;
+            }
+
+            switch (ones)
+            {
+            case 0:
+                dod = 0;
+                break;
+            case 1:
+                nbits = 7;
+                break;
+            case 2:
+                nbits = 9;
+                break;
+            case 3:
+                nbits = 12;
+                break;
+            default:
+                nbits = 32;
+            }
+
+            if (nbits > 0)
+            {
+                if (get_bits(&r, nbits, &bits) == -1)
+                {
+                    return 0;
+                }
+                if (nbits == 32)
+                {
+                    dod = (int32_t)(uint32_t)bits;
+                }
+                else
+                {
+                    dod = (int64_t)bits - ((1 << (nbits - 1)) - 1);
+                }
+            }
+
+            delta += dod;
+            ts += delta;
+
+            /* Value */
+            if (get_bits(&r, 1, &bits) == -1)
+            {
+                return 0;
+            }
+            if (bits == 1)
+            {
+                int meaningful;
+
+                if (get_bits(&r, 1, &bits) == -1)
+                {
+                    return 0;
+                }
+                if (bits == 1)
+                {
+                    uint64_t l, m;
+                    if (get_bits(&r, 5, &l) == -1 || get_bits(&r, 6, &m) == -1)
+                    {
+                        return 0;
+                    }
+                    leading = l;
+                    meaningful = m == 0 ? 64 : m;
+                    trailing = 64 - leading - meaningful;
+                    if (trailing < 0)
+                    {
+                        return 0;
+                    }
+                }
+                else
+                {
+                    meaningful = 64 - leading - trailing;
+                }
+
+                if (get_bits(&r, meaningful, &bits) == -1)
+                {
+                    return 0;
+                }
+                value ^= bits << trailing;
+            }
+        }
+
+        if (ts > to)
+        {
+            return 0;
+        }
+
+        if (ts >= from)
+        {
+            (*visited)++;
+            if (visitor(ts, bits_to_double(value), user) != 0)
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int valid_header(const emi_tsdb_chunk_header_t* header, off_t offset, off_t size)
+{
+    return header->magic == EMI_TSDB_CHUNK_MAGIC && header->version == EMI_TSDB_VERSION
+        && header->count > 0 && header->nbytes <= EMI_TSDB_CHUNK_BYTES
+        && offset + (off_t)sizeof(*header) + header->nbytes <= size;
+}
+
+/* Finds the end of the last valid chunk and drops anything after it, unless
+ * the store is read-only: the writer may be in the middle of a chunk */
+static int recover_series(emi_tsdb_series_t* s, int readonly)
+{
+    emi_tsdb_chunk_header_t header;
+    struct stat st;
+    off_t offset = 0;
+
+    if (fstat(s->fd, &st) == -1)
+    {
+        return -1;
+    }
+
+    while (offset + (off_t)sizeof(header) <= st.st_size)
+    {
+        if (pread(s->fd, &header, sizeof(header), offset) != sizeof(header)
+            || !valid_header(&header, offset, st.st_size))
+        {
+            break;
+        }
+        offset += sizeof(header) + header.nbytes;
+        s->prev_ts = header.last_ts;
+    }
+
+    if (!readonly && offset != st.st_size && ftruncate(s->fd, offset) == -1)
+    {
+        return -1;
+    }
+
+    s->committed = offset;
+    return 0;
+}
+
+static emi_tsdb_series_t* find_series(emi_tsdb_t* db, uint8_t slave, const char* name, int create)
+{
+    emi_tsdb_series_t* s;
+    char path[PATH_MAX];
+    char* p;
+    int i, flags;
+
+    for (i = 0; i < db->nb_series; i++)
+    {
+        if (db->series[i]->slave == slave && strcmp(db->series[i]->name, name) == 0)
+        {
+            return db->series[i];
+        }
+    }
+
+    if (db->nb_series == EMI_TSDB_MAX_SERIES || strlen(name) >= EMI_TSDB_SERIES_NAME_LENGTH)
+    {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    s = calloc(1, sizeof(emi_tsdb_series_t));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+
+    s->slave = slave;
+    strcpy(s->name, name);
+    reset_chunk(s);
+
+    snprintf(path, sizeof(path), "%s/%d-%s.tsdb", db->dir, slave, name);
+    /* Series names are topic-like ("L1/voltage"), keep them in a flat directory */
+    for (p = path + strlen(db->dir) + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '_';
+        }
+    }
+
+    flags = (db->readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+    if (create)
+    {
+        flags |= O_CREAT;
+    }
+
+    s->fd = open(path, flags, 0644);
+    if (s->fd == -1 || recover_series(s, db->readonly) == -1)
+    {
+        int saved_errno = errno;
+        if (s->fd != -1)
+        {
+            close(s->fd);
+        }
+        free(s);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    db->series[db->nb_series++] = s;
+    return s;
+}
+
+static emi_tsdb_t* open_store(const char* dir, int readonly)
+{
+    emi_tsdb_t* db;
+
+    db = calloc(1, sizeof(emi_tsdb_t));
+    if (db == NULL)
+    {
+        return NULL;
+    }
+
+    db->dir = strdup(dir);
+    if (db->dir == NULL)
+    {
+        free(db);
+        errno = ENOMEM;
+        return NULL;
+    }
+    db->readonly = readonly;
+
+    return db;
+}
+
+emi_tsdb_t* emi_tsdb_open(const char* dir)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        return NULL;
+    }
+
+    return open_store(dir, 0);
+}
+
+emi_tsdb_t* emi_tsdb_open_readonly(const char* dir)
+{
+    return open_store(dir, 1);
+}
+
+int emi_tsdb_append(emi_tsdb_t* db, uint8_t slave, const char* series, int64_t ts, double value)
+{
+    emi_tsdb_series_t* s;
+    uint64_t bits = double_to_bits(value);
+
+    if (db->readonly)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    s = find_series(db, slave, series, 1);
+    if (s == NULL)
+    {
+        return -1;
+    }
+
+    if (ts < s->prev_ts)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (s->count > 0)
+    {
+        int64_t delta = ts - s->prev_ts;
+        int64_t dod = delta - s->prev_delta;
+
+        /* Close the chunk when full or when the gap can't be encoded */
+        if (s->bits + MAX_SAMPLE_BITS > EMI_TSDB_CHUNK_BYTES * 8 || s->count == UINT16_MAX
+            || dod < INT32_MIN || dod > INT32_MAX)
+        {
+            if (write_chunk(s, 1) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (s->count == 0)
+    {
+        s->first_ts = ts;
+        put_bits(s->buf, &s->bits, bits, 64);
+    }
+    else
+    {
+        int64_t delta = ts - s->prev_ts;
+        encode_timestamp(s, delta - s->prev_delta);
+        encode_value(s, bits);
+        s->prev_delta = delta;
+    }
+
+    s->prev_ts = ts;
+    s->prev_value = bits;
+    s->count++;
+    s->dirty = 1;
+
+    return 0;
+}
+
+int emi_tsdb_flush(emi_tsdb_t* db)
+{
+    int i, rc = 0;
+
+    for (i = 0; i < db->nb_series; i++)
+    {
+        if (db->series[i]->dirty && write_chunk(db->series[i], 0) == -1)
+        {
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+int emi_tsdb_query(emi_tsdb_t* db, uint8_t slave, const char* series, int64_t from, int64_t to,
+    emi_tsdb_visitor_t visitor, void* user)
+{
+    emi_tsdb_series_t* s = find_series(db, slave, series, 0);
+    int visited = 0;
+
+    if (s == NULL)
+    {
+        /* Nothing recorded yet */
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (s->committed > 0)
+    {
+        const uint8_t* map = mmap(NULL, s->committed, PROT_READ, MAP_SHARED, s->fd, 0);
+        off_t offset = 0;
+        int stop = 0;
+
+        if (map == MAP_FAILED)
+        {
+            return -1;
+        }
+
+        while (!stop && offset + (off_t)sizeof(emi_tsdb_chunk_header_t) <= s->committed)
+        {
+            emi_tsdb_chunk_header_t header;
+
+            memcpy(&header, map + offset, sizeof(header));
+            if (!valid_header(&header, offset, s->committed))
+            {
+                break;
+            }
+
+            if (header.first_ts <= to && header.last_ts >= from)
+            {
+                stop = decode_chunk(&header, map + offset + sizeof(header), from, to, visitor, user, &visited);
+            }
+            else if (header.first_ts > to)
+            {
+                break;
+            }
+
+            offset += sizeof(header) + header.nbytes;
+        }
+
+        munmap((void*)map, s->committed);
+        if (stop)
+        {
+            return visited;
+        }
+    }
+
+    if (s->count > 0)
+    {
+        emi_tsdb_chunk_header_t header;
+
+        fill_header(s, &header);
+        decode_chunk(&header, s->buf, from, to, visitor, user, &visited);
+    }
+
+    return visited;
+}
+
+void emi_tsdb_close(emi_tsdb_t* db)
+{
+    int i;
+
+    if (db == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < db->nb_series; i++)
+    {
+        write_chunk(db->series[i], 0);
+        close(db->series[i]->fd);
+        free(db->series[i]);
+    }
+
+    free(db->dir);
+    free(db);
+}
@@ -0,0 +1,111 @@
+#ifndef EMI_TSDB_H
+#define EMI_TSDB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Maximum number of series a store keeps open at once */
+#define EMI_TSDB_MAX_SERIES 64
+#define EMI_TSDB_SERIES_NAME_LENGTH 48
+/* Size of the compressed payload of one chunk */
+#define EMI_TSDB_CHUNK_BYTES 1024
+
+#define EMI_TSDB_CHUNK_MAGIC 0x42445354 /* "TSDB" */
+#define EMI_TSDB_VERSION 1
+
+/*
+ * On-disk layout of a series file: a sequence of chunks, each one made of this
+ * header followed by `nbytes` of bitstream. Timestamps are milliseconds and
+ * are delta-of-delta encoded; values are XOR encoded against the previous one
+ * (Gorilla). The first value of a chunk is stored verbatim.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    int64_t first_ts;
+    int64_t last_ts;
+    uint32_t nbytes;
+    uint32_t reserved;
+} emi_tsdb_chunk_header_t;
+
+typedef struct {
+    uint8_t slave;
+    char name[EMI_TSDB_SERIES_NAME_LENGTH];
+    int fd;
+    /* End of the last closed chunk; the open chunk is (re)written here */
+    off_t committed;
+    int dirty;
+
+    /* Open chunk */
+    uint8_t buf[EMI_TSDB_CHUNK_BYTES];
+    uint32_t bits;
+    uint16_t count;
+    int64_t first_ts;
+    int64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_value;
+    uint8_t prev_leading;
+    uint8_t prev_trailing;
+} emi_tsdb_series_t;
+
+typedef struct {
+    char* dir;
+    /* Opened by a reader, next to the process appending */
+    int readonly;
+    int nb_series;
+    emi_tsdb_series_t* series[EMI_TSDB_MAX_SERIES];
+} emi_tsdb_t;
+
+/**
+ * @brief Called for every sample matched by emi_tsdb_query, in time order.
+ *
+ * @return 0 to continue, anything else to stop the query.
+ */
+typedef int (*emi_tsdb_visitor_t)(int64_t ts, double value, void* user);
+
+/**
+ * @brief Open (or create) a store rooted at the given directory.
+ *
+ * @return the store, or NULL with errno set.
+ */
+emi_tsdb_t* emi_tsdb_open(const char* dir);
+
+/**
+ * @brief Open an existing store to query it while another process appends to
+ * it. The samples flushed by the writer when the series is first queried are
+ * visible; appending fails with EROFS.
+ *
+ * @return the store, or NULL with errno set.
+ */
+emi_tsdb_t* emi_tsdb_open_readonly(const char* dir);
+
+/**
+ * @brief Append a sample to a series. Timestamps must not go backwards.
+ *
+ * @param slave the meter the series belongs to
+ * @param series the series name, e.g. "L1/voltage"
+ * @param ts the sample time, in milliseconds since the epoch
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int emi_tsdb_append(emi_tsdb_t* db, uint8_t slave, const char* series, int64_t ts, double value);
+
+/**
+ * @brief Write the open chunk of every modified series to disk, so that at most
+ * the samples appended since the last flush are lost on a crash.
+ */
+int emi_tsdb_flush(emi_tsdb_t* db);
+
+/**
+ * @brief Visit the samples of a series within [from, to] (milliseconds).
+ *
+ * Closed chunks are read through a read-only mapping of the series file.
+ *
+ * @return the number of samples visited, or -1 with errno set.
+ */
+int emi_tsdb_query(emi_tsdb_t* db, uint8_t slave, const char* series, int64_t from, int64_t to,
+    emi_tsdb_visitor_t visitor, void* user);
+
+void emi_tsdb_close(emi_tsdb_t* db);
+
+#endif
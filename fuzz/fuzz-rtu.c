@@ -0,0 +1,401 @@
+/* Fuzzing entry point of the RTU frame parser: _modbus_receive_msg(),
+ * compute_data_length_after_meta() and _modbus_check_confirmation() fed from
+ * a byte buffer through the loopback backend.
+ *
+ * An input is 4 bytes of setup followed by the bytes received from the line:
+ *   [0] bit 0: parse as indications instead of confirmations
+ *       bit 1: protocol error recovery
+ *       bits 4-7: function code of the request (index in functions[])
+ *   [1] value size
+ *   [2] number of values requested
+ *   [3] slave requested
+ *
+ * Built with -DLIBFUZZER for libFuzzer, otherwise with a main that runs files
+ * or stdin (AFL), writes a seed corpus, or measures the parser throughput. */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "../light-modbus/light-modbus-loopback.h"
+#include "../light-modbus/light-modbus-rtu.h"
+#include "../tools/emi-model.h"
+
+#define SETUP_LENGTH 4
+#define MAX_INPUT_LENGTH 4096
+
+/* Aborts with the input that broke an invariant, for the fuzzer to keep */
+#define FUZZ_ASSERT(cond)                                                            \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            fprintf(stderr, "%s:%d: invariant broken: %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                                 \
+        }                                                                            \
+    } while (0)
+
+static const uint8_t functions[16] = {
+    MODBUS_FC_READ_INPUT_REGISTERS, MODBUS_FC_READ_COILS, MODBUS_FC_READ_DISCRETE_INPUTS,
+    MODBUS_FC_READ_HOLDING_REGISTERS, MODBUS_FC_WRITE_SINGLE_COIL, MODBUS_FC_WRITE_SINGLE_REGISTER,
+    MODBUS_FC_READ_EXCEPTION_STATUS, MODBUS_FC_WRITE_MULTIPLE_COILS, MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+    MODBUS_FC_REPORT_SLAVE_ID, MODBUS_FC_MASK_WRITE_REGISTER, MODBUS_FC_WRITE_AND_READ_REGISTERS,
+    MODBUS_FC_READ_INPUT_REGISTERS, MODBUS_FC_READ_INPUT_REGISTERS, 0x84, 0x00};
+
+static modbus_t *ctx;
+static emi_model_t model;
+
+/* Frames parsed over all inputs, and the ones accepted */
+static uint64_t framesParsed;
+static uint64_t framesValid;
+
+static int silentSlave(void *user, const uint8_t *req, int req_length, uint8_t *rsp)
+{
+    return 0;
+}
+
+static void setUp(void)
+{
+    ctx = modbus_new_loopback(silentSlave, NULL);
+    if (ctx == NULL || modbus_connect(ctx) == -1)
+    {
+        fprintf(stderr, "Could not create the loopback context\n");
+        exit(1);
+    }
+    /* Protocol recovery sleeps for the response timeout */
+    modbus_set_response_timeout(ctx, 0, 0);
+}
+
+static int runOne(const uint8_t *data, size_t size)
+{
+    modbus_loopback_t *lb;
+    msg_type_t msgType;
+    uint8_t req[_MIN_REQ_LENGTH];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int valueSize, paddedSize, nb, function, reqLength;
+    size_t fed;
+
+    if (size < SETUP_LENGTH)
+    {
+        return 0;
+    }
+    if (ctx == NULL)
+    {
+        setUp();
+    }
+    lb = ctx->backend_data;
+
+    msgType = (data[0] & 0x01) ? MSG_INDICATION : MSG_CONFIRMATION;
+    modbus_set_error_recovery(ctx, (data[0] & 0x02) ? MODBUS_ERROR_RECOVERY_PROTOCOL : MODBUS_ERROR_RECOVERY_NONE);
+    function = functions[data[0] >> 4];
+    valueSize = data[1];
+    paddedSize = (valueSize % 2 == 1) ? valueSize + 1 : valueSize;
+    nb = data[2];
+    if (modbus_set_slave(ctx, data[3]) == -1)
+    {
+        modbus_set_slave(ctx, 1);
+    }
+
+    /* Requests modbus_read_input_registers() refuses */
+    if (valueSize == 0 || nb < 1 ||
+        nb * paddedSize > MODBUS_RTU_MAX_ADU_LENGTH - _MODBUS_RTU_HEADER_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH - 2)
+    {
+        return 0;
+    }
+
+    reqLength = _modbus_rtu_build_request_basis(ctx, function, 0x0006, nb, valueSize, req);
+    _modbus_rtu_send_msg_pre(req, reqLength);
+
+    modbus_flush(ctx);
+    data += SETUP_LENGTH;
+    size -= SETUP_LENGTH;
+    fed = 0;
+
+    /* Parse until the line is quiet, feeding more bytes as the queue drains.
+       Every call either consumes bytes or times out on the empty queue */
+    for (;;)
+    {
+        int rc;
+
+        if (fed < size)
+        {
+            rc = modbus_loopback_feed(ctx, data + fed, size - fed);
+            FUZZ_ASSERT(rc >= 0);
+            fed += rc;
+        }
+        if (lb->queue_offset == lb->queue_length)
+        {
+            break;
+        }
+
+        memset(rsp, 0, sizeof(rsp));
+        rc = _modbus_receive_msg(ctx, rsp, msgType);
+        FUZZ_ASSERT(rc >= -1 && rc <= MODBUS_RTU_MAX_ADU_LENGTH);
+        FUZZ_ASSERT(lb->queue_offset <= lb->queue_length);
+        framesParsed++;
+        if (rc <= 0 || msgType == MSG_INDICATION)
+        {
+            continue;
+        }
+
+        /* As read_registers() does next, with the same bounds */
+        rc = _modbus_check_confirmation(ctx, req, rsp, valueSize, rc);
+        if (rc > 0)
+        {
+            framesValid++;
+            if (function == MODBUS_FC_READ_INPUT_REGISTERS || function == MODBUS_FC_READ_HOLDING_REGISTERS)
+            {
+                /* The values copied out of rsp */
+                FUZZ_ASSERT(rc == nb);
+                FUZZ_ASSERT(_MODBUS_RTU_HEADER_LENGTH + 2 + rc * paddedSize + _MODBUS_RTU_CHECKSUM_LENGTH <=
+                            MODBUS_RTU_MAX_ADU_LENGTH);
+            }
+        }
+    }
+
+    return 0;
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    return runOne(data, size);
+}
+
+#else
+
+static const struct option longOptions[] = {
+    {"throughput", required_argument, NULL, 't'},
+    {"seeds", required_argument, NULL, 's'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] [input...]\n", name);
+    fprintf(stderr, "  Runs each input file, or stdin without any (AFL)\n");
+    fprintf(stderr, "  -t, --throughput SECONDS  parse valid and mutated frames for SECONDS, report the frames/s\n");
+    fprintf(stderr, "  -s, --seeds DIR           write a seed corpus of valid responses to DIR\n");
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Setup bytes and the model response of a FC 0x04 read, returns the input length */
+static int validInput(uint8_t *input, int slave, uint16_t address, int nb)
+{
+    uint8_t req[_MIN_REQ_LENGTH];
+    int size = emi_model_register_size(address);
+    int length;
+
+    if (size == 0 || nb > 1)
+    {
+        size = 2;
+    }
+
+    input[0] = 0;
+    input[1] = size;
+    input[2] = nb;
+    input[3] = slave;
+
+    req[0] = slave;
+    req[1] = MODBUS_FC_READ_INPUT_REGISTERS;
+    req[2] = address >> 8;
+    req[3] = address & 0xff;
+    req[4] = nb >> 8;
+    req[5] = nb & 0xff;
+    length = emi_model_answer(&model, req, _MODBUS_RTU_PRESET_REQ_LENGTH, input + SETUP_LENGTH);
+    return SETUP_LENGTH + _modbus_rtu_send_msg_pre(input + SETUP_LENGTH, length);
+}
+
+static int writeSeed(const char *dir, const char *name, const uint8_t *input, int length)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "wb");
+    if (f == NULL || fwrite(input, 1, length, f) != (size_t)length)
+    {
+        fprintf(stderr, "Could not write %s\n", path);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int writeSeeds(const char *dir)
+{
+    uint8_t input[SETUP_LENGTH + MODBUS_RTU_MAX_ADU_LENGTH];
+    char name[32];
+    int address, count = 0;
+
+    emi_model_init(&model, 1, 1);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Could not create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    for (address = 0; address < 0x200; address++)
+    {
+        if (emi_model_register_size(address) == 0)
+        {
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "fc04-%04x", address);
+        if (writeSeed(dir, name, input, validInput(input, 1, address, 1)) == -1)
+        {
+            return 1;
+        }
+        count++;
+    }
+
+    /* The voltage and current block read of the burst mode */
+    if (writeSeed(dir, "fc04-006c-x2", input, validInput(input, 1, 0x006c, 2)) == -1)
+    {
+        return 1;
+    }
+    count++;
+
+    printf("%d seeds written to %s\n", count, dir);
+    return 0;
+}
+
+#define POOL_SIZE 4096
+
+/* Valid responses of the meter model, a quarter of them mutated (bit flips,
+ * truncation, random bytes, random setup), parsed in a loop */
+static int throughput(double seconds)
+{
+    static uint8_t pool[POOL_SIZE][SETUP_LENGTH + MODBUS_RTU_MAX_ADU_LENGTH];
+    static int lengths[POOL_SIZE];
+    uint64_t start, elapsed, inputs = 0, bytes = 0;
+    unsigned int seed = 1;
+    int i;
+
+    emi_model_init(&model, 1, 1);
+    for (i = 0; i < POOL_SIZE; i++)
+    {
+        uint8_t *input = pool[i];
+        int address;
+
+        do
+        {
+            address = rand_r(&seed) % 0x200;
+        } while (emi_model_register_size(address) == 0);
+        lengths[i] = validInput(input, 1, address, 1);
+
+        switch (rand_r(&seed) % 16)
+        {
+        case 0:
+            input[SETUP_LENGTH + rand_r(&seed) % (lengths[i] - SETUP_LENGTH)] ^= 1 << (rand_r(&seed) % 8);
+            break;
+        case 1:
+            lengths[i] = SETUP_LENGTH + rand_r(&seed) % (lengths[i] - SETUP_LENGTH);
+            break;
+        case 2:
+        {
+            int j;
+
+            lengths[i] = SETUP_LENGTH + rand_r(&seed) % MODBUS_RTU_MAX_ADU_LENGTH;
+            for (j = SETUP_LENGTH; j < lengths[i]; j++)
+            {
+                input[j] = rand_r(&seed);
+            }
+        }
+        break;
+        case 3:
+            input[0] = rand_r(&seed) & ~0x02;
+            input[1] = rand_r(&seed) % 16;
+            input[2] = rand_r(&seed) % 4;
+            break;
+        default:
+            break;
+        }
+    }
+
+    framesParsed = framesValid = 0;
+    start = nowNs();
+    do
+    {
+        for (i = 0; i < POOL_SIZE; i++)
+        {
+            runOne(pool[i], lengths[i]);
+            bytes += lengths[i] - SETUP_LENGTH;
+        }
+        inputs += POOL_SIZE;
+        elapsed = nowNs() - start;
+    } while (elapsed < seconds * 1e9);
+
+    printf("%llu frames (%llu valid) from %llu inputs in %.3f s: %.0f frames/s, %.1f MB/s\n",
+           (unsigned long long)framesParsed, (unsigned long long)framesValid, (unsigned long long)inputs,
+           elapsed / 1e9, framesParsed / (elapsed / 1e9), bytes / (elapsed / 1e3));
+    return 0;
+}
+
+static int runFile(const char *path)
+{
+    static uint8_t input[MAX_INPUT_LENGTH];
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    size_t length;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    length = fread(input, 1, sizeof(input), f);
+    if (f != stdin)
+    {
+        fclose(f);
+    }
+
+    return runOne(input, length);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "t:s:h", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            return throughput(atof(optarg));
+        case 's':
+            return writeSeeds(optarg);
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind == argc)
+    {
+        return runFile("-");
+    }
+    for (i = optind; i < argc; i++)
+    {
+        if (runFile(argv[i]) != 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
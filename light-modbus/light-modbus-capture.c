@@ -0,0 +1,70 @@
+#include "light-modbus.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+void _modbus_capture_frame(modbus_t *ctx, int direction, int flags, const uint8_t *msg, int length)
+{
+    modbus_capture_record_t record;
+    struct timespec ts;
+    struct iovec iov[2];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record.ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record.direction = direction;
+    record.flags = flags;
+    record.length = length;
+
+    /* One write per frame, so that records stay whole in an O_APPEND file */
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = length;
+    if (writev(ctx->capture_fd, iov, 2) == -1 && ctx->debug)
+    {
+        fprintf(stderr, "ERROR Capture write failed: %s\n", strerror(errno));
+    }
+}
+
+/* Records the frames sent and received to fd, an empty or capture file opened
+ * for writing (O_APPEND is advised), or stops when fd is -1. The caller keeps
+ * the ownership of fd. */
+int modbus_set_capture(modbus_t *ctx, int fd)
+{
+    modbus_capture_header_t header;
+    off_t size;
+
+    if (ctx == NULL || fd < -1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fd >= 0)
+    {
+        size = lseek(fd, 0, SEEK_END);
+        if (size == -1)
+        {
+            return -1;
+        }
+
+        if (size == 0)
+        {
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, MODBUS_CAPTURE_MAGIC, sizeof(header.magic));
+            header.version = MODBUS_CAPTURE_VERSION;
+            header.onebyte_time = ctx->onebyte_time;
+            if (write(fd, &header, sizeof(header)) != sizeof(header))
+            {
+                return -1;
+            }
+        }
+    }
+
+    ctx->capture_fd = fd;
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LIGHT_MODBUS_CAPTURE_H
+#define LIGHT_MODBUS_CAPTURE_H
+
+#include <stdint.h>
+
+#define MODBUS_CAPTURE_MAGIC "MBCP"
+#define MODBUS_CAPTURE_VERSION 1
+
+typedef enum {
+    MODBUS_CAPTURE_TX = 1,
+    MODBUS_CAPTURE_RX
+} modbus_capture_direction_t;
+
+/* The frame was cut short by a timeout or an error */
+#define MODBUS_CAPTURE_PARTIAL 0x01
+
+/* Header of a capture file, followed by records */
+typedef struct __attribute__((packed)) _modbus_capture_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    /* Of the line the capture was taken on, 0 if unknown */
+    uint32_t onebyte_time;
+    uint32_t reserved2;
+} modbus_capture_header_t;
+
+/* A frame, followed by its `length` raw bytes (CRC included) */
+typedef struct __attribute__((packed)) _modbus_capture_record {
+    /* CLOCK_MONOTONIC, when the frame was sent or fully received */
+    uint64_t ts_ns;
+    uint8_t direction;
+    uint8_t flags;
+    uint16_t length;
+} modbus_capture_record_t;
+
+#endif
@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "light-modbus-fault.h"
+#include "light-modbus-rtu.h"
+
+static void _fault_sleep_us(uint64_t us)
+{
+    struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    {
+    }
+}
+
+static modbus_fault_t _fault_draw(modbus_fault_ctx_t *f)
+{
+    double r = rand_r(&f->seed) / (RAND_MAX + 1.0);
+    int i;
+
+    for (i = MODBUS_FAULT_NONE + 1; i < MODBUS_FAULT_MAX; i++)
+    {
+        if (r < f->profile.rates[i])
+        {
+            return i;
+        }
+        r -= f->profile.rates[i];
+    }
+
+    return MODBUS_FAULT_NONE;
+}
+
+static int _modbus_fault_set_slave(modbus_t *ctx, int slave)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+    int rc = f->inner->backend->set_slave(f->inner, slave);
+
+    if (rc == 0)
+    {
+        ctx->slave = slave;
+    }
+    return rc;
+}
+
+static int _modbus_fault_build_request_basis(
+    modbus_t *ctx, int function, int addr, int nb, uint8_t size, uint8_t *req)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    return f->inner->backend->build_request_basis(f->inner, function, addr, nb, size, req);
+}
+
+/* Decides the fault of the transaction starting with this request */
+static ssize_t _modbus_fault_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    f->buffer_offset = f->buffer_length = 0;
+    f->rx_index = 0;
+    f->fault = _fault_draw(f);
+    f->injected[f->fault]++;
+
+    switch (f->fault)
+    {
+    case MODBUS_FAULT_DROP:
+        /* Within the shortest response, an exception */
+        f->fault_index = rand_r(&f->seed) % 5;
+        break;
+    case MODBUS_FAULT_CRC:
+        /* After the byte count, so that the frame length is unchanged */
+        f->fault_index = 3 + rand_r(&f->seed) % 2;
+        break;
+    case MODBUS_FAULT_TRUNCATE:
+        f->fault_index = 1 + rand_r(&f->seed) % 3;
+        break;
+    case MODBUS_FAULT_EBADF:
+        f->fault = MODBUS_FAULT_NONE;
+        errno = EBADF;
+        return -1;
+    default:
+        break;
+    }
+
+    return f->inner->backend->send(f->inner, req, req_length);
+}
+
+static int _modbus_fault_receive(modbus_t *ctx, uint8_t *req)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* Applies the fault to a chunk read from the inner backend */
+static void _fault_apply(modbus_fault_ctx_t *f, int length)
+{
+    int i, index;
+
+    for (i = 0; i < length; i++)
+    {
+        index = f->rx_index + i;
+        if (f->fault == MODBUS_FAULT_SLAVE && index == 0)
+        {
+            f->buffer[f->buffer_length] = f->buffer[f->buffer_length] % 247 + 1;
+        }
+        else if (f->fault == MODBUS_FAULT_CRC && index == f->fault_index)
+        {
+            f->buffer[f->buffer_length] ^= 0x01;
+        }
+        else if (f->fault == MODBUS_FAULT_DROP && index == f->fault_index)
+        {
+            memmove(f->buffer + f->buffer_length, f->buffer + f->buffer_length + 1, length - i - 1);
+            continue;
+        }
+        f->buffer_length++;
+    }
+    f->rx_index += length;
+}
+
+static int _modbus_fault_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+    modbus_t *inner = f->inner;
+    uint64_t timeout_us;
+    int rc;
+
+    if (f->buffer_offset < f->buffer_length)
+    {
+        return 1;
+    }
+    f->buffer_offset = f->buffer_length = 0;
+
+    for (;;)
+    {
+        timeout_us = tv == NULL ? UINT64_MAX : (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+        if (f->fault == MODBUS_FAULT_DELAY && f->rx_index == 0)
+        {
+            f->fault = MODBUS_FAULT_NONE;
+            if (f->profile.delay_us >= timeout_us)
+            {
+                _fault_sleep_us(timeout_us);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            _fault_sleep_us(f->profile.delay_us);
+            if (tv != NULL)
+            {
+                timeout_us -= f->profile.delay_us;
+                tv->tv_sec = timeout_us / 1000000;
+                tv->tv_usec = timeout_us % 1000000;
+            }
+        }
+
+        if (f->fault == MODBUS_FAULT_TRUNCATE)
+        {
+            if (f->rx_index >= f->fault_index)
+            {
+                /* The rest never comes */
+                if (timeout_us != UINT64_MAX)
+                {
+                    _fault_sleep_us(timeout_us);
+                }
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (length_to_read > f->fault_index - f->rx_index)
+            {
+                length_to_read = f->fault_index - f->rx_index;
+            }
+        }
+
+        rc = inner->backend->select(inner, rset, tv, length_to_read);
+        if (rc == -1)
+        {
+            return -1;
+        }
+
+        rc = inner->backend->recv(inner, f->buffer, length_to_read);
+        if (rc <= 0)
+        {
+            /* Let the core see the error in recv */
+            return 1;
+        }
+
+        _fault_apply(f, rc);
+        if (f->buffer_length > 0)
+        {
+            return 1;
+        }
+        /* The only byte was dropped, wait for the next one */
+        FD_ZERO(rset);
+        FD_SET(inner->s, rset);
+    }
+}
+
+static ssize_t _modbus_fault_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+    int available = f->buffer_length - f->buffer_offset;
+
+    if (available == 0)
+    {
+        /* select() got an error or an end of file from the inner backend */
+        return f->inner->backend->recv(f->inner, rsp, rsp_length);
+    }
+
+    if (rsp_length > available)
+    {
+        rsp_length = available;
+    }
+    memcpy(rsp, f->buffer + f->buffer_offset, rsp_length);
+    f->buffer_offset += rsp_length;
+
+    return rsp_length;
+}
+
+static int _modbus_fault_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    return f->inner->backend->check_integrity(f->inner, msg, msg_length);
+}
+
+static int _modbus_fault_pre_check_confirmation(modbus_t *ctx,
+                                                const uint8_t *req,
+                                                const uint8_t *rsp,
+                                                int rsp_length)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    return f->inner->backend->pre_check_confirmation(f->inner, req, rsp, rsp_length);
+}
+
+static int _modbus_fault_connect(modbus_t *ctx)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+    int rc = f->inner->backend->connect(f->inner);
+
+    ctx->s = f->inner->s;
+    return rc;
+}
+
+static unsigned int _modbus_fault_is_connected(modbus_t *ctx)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    return f->inner->backend->is_connected(f->inner);
+}
+
+static void _modbus_fault_close(modbus_t *ctx)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    f->inner->backend->close(f->inner);
+    ctx->s = f->inner->s;
+}
+
+static int _modbus_fault_flush(modbus_t *ctx)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+    int buffered = f->buffer_length - f->buffer_offset;
+    int rc;
+
+    f->buffer_offset = f->buffer_length = 0;
+    f->fault = MODBUS_FAULT_NONE;
+    rc = f->inner->backend->flush(f->inner);
+
+    return rc == -1 ? -1 : rc + buffered;
+}
+
+static void _modbus_fault_free(modbus_t *ctx)
+{
+    modbus_fault_ctx_t *f = ctx->backend_data;
+
+    if (f != NULL)
+    {
+        modbus_free(f->inner);
+        free(f);
+    }
+    free(ctx);
+}
+
+// clang-format off
+const modbus_backend_t _modbus_fault_backend = {
+    _MODBUS_BACKEND_TYPE_FAULT,
+    _MODBUS_RTU_HEADER_LENGTH,
+    _MODBUS_RTU_CHECKSUM_LENGTH,
+    MODBUS_RTU_MAX_ADU_LENGTH,
+    _modbus_fault_set_slave,
+    _modbus_fault_build_request_basis,
+    _modbus_rtu_build_response_basis,
+    _modbus_rtu_prepare_response_tid,
+    _modbus_rtu_send_msg_pre,
+    _modbus_fault_send,
+    _modbus_fault_receive,
+    _modbus_fault_recv,
+    _modbus_fault_check_integrity,
+    _modbus_fault_pre_check_confirmation,
+    _modbus_fault_connect,
+    _modbus_fault_is_connected,
+    _modbus_fault_close,
+    _modbus_fault_flush,
+    _modbus_fault_select,
+    _modbus_fault_free
+};
+
+// clang-format on
+
+modbus_t *modbus_new_fault(modbus_t *inner, const modbus_fault_profile_t *profile, unsigned int seed)
+{
+    modbus_t *ctx;
+    modbus_fault_ctx_t *f;
+
+    if (inner == NULL || profile == NULL || inner->backend->header_length != _MODBUS_RTU_HEADER_LENGTH)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    _modbus_init_common(ctx);
+    ctx->backend = &_modbus_fault_backend;
+    ctx->backend_data = calloc(1, sizeof(modbus_fault_ctx_t));
+    if (ctx->backend_data == NULL)
+    {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    f = ctx->backend_data;
+    f->inner = inner;
+    f->profile = *profile;
+    f->seed = seed;
+    ctx->onebyte_time = inner->onebyte_time;
+    ctx->response_timeout = inner->response_timeout;
+    ctx->byte_timeout = inner->byte_timeout;
+
+    return ctx;
+}
+
+int modbus_fault_set_profile(modbus_t *ctx, const modbus_fault_profile_t *profile)
+{
+    if (ctx == NULL || profile == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_FAULT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ((modbus_fault_ctx_t *)ctx->backend_data)->profile = *profile;
+    return 0;
+}
+
+int modbus_fault_get_injected(modbus_t *ctx, uint64_t injected[MODBUS_FAULT_MAX])
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_FAULT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(injected, ((modbus_fault_ctx_t *)ctx->backend_data)->injected, sizeof(uint64_t) * MODBUS_FAULT_MAX);
+    return 0;
+}
+
+const char *modbus_fault_name(modbus_fault_t fault)
+{
+    switch (fault)
+    {
+    case MODBUS_FAULT_NONE:
+        return "none";
+    case MODBUS_FAULT_DROP:
+        return "drop";
+    case MODBUS_FAULT_CRC:
+        return "crc";
+    case MODBUS_FAULT_SLAVE:
+        return "slave";
+    case MODBUS_FAULT_TRUNCATE:
+        return "truncate";
+    case MODBUS_FAULT_DELAY:
+        return "delay";
+    case MODBUS_FAULT_EBADF:
+        return "ebadf";
+    default:
+        return "?";
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef LIGHT_MODBUS_FAULT_H
+#define LIGHT_MODBUS_FAULT_H
+
+#include "light-modbus.h"
+
+typedef enum {
+    MODBUS_FAULT_NONE = 0,
+    /* One byte of the response is lost */
+    MODBUS_FAULT_DROP,
+    /* A data byte of the response is flipped, failing the CRC check */
+    MODBUS_FAULT_CRC,
+    /* The response comes from another slave */
+    MODBUS_FAULT_SLAVE,
+    /* The response stops after a few bytes */
+    MODBUS_FAULT_TRUNCATE,
+    /* The response starts delay_us late */
+    MODBUS_FAULT_DELAY,
+    /* The request can't be written, as when a USB adapter is unplugged */
+    MODBUS_FAULT_EBADF,
+    MODBUS_FAULT_MAX
+} modbus_fault_t;
+
+/* Probability of each fault per transaction, at most one fault is injected
+   per transaction */
+typedef struct _modbus_fault_profile {
+    double rates[MODBUS_FAULT_MAX];
+    unsigned int delay_us;
+} modbus_fault_profile_t;
+
+typedef struct _modbus_fault {
+    modbus_t* inner;
+    modbus_fault_profile_t profile;
+    unsigned int seed;
+    /* Fault of the transaction in progress */
+    modbus_fault_t fault;
+    /* Response byte the fault applies to */
+    int fault_index;
+    /* Response bytes received since the request */
+    int rx_index;
+    /* Bytes received from the inner backend, served by recv */
+    uint8_t buffer[MODBUS_RTU_MAX_ADU_LENGTH];
+    int buffer_length;
+    int buffer_offset;
+    uint64_t injected[MODBUS_FAULT_MAX];
+} modbus_fault_ctx_t;
+
+/**
+ * @brief Wrap a context with a RTU framed backend (serial port or loopback)
+ * in one injecting faults in its transactions. The new context owns inner.
+ */
+modbus_t* modbus_new_fault(modbus_t* inner, const modbus_fault_profile_t* profile, unsigned int seed);
+
+int modbus_fault_set_profile(modbus_t* ctx, const modbus_fault_profile_t* profile);
+
+/**
+ * @brief Number of faults of each type injected so far.
+ */
+int modbus_fault_get_injected(modbus_t* ctx, uint64_t injected[MODBUS_FAULT_MAX]);
+
+const char* modbus_fault_name(modbus_fault_t fault);
+
+#endif
@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "light-modbus-loopback.h"
+#include "light-modbus-rtu.h"
+
+static uint64_t _loopback_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _loopback_sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / 1000000000;
+    ts.tv_nsec = deadline_ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/* Appends bytes to the queue, the first one being on the line from start_ns */
+static int _loopback_queue(modbus_loopback_t *lb, const uint8_t *data, int length, uint64_t start_ns)
+{
+    uint64_t ready_ns;
+    int i;
+
+    if (lb->queue_offset > 0 && lb->queue_length + length > MODBUS_LOOPBACK_QUEUE_LENGTH)
+    {
+        lb->queue_length -= lb->queue_offset;
+        memmove(lb->queue, lb->queue + lb->queue_offset, lb->queue_length);
+        memmove(lb->ready_ns, lb->ready_ns + lb->queue_offset, lb->queue_length * sizeof(uint64_t));
+        lb->queue_offset = 0;
+    }
+
+    if (length > MODBUS_LOOPBACK_QUEUE_LENGTH - lb->queue_length)
+    {
+        length = MODBUS_LOOPBACK_QUEUE_LENGTH - lb->queue_length;
+    }
+
+    memcpy(lb->queue + lb->queue_length, data, length);
+    if (lb->byte_ns > 0)
+    {
+        /* Bytes follow the ones still on the line */
+        ready_ns = start_ns;
+        if (lb->queue_length > lb->queue_offset && lb->ready_ns[lb->queue_length - 1] > ready_ns)
+        {
+            ready_ns = lb->ready_ns[lb->queue_length - 1];
+        }
+        for (i = 0; i < length; i++)
+        {
+            ready_ns += lb->byte_ns;
+            lb->ready_ns[lb->queue_length + i] = ready_ns;
+        }
+    }
+    lb->queue_length += length;
+
+    return length;
+}
+
+static ssize_t _modbus_loopback_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_loopback_t *lb = ctx->backend_data;
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint16_t crc;
+    int rsp_length;
+
+    /* Like a real slave, ignore the frames with a bad CRC */
+    if (req_length < _MODBUS_RTU_PRESET_REQ_LENGTH + _MODBUS_RTU_CHECKSUM_LENGTH)
+    {
+        return req_length;
+    }
+    crc = _modbus_rtu_crc16(req, req_length - _MODBUS_RTU_CHECKSUM_LENGTH);
+    if (req[req_length - 2] != (crc & 0x00FF) || req[req_length - 1] != crc >> 8)
+    {
+        return req_length;
+    }
+
+    rsp_length = lb->slave(lb->user, req, req_length - _MODBUS_RTU_CHECKSUM_LENGTH, rsp);
+    if (rsp_length <= 0 || req[0] == MODBUS_BROADCAST_ADDRESS)
+    {
+        return req_length;
+    }
+    if (rsp_length > MODBUS_RTU_MAX_ADU_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH)
+    {
+        rsp_length = MODBUS_RTU_MAX_ADU_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH;
+    }
+    rsp_length = _modbus_rtu_send_msg_pre(rsp, rsp_length);
+
+    _loopback_queue(lb, rsp, rsp_length,
+                    lb->byte_ns > 0 ? _loopback_now_ns() + req_length * lb->byte_ns + lb->turnaround_ns : 0);
+
+    return req_length;
+}
+
+static int _modbus_loopback_receive(modbus_t *ctx, uint8_t *req)
+{
+    /* Only the master side is modelled */
+    errno = ENOTSUP;
+    return -1;
+}
+
+static ssize_t _modbus_loopback_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_loopback_t *lb = ctx->backend_data;
+    int available = lb->queue_length - lb->queue_offset;
+
+    if (lb->byte_ns > 0)
+    {
+        uint64_t now = _loopback_now_ns();
+        int ready = 1;
+
+        while (ready < available && lb->ready_ns[lb->queue_offset + ready] <= now)
+        {
+            ready++;
+        }
+        available = ready;
+    }
+    if (rsp_length > available)
+    {
+        rsp_length = available;
+    }
+
+    memcpy(rsp, lb->queue + lb->queue_offset, rsp_length);
+    lb->queue_offset += rsp_length;
+    if (lb->queue_offset == lb->queue_length)
+    {
+        lb->queue_offset = lb->queue_length = 0;
+    }
+
+    return rsp_length;
+}
+
+static int _modbus_loopback_connect(modbus_t *ctx)
+{
+    /* The core puts ctx->s in fd sets, give it a harmless descriptor */
+    ctx->s = open("/dev/null", O_RDWR | O_CLOEXEC);
+    return ctx->s == -1 ? -1 : 0;
+}
+
+static unsigned int _modbus_loopback_is_connected(modbus_t *ctx)
+{
+    return ctx->s >= 0;
+}
+
+static void _modbus_loopback_close(modbus_t *ctx)
+{
+    modbus_loopback_t *lb = ctx->backend_data;
+
+    if (ctx->s >= 0)
+    {
+        close(ctx->s);
+        ctx->s = -1;
+    }
+    lb->queue_offset = lb->queue_length = 0;
+}
+
+static int _modbus_loopback_flush(modbus_t *ctx)
+{
+    modbus_loopback_t *lb = ctx->backend_data;
+    int rc = lb->queue_length - lb->queue_offset;
+
+    lb->queue_offset = lb->queue_length = 0;
+    return rc;
+}
+
+static int _modbus_loopback_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+{
+    modbus_loopback_t *lb = ctx->backend_data;
+    uint64_t timeout_ns = tv == NULL ? UINT64_MAX : (uint64_t)tv->tv_sec * 1000000000 + tv->tv_usec * 1000;
+    uint64_t now, ready_ns;
+
+    if (lb->byte_ns == 0)
+    {
+        if (lb->queue_offset == lb->queue_length)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        return 1;
+    }
+
+    now = _loopback_now_ns();
+    ready_ns = lb->queue_offset < lb->queue_length ? lb->ready_ns[lb->queue_offset] : UINT64_MAX;
+    if (ready_ns > now && ready_ns - now > timeout_ns)
+    {
+        /* Nothing on the line in time, wait like a real timeout */
+        if (timeout_ns != UINT64_MAX)
+        {
+            _loopback_sleep_until(now + timeout_ns);
+        }
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (ready_ns > now)
+    {
+        _loopback_sleep_until(ready_ns);
+    }
+
+    return 1;
+}
+
+static void _modbus_loopback_free(modbus_t *ctx)
+{
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+// clang-format off
+const modbus_backend_t _modbus_loopback_backend = {
+    _MODBUS_BACKEND_TYPE_LOOPBACK,
+    _MODBUS_RTU_HEADER_LENGTH,
+    _MODBUS_RTU_CHECKSUM_LENGTH,
+    MODBUS_RTU_MAX_ADU_LENGTH,
+    _modbus_set_slave,
+    _modbus_rtu_build_request_basis,
+    _modbus_rtu_build_response_basis,
+    _modbus_rtu_prepare_response_tid,
+    _modbus_rtu_send_msg_pre,
+    _modbus_loopback_send,
+    _modbus_loopback_receive,
+    _modbus_loopback_recv,
+    _modbus_rtu_check_integrity,
+    _modbus_rtu_pre_check_confirmation,
+    _modbus_loopback_connect,
+    _modbus_loopback_is_connected,
+    _modbus_loopback_close,
+    _modbus_loopback_flush,
+    _modbus_loopback_select,
+    _modbus_loopback_free
+};
+
+// clang-format on
+
+modbus_t *modbus_new_loopback(modbus_loopback_slave_t slave, void *user)
+{
+    modbus_t *ctx;
+    modbus_loopback_t *lb;
+
+    if (slave == NULL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    _modbus_init_common(ctx);
+    ctx->backend = &_modbus_loopback_backend;
+    ctx->backend_data = calloc(1, sizeof(modbus_loopback_t));
+    if (ctx->backend_data == NULL)
+    {
+        modbus_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    lb = ctx->backend_data;
+    lb->slave = slave;
+    lb->user = user;
+
+    return ctx;
+}
+
+int modbus_loopback_set_line(modbus_t *ctx, int baud, unsigned int turnaround_us)
+{
+    modbus_loopback_t *lb;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_LOOPBACK || baud < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    lb = ctx->backend_data;
+    /* 10 bits per byte in 8N1 */
+    lb->byte_ns = baud > 0 ? 10000000000ULL / baud : 0;
+    lb->turnaround_ns = baud > 0 ? turnaround_us * 1000ULL : 0;
+    ctx->onebyte_time = lb->byte_ns / 1000;
+
+    return 0;
+}
+
+int modbus_loopback_feed(modbus_t *ctx, const uint8_t *data, int length)
+{
+    modbus_loopback_t *lb;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_LOOPBACK || length < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    lb = ctx->backend_data;
+    return _loopback_queue(lb, data, length, lb->byte_ns > 0 ? _loopback_now_ns() : 0);
+}
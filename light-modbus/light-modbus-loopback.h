@@ -0,0 +1,53 @@
+#ifndef LIGHT_MODBUS_LOOPBACK_H
+#define LIGHT_MODBUS_LOOPBACK_H
+
+#include "light-modbus.h"
+
+/* Room for a few frames not read by the master yet */
+#define MODBUS_LOOPBACK_QUEUE_LENGTH (4 * MODBUS_RTU_MAX_ADU_LENGTH)
+
+/**
+ * @brief In-process slave answering the requests sent on a loopback context.
+ *
+ * @param req the request (slave, function, address, count), without its CRC
+ * @param rsp where to write the response (slave, function, data), the CRC is
+ * appended by the backend
+ * @return the response length, 0 to stay silent (the master times out).
+ */
+typedef int (*modbus_loopback_slave_t)(void* user, const uint8_t* req, int req_length, uint8_t* rsp);
+
+typedef struct _modbus_loopback {
+    modbus_loopback_slave_t slave;
+    void* user;
+    /* Bytes sent by the slave model and not read yet */
+    uint8_t queue[MODBUS_LOOPBACK_QUEUE_LENGTH];
+    int queue_length;
+    int queue_offset;
+    /* Wire delays, disabled when byte_ns is 0. Each queued byte carries the
+       CLOCK_MONOTONIC time it is fully received at */
+    uint64_t byte_ns;
+    uint64_t turnaround_ns;
+    uint64_t ready_ns[MODBUS_LOOPBACK_QUEUE_LENGTH];
+} modbus_loopback_t;
+
+/**
+ * @brief Create a context doing RTU transactions with a slave model in memory
+ * instead of a serial port. Without wire delays, timeouts are immediate.
+ */
+modbus_t* modbus_new_loopback(modbus_loopback_slave_t slave, void* user);
+
+/**
+ * @brief Simulate the time taken by the frames on a line at baud (8N1), plus
+ * turnaround_us before the slave answers. A baud of 0 disables the delays.
+ */
+int modbus_loopback_set_line(modbus_t* ctx, int baud, unsigned int turnaround_us);
+
+/**
+ * @brief Queue raw bytes as if received from the line, e.g. to replay or fuzz
+ * responses.
+ *
+ * @return the number of bytes queued, less than length when the queue is full.
+ */
+int modbus_loopback_feed(modbus_t* ctx, const uint8_t* data, int length);
+
+#endif
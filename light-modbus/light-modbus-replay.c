@@ -0,0 +1,340 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "light-modbus-replay.h"
+#include "light-modbus-rtu.h"
+
+static uint64_t _replay_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _replay_sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts = {deadline_ns / 1000000000, deadline_ns % 1000000000};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/* Reads the record at offset, returns its bytes or NULL past the end */
+static const uint8_t *_replay_record(modbus_replay_t *r, size_t offset, modbus_capture_record_t *record)
+{
+    if (offset + sizeof(*record) > r->size)
+    {
+        return NULL;
+    }
+    memcpy(record, r->data + offset, sizeof(*record));
+    if (offset + sizeof(*record) + record->length > r->size)
+    {
+        /* Cut by a crash while capturing */
+        return NULL;
+    }
+    return r->data + offset + sizeof(*record);
+}
+
+/* Offset of the next request from offset, r->size if none */
+static size_t _replay_find_request(modbus_replay_t *r, size_t offset)
+{
+    modbus_capture_record_t record;
+
+    while (_replay_record(r, offset, &record) != NULL)
+    {
+        if (record.direction == MODBUS_CAPTURE_TX)
+        {
+            return offset;
+        }
+        offset += sizeof(record) + record.length;
+    }
+    return r->size;
+}
+
+static ssize_t _modbus_replay_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_replay_t *r = ctx->backend_data;
+    modbus_capture_record_t tx, rx;
+    const uint8_t *bytes;
+    uint64_t now = r->realtime ? _replay_now_ns() : 0;
+    size_t offset;
+
+    offset = _replay_find_request(r, r->position);
+    bytes = _replay_record(r, offset, &tx);
+    if (bytes == NULL)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+    if (tx.length != req_length || memcmp(bytes, req, req_length) != 0)
+    {
+        r->mismatches++;
+    }
+
+    /* Responses of this request, up to the next one */
+    r->queue_offset = r->queue_length = 0;
+    offset += sizeof(tx) + tx.length;
+    while ((bytes = _replay_record(r, offset, &rx)) != NULL && rx.direction == MODBUS_CAPTURE_RX)
+    {
+        int length = rx.length;
+        int i;
+
+        if (length > MODBUS_REPLAY_QUEUE_LENGTH - r->queue_length)
+        {
+            length = MODBUS_REPLAY_QUEUE_LENGTH - r->queue_length;
+        }
+        memcpy(r->queue + r->queue_length, bytes, length);
+        for (i = 0; i < length; i++)
+        {
+            r->ready_ns[r->queue_length + i] = now + (rx.ts_ns > tx.ts_ns ? rx.ts_ns - tx.ts_ns : 0);
+        }
+        r->queue_length += length;
+        offset += sizeof(rx) + rx.length;
+    }
+    r->position = offset;
+
+    return req_length;
+}
+
+static int _modbus_replay_receive(modbus_t *ctx, uint8_t *req)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+static ssize_t _modbus_replay_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_replay_t *r = ctx->backend_data;
+    int available = r->queue_length - r->queue_offset;
+
+    if (rsp_length > available)
+    {
+        rsp_length = available;
+    }
+    memcpy(rsp, r->queue + r->queue_offset, rsp_length);
+    r->queue_offset += rsp_length;
+
+    return rsp_length;
+}
+
+static int _modbus_replay_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+{
+    modbus_replay_t *r = ctx->backend_data;
+    uint64_t timeout_ns = tv == NULL ? UINT64_MAX : (uint64_t)tv->tv_sec * 1000000000 + tv->tv_usec * 1000;
+    uint64_t now, ready_ns;
+
+    if (!r->realtime)
+    {
+        if (r->queue_offset == r->queue_length)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        return 1;
+    }
+
+    now = _replay_now_ns();
+    ready_ns = r->queue_offset < r->queue_length ? r->ready_ns[r->queue_offset] : UINT64_MAX;
+    if (ready_ns > now && ready_ns - now > timeout_ns)
+    {
+        if (timeout_ns != UINT64_MAX)
+        {
+            _replay_sleep_until(now + timeout_ns);
+        }
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (ready_ns > now)
+    {
+        _replay_sleep_until(ready_ns);
+    }
+
+    return 1;
+}
+
+static int _modbus_replay_connect(modbus_t *ctx)
+{
+    /* The core puts ctx->s in fd sets, give it a harmless descriptor */
+    ctx->s = open("/dev/null", O_RDWR | O_CLOEXEC);
+    return ctx->s == -1 ? -1 : 0;
+}
+
+static unsigned int _modbus_replay_is_connected(modbus_t *ctx)
+{
+    return ctx->s >= 0;
+}
+
+static void _modbus_replay_close(modbus_t *ctx)
+{
+    if (ctx->s >= 0)
+    {
+        close(ctx->s);
+        ctx->s = -1;
+    }
+}
+
+static int _modbus_replay_flush(modbus_t *ctx)
+{
+    modbus_replay_t *r = ctx->backend_data;
+    int rc = r->queue_length - r->queue_offset;
+
+    r->queue_offset = r->queue_length = 0;
+    return rc;
+}
+
+static void _modbus_replay_free(modbus_t *ctx)
+{
+    modbus_replay_t *r = ctx->backend_data;
+
+    if (r != NULL)
+    {
+        if (r->data != NULL)
+        {
+            munmap((void *)r->data, r->size);
+        }
+        free(r);
+    }
+    free(ctx);
+}
+
+// clang-format off
+const modbus_backend_t _modbus_replay_backend = {
+    _MODBUS_BACKEND_TYPE_REPLAY,
+    _MODBUS_RTU_HEADER_LENGTH,
+    _MODBUS_RTU_CHECKSUM_LENGTH,
+    MODBUS_RTU_MAX_ADU_LENGTH,
+    _modbus_set_slave,
+    _modbus_rtu_build_request_basis,
+    _modbus_rtu_build_response_basis,
+    _modbus_rtu_prepare_response_tid,
+    _modbus_rtu_send_msg_pre,
+    _modbus_replay_send,
+    _modbus_replay_receive,
+    _modbus_replay_recv,
+    _modbus_rtu_check_integrity,
+    _modbus_rtu_pre_check_confirmation,
+    _modbus_replay_connect,
+    _modbus_replay_is_connected,
+    _modbus_replay_close,
+    _modbus_replay_flush,
+    _modbus_replay_select,
+    _modbus_replay_free
+};
+
+// clang-format on
+
+modbus_t *modbus_new_replay(const char *path, int realtime)
+{
+    modbus_capture_header_t header;
+    modbus_t *ctx;
+    modbus_replay_t *r;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    _modbus_init_common(ctx);
+    ctx->backend = &_modbus_replay_backend;
+    ctx->backend_data = calloc(1, sizeof(modbus_replay_t));
+    if (ctx->backend_data == NULL)
+    {
+        close(fd);
+        modbus_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    r = ctx->backend_data;
+    r->size = st.st_size;
+    r->data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->data == MAP_FAILED)
+    {
+        r->data = NULL;
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    memcpy(&header, r->data, sizeof(header));
+    if (memcmp(header.magic, MODBUS_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MODBUS_CAPTURE_VERSION)
+    {
+        modbus_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    r->position = sizeof(header);
+    r->realtime = realtime;
+    ctx->onebyte_time = header.onebyte_time;
+
+    return ctx;
+}
+
+int modbus_replay_next_request(modbus_t *ctx, uint8_t *req, uint64_t *ts_ns)
+{
+    modbus_replay_t *r;
+    modbus_capture_record_t record;
+    const uint8_t *bytes;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_REPLAY)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r = ctx->backend_data;
+    bytes = _replay_record(r, _replay_find_request(r, r->position), &record);
+    if (bytes == NULL)
+    {
+        return 0;
+    }
+
+    if (record.length > MODBUS_RTU_MAX_ADU_LENGTH)
+    {
+        record.length = MODBUS_RTU_MAX_ADU_LENGTH;
+    }
+    memcpy(req, bytes, record.length);
+    if (ts_ns != NULL)
+    {
+        *ts_ns = record.ts_ns;
+    }
+
+    return record.length;
+}
+
+uint64_t modbus_replay_get_mismatches(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_REPLAY)
+    {
+        return 0;
+    }
+
+    return ((modbus_replay_t *)ctx->backend_data)->mismatches;
+}
@@ -0,0 +1,51 @@
+#ifndef LIGHT_MODBUS_REPLAY_H
+#define LIGHT_MODBUS_REPLAY_H
+
+#include <stddef.h>
+
+#include "light-modbus.h"
+
+#define MODBUS_REPLAY_QUEUE_LENGTH (4 * MODBUS_RTU_MAX_ADU_LENGTH)
+
+typedef struct _modbus_replay {
+    /* The capture file, mapped */
+    const uint8_t* data;
+    size_t size;
+    /* Offset of the next record */
+    size_t position;
+    /* Serve the responses with their recorded delay after the request,
+       instead of at once */
+    int realtime;
+    /* Requests differing from the recorded ones */
+    uint64_t mismatches;
+    /* Response bytes of the current transaction */
+    uint8_t queue[MODBUS_REPLAY_QUEUE_LENGTH];
+    uint64_t ready_ns[MODBUS_REPLAY_QUEUE_LENGTH];
+    int queue_length;
+    int queue_offset;
+} modbus_replay_t;
+
+/**
+ * @brief Create a context replaying a capture written with
+ * modbus_set_capture(): each request sent gets the responses that followed
+ * the next recorded request, through the usual receive and check path.
+ *
+ * @param realtime serve the responses with their recorded delays
+ */
+modbus_t* modbus_new_replay(const char* path, int realtime);
+
+/**
+ * @brief Get the next recorded request, to be issued by the caller.
+ *
+ * @param req MODBUS_RTU_MAX_ADU_LENGTH bytes
+ * @param ts_ns when it was sent (CLOCK_MONOTONIC of the capturing host), may be NULL
+ * @return its length, 0 at the end of the capture.
+ */
+int modbus_replay_next_request(modbus_t* ctx, uint8_t* req, uint64_t* ts_ns);
+
+/**
+ * @brief Number of requests sent that differed from the recorded ones.
+ */
+uint64_t modbus_replay_get_mismatches(modbus_t* ctx);
+
+#endif
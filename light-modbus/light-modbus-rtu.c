@@ -6,20 +6,22 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
 #include "light-modbus-rtu.h"
 #include <assert.h>
 
-#if HAVE_DECL_TIOCSRS485 || HAVE_DECL_TIOCM_RTS
+#if HAVE_DECL_TIOCSRS485 || HAVE_DECL_TIOCM_RTS || HAVE_DECL_TIOCSSERIAL
 #include <sys/ioctl.h>
 #endif
 
-#if HAVE_DECL_TIOCSRS485
+#if HAVE_DECL_TIOCSRS485 || HAVE_DECL_TIOCSSERIAL
 #include <linux/serial.h>
 #endif
 
@@ -87,12 +89,18 @@ void _modbus_init_common(modbus_t *ctx)
 
     ctx->indication_timeout.tv_sec = 0;
     ctx->indication_timeout.tv_usec = 0;
+
+    memset(&ctx->stats, 0, sizeof(modbus_stats_t));
+    ctx->trace = NULL;
+    ctx->onebyte_time = 0;
+    memset(&ctx->timing, 0, sizeof(modbus_timing_t));
+    ctx->capture_fd = -1;
 }
 
 
 /* Define the slave ID of the remote device to talk in master mode or set the
  * internal slave ID in slave mode */
-static int _modbus_set_slave(modbus_t* ctx, int slave)
+int _modbus_set_slave(modbus_t* ctx, int slave)
 {
     int max_slave = (ctx->quirks & MODBUS_QUIRK_MAX_SLAVE) ? 255 : 247;
 
@@ -108,7 +116,7 @@ static int _modbus_set_slave(modbus_t* ctx, int slave)
 }
 
 /* Builds a RTU request header */
-static int _modbus_rtu_build_request_basis(
+int _modbus_rtu_build_request_basis(
     modbus_t* ctx, int function, int addr, int nb, uint8_t size, uint8_t* req)
 {
     assert(ctx->slave != -1);
@@ -123,7 +131,7 @@ static int _modbus_rtu_build_request_basis(
 }
 
 /* Builds a RTU response header */
-static int _modbus_rtu_build_response_basis(sft_t* sft, uint8_t* rsp)
+int _modbus_rtu_build_response_basis(sft_t* sft, uint8_t* rsp)
 {
     /* In this case, the slave is certainly valid because a check is already
      * done in _modbus_rtu_listen */
@@ -133,7 +141,7 @@ static int _modbus_rtu_build_response_basis(sft_t* sft, uint8_t* rsp)
     return _MODBUS_RTU_PRESET_RSP_LENGTH;
 }
 
-static uint16_t crc16(uint8_t* buffer, uint16_t buffer_length)
+uint16_t _modbus_rtu_crc16(const uint8_t* buffer, uint16_t buffer_length)
 {
     uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
     uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
@@ -149,16 +157,16 @@ static uint16_t crc16(uint8_t* buffer, uint16_t buffer_length)
     return (crc_hi << 8 | crc_lo);
 }
 
-static int _modbus_rtu_prepare_response_tid(const uint8_t* req, int* req_length)
+int _modbus_rtu_prepare_response_tid(const uint8_t* req, int* req_length)
 {
     (*req_length) -= _MODBUS_RTU_CHECKSUM_LENGTH;
     /* No TID */
     return 0;
 }
 
-static int _modbus_rtu_send_msg_pre(uint8_t* req, int req_length)
+int _modbus_rtu_send_msg_pre(uint8_t* req, int req_length)
 {
-    uint16_t crc = crc16(req, req_length);
+    uint16_t crc = _modbus_rtu_crc16(req, req_length);
 
     /* According to the MODBUS specs (p. 14), the low order byte of the CRC comes
      * first in the RTU message */
@@ -256,6 +264,53 @@ static int win32_ser_read(struct win32_ser* ws, uint8_t* p_msg, unsigned int max
 }
 #endif
 
+#if HAVE_DECL_TIOCSRS485
+/* Hands RTS over to the driver: it raises RTS (or lowers it, with
+ * MODBUS_RTU_RTS_DOWN) before the first bit and restores it once the last
+ * bit has left the shift register. Fails with ENOTTY or EINVAL when the
+ * driver has no RS-485 support, e.g. most USB adapters. */
+static int _modbus_rtu_set_kernel_rts(modbus_t* ctx, int mode, int delay_us)
+{
+    struct serial_rs485 rs485conf;
+    /* The kernel counts in milliseconds */
+    int delay_ms = (delay_us + 999) / 1000;
+
+    if (ioctl(ctx->s, TIOCGRS485, &rs485conf) < 0) {
+        return -1;
+    }
+
+    if (mode == MODBUS_RTU_RTS_NONE) {
+        rs485conf.flags &= ~SER_RS485_ENABLED;
+    } else {
+        rs485conf.flags |= SER_RS485_ENABLED;
+        if (mode == MODBUS_RTU_RTS_UP) {
+            rs485conf.flags |= SER_RS485_RTS_ON_SEND;
+            rs485conf.flags &= ~SER_RS485_RTS_AFTER_SEND;
+        } else {
+            rs485conf.flags &= ~SER_RS485_RTS_ON_SEND;
+            rs485conf.flags |= SER_RS485_RTS_AFTER_SEND;
+        }
+        rs485conf.delay_rts_before_send = delay_ms;
+        rs485conf.delay_rts_after_send = delay_ms;
+    }
+
+    if (ioctl(ctx->s, TIOCSRS485, &rs485conf) < 0) {
+        return -1;
+    }
+
+    /* The driver may not support the requested polarity and adjust it */
+    if (mode != MODBUS_RTU_RTS_NONE && ioctl(ctx->s, TIOCGRS485, &rs485conf) == 0
+        && !!(rs485conf.flags & SER_RS485_RTS_ON_SEND) != (mode == MODBUS_RTU_RTS_UP)) {
+        rs485conf.flags &= ~SER_RS485_ENABLED;
+        ioctl(ctx->s, TIOCSRS485, &rs485conf);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
 #if HAVE_DECL_TIOCM_RTS
 static void _modbus_rtu_ioctl_rts(modbus_t* ctx, int on)
 {
@@ -281,9 +336,20 @@ static ssize_t _modbus_rtu_send(modbus_t* ctx, const uint8_t* req, int req_lengt
         ? (ssize_t)n_bytes
         : -1;
 #else
-#if HAVE_DECL_TIOCM_RTS
     modbus_rtu_t* ctx_rtu = ctx->backend_data;
+
+    if (ctx_rtu->listen_only) {
+        errno = EPERM;
+        return -1;
+    }
+#if HAVE_DECL_TIOCM_RTS
+#if HAVE_DECL_TIOCSRS485
+    /* The driver toggles RTS itself */
+    if (ctx_rtu->rts != MODBUS_RTU_RTS_NONE && !ctx_rtu->kernel_rts) {
+#else
     if (ctx_rtu->rts != MODBUS_RTU_RTS_NONE) {
+#endif
+        struct timespec sent;
         ssize_t size;
 
         if (ctx->debug) {
@@ -294,8 +360,11 @@ static ssize_t _modbus_rtu_send(modbus_t* ctx, const uint8_t* req, int req_lengt
         usleep(ctx_rtu->rts_delay);
 
         size = write(ctx->s, req, req_length);
+        /* The wait below isn't the slave's turnaround */
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        ctx->timing.sent_ns = (uint64_t)sent.tv_sec * 1000000000 + sent.tv_nsec;
 
-        usleep(ctx_rtu->onebyte_time * req_length + ctx_rtu->rts_delay);
+        usleep(ctx->onebyte_time * req_length + ctx_rtu->rts_delay);
         ctx_rtu->set_rts(ctx, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
 
         return size;
@@ -336,9 +405,7 @@ static ssize_t _modbus_rtu_recv(modbus_t* ctx, uint8_t* rsp, int rsp_length)
     return read(ctx->s, rsp, rsp_length);
 }
 
-static int _modbus_rtu_flush(modbus_t*);
-
-static int _modbus_rtu_pre_check_confirmation(modbus_t* ctx,
+int _modbus_rtu_pre_check_confirmation(modbus_t* ctx,
     const uint8_t* req,
     const uint8_t* rsp,
     int rsp_length)
@@ -362,7 +429,7 @@ static int _modbus_rtu_pre_check_confirmation(modbus_t* ctx,
 /* The check_crc16 function shall return 0 if the message is ignored and the
    message length if the CRC is valid. Otherwise it shall return -1 and set
    errno to EMBBADCRC. */
-static int _modbus_rtu_check_integrity(modbus_t* ctx, uint8_t* msg, const int msg_length)
+int _modbus_rtu_check_integrity(modbus_t* ctx, uint8_t* msg, const int msg_length)
 {
     uint16_t crc_calculated;
     uint16_t crc_received;
@@ -378,7 +445,7 @@ static int _modbus_rtu_check_integrity(modbus_t* ctx, uint8_t* msg, const int ms
         return 0;
     }
 
-    crc_calculated = crc16(msg, msg_length - 2);
+    crc_calculated = _modbus_rtu_crc16(msg, msg_length - 2);
     crc_received = (msg[msg_length - 1] << 8) | msg[msg_length - 2];
 
     /* Check CRC of msg */
@@ -393,7 +460,7 @@ static int _modbus_rtu_check_integrity(modbus_t* ctx, uint8_t* msg, const int ms
         }
 
         if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-            _modbus_rtu_flush(ctx);
+            ctx->backend->flush(ctx);
         }
         errno = EMBBADCRC;
         return -1;
@@ -513,6 +580,105 @@ static speed_t _get_termios_speed(int baud, int debug)
 }
 
 /* POSIX */
+#if HAVE_DECL_TIOCSSERIAL
+/* Latency timer of the USB serial adapter behind the device, in ms */
+static int _modbus_rtu_latency_timer(const char* device, int ms)
+{
+    char tty[PATH_MAX];
+    char path[PATH_MAX];
+    char value[16];
+    const char* name;
+    ssize_t n;
+    int fd;
+
+    /* Follow /dev/serial/by-id links to the tty name */
+    if (realpath(device, tty) == NULL) {
+        return -1;
+    }
+    name = strrchr(tty, '/');
+    name = (name == NULL) ? tty : name + 1;
+    if (snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", name)
+        >= (int)sizeof(path)) {
+        return -1;
+    }
+
+    if (ms != -1) {
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            n = snprintf(value, sizeof(value), "%d", ms);
+            /* Whether the adapter took it is read back below */
+            n = write(fd, value, n);
+            close(fd);
+        }
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    value[n] = '\0';
+    return atoi(value);
+}
+#endif
+
+/* Apply the low-latency settings and find out the ones in effect */
+static void _modbus_rtu_tune_line(modbus_t* ctx, const struct termios* tios)
+{
+    modbus_rtu_t* ctx_rtu = ctx->backend_data;
+#if HAVE_DECL_TIOCSSERIAL
+    struct serial_struct serial;
+#endif
+
+    ctx_rtu->line.low_latency = FALSE;
+    ctx_rtu->line.latency_timer = -1;
+    ctx_rtu->line.vmin = tios->c_cc[VMIN];
+    ctx_rtu->line.vtime = tios->c_cc[VTIME];
+
+#if HAVE_DECL_TIOCSSERIAL
+    /* Not a real UART (e.g. a pty) when TIOCGSERIAL fails */
+    if (ioctl(ctx->s, TIOCGSERIAL, &serial) == 0) {
+        if (ctx_rtu->low_latency && !(serial.flags & ASYNC_LOW_LATENCY)) {
+            serial.flags |= ASYNC_LOW_LATENCY;
+            if (ioctl(ctx->s, TIOCSSERIAL, &serial) < 0) {
+                if (ctx->debug) {
+                    fprintf(stderr,
+                        "Can't set ASYNC_LOW_LATENCY on %s (%s)\n",
+                        ctx_rtu->device,
+                        strerror(errno));
+                }
+            }
+            ioctl(ctx->s, TIOCGSERIAL, &serial);
+        }
+        ctx_rtu->line.low_latency = (serial.flags & ASYNC_LOW_LATENCY) != 0;
+    }
+
+    ctx_rtu->line.latency_timer = _modbus_rtu_latency_timer(
+        ctx_rtu->device, ctx_rtu->low_latency ? ctx_rtu->latency_timer : -1);
+    /* -1 when the port isn't a USB adapter with a latency timer */
+    if (ctx_rtu->low_latency && ctx_rtu->latency_timer != -1 &&
+        ctx_rtu->line.latency_timer != -1 &&
+        ctx_rtu->line.latency_timer != ctx_rtu->latency_timer && ctx->debug) {
+        fprintf(stderr,
+            "Can't set the latency timer of %s to %d ms\n",
+            ctx_rtu->device,
+            ctx_rtu->latency_timer);
+    }
+#endif
+
+    if (ctx->debug) {
+        printf("Line: low latency %s, latency timer %d ms, VMIN %d, VTIME %d\n",
+            ctx_rtu->line.low_latency ? "on" : "off",
+            ctx_rtu->line.latency_timer,
+            ctx_rtu->line.vmin,
+            ctx_rtu->line.vtime);
+    }
+}
+
 static int _modbus_rtu_connect(modbus_t* ctx)
 {
     struct termios tios;
@@ -745,7 +911,10 @@ static int _modbus_rtu_connect(modbus_t* ctx)
        default), reads will block (wait) indefinitely unless the
        NDELAY option is set on the port with open or fcntl.
     */
-    /* Unused because we use open with the NDELAY option */
+    /* Unused because we use open with the NDELAY option: reads are driven by
+       select() with the response and byte timeouts, then return what has
+       arrived at once. The inter-byte latency is up to the driver and the
+       adapter, which _modbus_rtu_tune_line() takes care of. */
     tios.c_cc[VMIN] = 0;
     tios.c_cc[VTIME] = 0;
 
@@ -755,6 +924,8 @@ static int _modbus_rtu_connect(modbus_t* ctx)
         return -1;
     }
 
+    _modbus_rtu_tune_line(ctx, &tios);
+
     return 0;
 }
 
@@ -809,6 +980,7 @@ int modbus_rtu_set_serial_mode(modbus_t* ctx, int mode)
                 }
             }
             ctx_rtu->serial_mode = MODBUS_RTU_RS232;
+            ctx_rtu->kernel_rts = FALSE;
             return 0;
         }
 #else
@@ -887,6 +1059,24 @@ int modbus_rtu_set_rts(modbus_t* ctx, int mode)
         if (mode == MODBUS_RTU_RTS_NONE || mode == MODBUS_RTU_RTS_UP || mode == MODBUS_RTU_RTS_DOWN) {
             ctx_rtu->rts = mode;
 
+#if HAVE_DECL_TIOCSRS485
+            /* Only with the default RTS function, a custom one is there for
+               a reason (e.g. a GPIO) */
+            if (ctx_rtu->set_rts == _modbus_rtu_ioctl_rts) {
+                if (_modbus_rtu_set_kernel_rts(ctx, mode, ctx_rtu->rts_delay) == 0) {
+                    ctx_rtu->kernel_rts = mode != MODBUS_RTU_RTS_NONE;
+                    if (ctx_rtu->kernel_rts) {
+                        return 0;
+                    }
+                } else {
+                    if (ctx->debug) {
+                        fprintf(stderr, "No kernel RS-485 support (%s), toggling RTS around writes\n", strerror(errno));
+                    }
+                    ctx_rtu->kernel_rts = FALSE;
+                }
+            }
+#endif
+
             /* Set the RTS bit in order to not reserve the RS485 bus */
             ctx_rtu->set_rts(ctx, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
 
@@ -918,6 +1108,12 @@ int modbus_rtu_set_custom_rts(modbus_t* ctx, void (*set_rts)(modbus_t* ctx, int
     if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
 #if HAVE_DECL_TIOCM_RTS
         modbus_rtu_t* ctx_rtu = ctx->backend_data;
+#if HAVE_DECL_TIOCSRS485
+        if (ctx_rtu->kernel_rts) {
+            _modbus_rtu_set_kernel_rts(ctx, MODBUS_RTU_RTS_NONE, 0);
+            ctx_rtu->kernel_rts = FALSE;
+        }
+#endif
         ctx_rtu->set_rts = set_rts;
         return 0;
 #else
@@ -970,6 +1166,11 @@ int modbus_rtu_set_rts_delay(modbus_t* ctx, int us)
         modbus_rtu_t* ctx_rtu;
         ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
         ctx_rtu->rts_delay = us;
+#if HAVE_DECL_TIOCSRS485
+        if (ctx_rtu->kernel_rts) {
+            return _modbus_rtu_set_kernel_rts(ctx, ctx_rtu->rts, us);
+        }
+#endif
         return 0;
 #else
         if (ctx->debug) {
@@ -984,6 +1185,69 @@ int modbus_rtu_set_rts_delay(modbus_t* ctx, int us)
     }
 }
 
+int modbus_rtu_is_kernel_rts(modbus_t* ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if HAVE_DECL_TIOCSRS485
+    return ((modbus_rtu_t*)ctx->backend_data)->kernel_rts;
+#else
+    return FALSE;
+#endif
+}
+
+int modbus_rtu_set_low_latency(modbus_t* ctx, int latency_timer)
+{
+    modbus_rtu_t* ctx_rtu;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU ||
+        latency_timer < -1 || latency_timer == 0 || latency_timer > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t*)ctx->backend_data;
+    ctx_rtu->low_latency = TRUE;
+    ctx_rtu->latency_timer = latency_timer;
+    return 0;
+}
+
+int modbus_rtu_get_line(modbus_t* ctx, modbus_rtu_line_t* line)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU ||
+        line == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *line = ((modbus_rtu_t*)ctx->backend_data)->line;
+    return 0;
+}
+
+int modbus_rtu_set_listen_only(modbus_t* ctx, int flag)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ((modbus_rtu_t*)ctx->backend_data)->listen_only = flag ? TRUE : FALSE;
+    return 0;
+}
+
+int modbus_rtu_get_listen_only(modbus_t* ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ((modbus_rtu_t*)ctx->backend_data)->listen_only;
+}
+
 static void _modbus_rtu_close(modbus_t* ctx)
 {
     /* Restore line settings and close file descriptor in RTU mode */
@@ -1157,26 +1421,35 @@ modbus_new_rtu(const char* device, int baud, char parity, int data_bit, int stop
     ctx_rtu->data_bit = data_bit;
     ctx_rtu->stop_bit = stop_bit;
 
+    /* Calculate estimated time in micro second to send one byte */
+    ctx->onebyte_time = 1000000 * (1 + data_bit + (parity == 'N' ? 0 : 1) + stop_bit) / baud;
+
 #if HAVE_DECL_TIOCSRS485
     /* The RS232 mode has been set by default */
     ctx_rtu->serial_mode = MODBUS_RTU_RS232;
+    ctx_rtu->kernel_rts = FALSE;
 #endif
 
 #if HAVE_DECL_TIOCM_RTS
     /* The RTS use has been set by default */
     ctx_rtu->rts = MODBUS_RTU_RTS_NONE;
 
-    /* Calculate estimated time in micro second to send one byte */
-    ctx_rtu->onebyte_time = 1000000 * (1 + data_bit + (parity == 'N' ? 0 : 1) + stop_bit) / baud;
-
     /* The internal function is used by default to set RTS */
     ctx_rtu->set_rts = _modbus_rtu_ioctl_rts;
 
     /* The delay before and after transmission when toggling the RTS pin */
-    ctx_rtu->rts_delay = ctx_rtu->onebyte_time;
+    ctx_rtu->rts_delay = ctx->onebyte_time;
 #endif
 
     ctx_rtu->confirmation_to_ignore = FALSE;
 
+    ctx_rtu->low_latency = FALSE;
+    ctx_rtu->latency_timer = -1;
+    ctx_rtu->line.low_latency = FALSE;
+    ctx_rtu->line.latency_timer = -1;
+    ctx_rtu->listen_only = FALSE;
+    ctx_rtu->line.vmin = 0;
+    ctx_rtu->line.vtime = 0;
+
     return ctx;
 }
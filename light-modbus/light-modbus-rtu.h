@@ -1,5 +1,33 @@
+#ifndef LIGHT_MODBUS_RTU_H
+#define LIGHT_MODBUS_RTU_H
+
 #include "light-modbus.h"
 
+/* Detected by autoconf in libmodbus; both ioctls are there on Linux */
+#if defined(__linux__)
+#define HAVE_DECL_TIOCSRS485 1
+#define HAVE_DECL_TIOCM_RTS 1
+#define HAVE_DECL_TIOCSSERIAL 1
+#endif
+
+#define MODBUS_RTU_RS232 0
+#define MODBUS_RTU_RS485 1
+
+#define MODBUS_RTU_RTS_NONE 0
+#define MODBUS_RTU_RTS_UP   1
+#define MODBUS_RTU_RTS_DOWN 2
+
+/* Line settings in effect once connected */
+typedef struct {
+    /* ASYNC_LOW_LATENCY is set on the port */
+    int low_latency;
+    /* Latency timer of the USB adapter in ms, -1 when it has none or it
+       can't be read */
+    int latency_timer;
+    int vmin;
+    int vtime;
+} modbus_rtu_line_t;
+
 typedef struct _modbus_rtu {
     /* Device: "/dev/ttyS0", "/dev/ttyUSB0" or "/dev/tty.USA19*" on Mac OS X. */
     char *device;
@@ -13,12 +41,102 @@ typedef struct _modbus_rtu {
     char parity;
     /* Save old termios settings */
     struct termios old_tios;
+#if HAVE_DECL_TIOCSRS485
+    int serial_mode;
+    /* RTS is driven by the kernel RS-485 support of the driver instead of
+       around each write */
+    int kernel_rts;
+#endif
+#if HAVE_DECL_TIOCM_RTS
+    int rts;
+    int rts_delay;
+    void (*set_rts)(modbus_t* ctx, int on);
+#endif
     /* To handle many slaves on the same link */
     int confirmation_to_ignore;
+    /* Tune the line for latency at connect */
+    int low_latency;
+    /* Latency timer to set in ms, -1 to leave the one of the adapter */
+    int latency_timer;
+    modbus_rtu_line_t line;
+    /* Never transmit, see modbus_rtu_set_listen_only() */
+    int listen_only;
 } modbus_rtu_t;
 
 /* Timeouts in microsecond (0.5 s) */
 #define _RESPONSE_TIMEOUT 500000
 #define _BYTE_TIMEOUT     500000
 
-modbus_t* modbus_new_rtu(const char* device, int baud, char parity, int data_bit, int stop_bit);
\ No newline at end of file
+modbus_t* modbus_new_rtu(const char* device, int baud, char parity, int data_bit, int stop_bit);
+
+int modbus_rtu_set_serial_mode(modbus_t* ctx, int mode);
+int modbus_rtu_get_serial_mode(modbus_t* ctx);
+
+/**
+ * @brief Drive RTS to switch the direction of an RS-485 transceiver: RTS is
+ * at the MODBUS_RTU_RTS_UP or MODBUS_RTU_RTS_DOWN level while sending. Set
+ * once connected.
+ *
+ * The kernel RS-485 support (TIOCSRS485) toggles RTS when the driver has it,
+ * at the exact end of the frame. Otherwise RTS is toggled around each write,
+ * sleeping for the estimated time of the frame.
+ */
+int modbus_rtu_set_rts(modbus_t* ctx, int mode);
+int modbus_rtu_get_rts(modbus_t* ctx);
+
+/**
+ * @brief Toggle RTS with set_rts instead of TIOCMSET, around each write.
+ * The kernel RS-485 support isn't used then.
+ */
+int modbus_rtu_set_custom_rts(modbus_t* ctx, void (*set_rts)(modbus_t* ctx, int on));
+
+/**
+ * @brief Delay between RTS and the frame, before and after (one byte time by
+ * default). The kernel RS-485 support counts in milliseconds, rounded up.
+ */
+int modbus_rtu_set_rts_delay(modbus_t* ctx, int us);
+int modbus_rtu_get_rts_delay(modbus_t* ctx);
+
+/**
+ * @brief Whether RTS is driven by the kernel RS-485 support.
+ */
+int modbus_rtu_is_kernel_rts(modbus_t* ctx);
+
+/**
+ * @brief Tune the line for latency at the next connect: set ASYNC_LOW_LATENCY
+ * (TIOCSSERIAL) so that the driver pushes received bytes at once, and when
+ * latency_timer isn't -1, write it (ms) to the latency timer of USB adapters
+ * (/sys/class/tty/<tty>/device/latency_timer, 16 ms by default on FTDI ones).
+ * Settings the driver or the permissions refuse are left as they are.
+ */
+int modbus_rtu_set_low_latency(modbus_t* ctx, int latency_timer);
+
+/**
+ * @brief Get the line settings in effect, once connected.
+ */
+int modbus_rtu_get_line(modbus_t* ctx, modbus_rtu_line_t* line);
+
+/**
+ * @brief Never transmit, to watch a line driven by another master (see
+ * light-modbus-sniff.h): every send fails with EPERM, and RTS is left at the
+ * receiving level.
+ */
+int modbus_rtu_set_listen_only(modbus_t* ctx, int flag);
+int modbus_rtu_get_listen_only(modbus_t* ctx);
+
+/* RTU framing, shared with the backends speaking RTU over something else
+   than a serial port */
+int _modbus_set_slave(modbus_t* ctx, int slave);
+int _modbus_rtu_build_request_basis(
+    modbus_t* ctx, int function, int addr, int nb, uint8_t size, uint8_t* req);
+int _modbus_rtu_build_response_basis(sft_t* sft, uint8_t* rsp);
+uint16_t _modbus_rtu_crc16(const uint8_t* buffer, uint16_t buffer_length);
+int _modbus_rtu_prepare_response_tid(const uint8_t* req, int* req_length);
+int _modbus_rtu_send_msg_pre(uint8_t* req, int req_length);
+int _modbus_rtu_pre_check_confirmation(modbus_t* ctx,
+    const uint8_t* req,
+    const uint8_t* rsp,
+    int rsp_length);
+int _modbus_rtu_check_integrity(modbus_t* ctx, uint8_t* msg, const int msg_length);
+
+#endif
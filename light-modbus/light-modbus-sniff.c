@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "light-modbus-rtu.h"
+#include "light-modbus-sniff.h"
+
+/* Slave, function, exception code and CRC */
+#define _SNIFF_EXCEPTION_LENGTH 5
+/* Slave, function, address, count and CRC */
+#define _SNIFF_READ_REQUEST_LENGTH 8
+
+static int _sniff_check_crc(const uint8_t *msg, int length)
+{
+    uint16_t crc = _modbus_rtu_crc16(msg, length - _MODBUS_RTU_CHECKSUM_LENGTH);
+
+    return crc == (msg[length - 1] << 8 | msg[length - 2]);
+}
+
+/* Whether the buffer starts with the response to the pending request rather
+   than another request */
+static int _sniff_response_expected(const modbus_sniff_t *sniff)
+{
+    return sniff->req_length > 0 && sniff->req[0] == sniff->buffer[0] && sniff->req[1] == (sniff->buffer[1] & 0x7F);
+}
+
+/* Length of the frame at the start of the buffer, 0 if more bytes are needed,
+   -1 if there is none */
+static int _sniff_next_frame(const modbus_sniff_t *sniff, int *is_request)
+{
+    const uint8_t *msg = sniff->buffer;
+    int lengths[2], requests[2];
+    int nb = 0, incomplete = 0;
+    int i;
+
+    if (sniff->length < 3)
+    {
+        return 0;
+    }
+
+    if (msg[1] & 0x80)
+    {
+        lengths[nb] = _SNIFF_EXCEPTION_LENGTH;
+        requests[nb++] = FALSE;
+    }
+    else if (msg[1] >= MODBUS_FC_READ_COILS && msg[1] <= MODBUS_FC_READ_INPUT_REGISTERS)
+    {
+        /* The same header starts a request and a response, the one expected
+           is tried first */
+        int response = _sniff_response_expected(sniff);
+
+        lengths[nb] = response ? 5 + msg[2] : _SNIFF_READ_REQUEST_LENGTH;
+        requests[nb++] = !response;
+        lengths[nb] = response ? _SNIFF_READ_REQUEST_LENGTH : 5 + msg[2];
+        requests[nb++] = response;
+    }
+
+    for (i = 0; i < nb; i++)
+    {
+        if (lengths[i] > MODBUS_RTU_MAX_ADU_LENGTH)
+        {
+            continue;
+        }
+        if (lengths[i] > sniff->length)
+        {
+            incomplete = TRUE;
+        }
+        else if (_sniff_check_crc(msg, lengths[i]))
+        {
+            *is_request = requests[i];
+            return lengths[i];
+        }
+    }
+
+    return incomplete ? 0 : -1;
+}
+
+static int _sniff_frame(modbus_sniff_t *sniff, int length, int is_request, modbus_sniff_callback_t callback,
+                        void *user)
+{
+    sniff->frames++;
+    if (is_request)
+    {
+        /* A broadcast, or a request that went unanswered, is replaced */
+        memcpy(sniff->req, sniff->buffer, length);
+        sniff->req_length = length;
+        return 0;
+    }
+
+    if (!_sniff_response_expected(sniff))
+    {
+        sniff->orphans++;
+        return 0;
+    }
+    sniff->pairs++;
+    callback(sniff->req, sniff->req_length, sniff->buffer, length, user);
+    sniff->req_length = 0;
+    return 1;
+}
+
+void modbus_sniff_init(modbus_sniff_t *sniff)
+{
+    memset(sniff, 0, sizeof(*sniff));
+}
+
+int modbus_sniff_feed(modbus_sniff_t *sniff, const uint8_t *data, int length, modbus_sniff_callback_t callback,
+                      void *user)
+{
+    int transactions = 0;
+    int rc, is_request, n;
+
+    while (length > 0)
+    {
+        n = MODBUS_SNIFF_BUFFER_LENGTH - sniff->length;
+        n = n < length ? n : length;
+        memcpy(sniff->buffer + sniff->length, data, n);
+        sniff->length += n;
+        data += n;
+        length -= n;
+
+        while ((rc = _sniff_next_frame(sniff, &is_request)) != 0)
+        {
+            if (rc == -1)
+            {
+                rc = 1;
+                sniff->dropped++;
+            }
+            else
+            {
+                transactions += _sniff_frame(sniff, rc, is_request, callback, user);
+            }
+            sniff->length -= rc;
+            memmove(sniff->buffer, sniff->buffer + rc, sniff->length);
+        }
+    }
+
+    return transactions;
+}
+
+int modbus_sniff_receive(modbus_t *ctx, modbus_sniff_t *sniff, modbus_sniff_callback_t callback, void *user)
+{
+    uint8_t data[MODBUS_RTU_MAX_ADU_LENGTH];
+    struct timeval tv = ctx->response_timeout;
+    fd_set rset;
+    ssize_t n;
+
+    FD_ZERO(&rset);
+    FD_SET(ctx->s, &rset);
+    if (ctx->backend->select(ctx, &rset, &tv, sizeof(data)) == -1)
+    {
+        if (errno == ETIMEDOUT)
+        {
+            /* The line is silent, what was received won't be completed */
+            sniff->dropped += sniff->length;
+            sniff->length = 0;
+        }
+        return -1;
+    }
+
+    n = ctx->backend->recv(ctx, data, sizeof(data));
+    if (n <= 0)
+    {
+        if (n == 0)
+        {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    if (ctx->capture_fd >= 0)
+    {
+        _modbus_capture_frame(ctx, MODBUS_CAPTURE_RX, 0, data, n);
+    }
+
+    return modbus_sniff_feed(sniff, data, n, callback, user);
+}
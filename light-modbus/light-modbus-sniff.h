@@ -0,0 +1,53 @@
+#ifndef LIGHT_MODBUS_SNIFF_H
+#define LIGHT_MODBUS_SNIFF_H
+
+#include "light-modbus.h"
+
+/* Decodes the transactions of another master from the bytes seen on an RTU
+ * line. Frames are delimited as a receiver would, from their function code
+ * and byte count, and kept only when their CRC checks out; when no frame
+ * does, a byte is dropped until one is found again. The read functions (1 to
+ * 4) and exception responses are decoded. */
+
+#define MODBUS_SNIFF_BUFFER_LENGTH (2 * MODBUS_RTU_MAX_ADU_LENGTH)
+
+/* A request and its response (or exception), CRC included */
+typedef void (*modbus_sniff_callback_t)(const uint8_t* req, int req_length, const uint8_t* rsp, int rsp_length,
+                                        void* user);
+
+typedef struct _modbus_sniff {
+    uint8_t buffer[MODBUS_SNIFF_BUFFER_LENGTH];
+    int length;
+    /* The last request, waiting for its response */
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    int req_length;
+    /* Valid frames, and the request and response pairs among them */
+    uint64_t frames;
+    uint64_t pairs;
+    /* Responses without their request, e.g. when started mid-transaction */
+    uint64_t orphans;
+    /* Bytes that weren't part of a valid frame */
+    uint64_t dropped;
+} modbus_sniff_t;
+
+void modbus_sniff_init(modbus_sniff_t* sniff);
+
+/**
+ * @brief Decode length bytes received, calling back for each transaction
+ * completed.
+ *
+ * @return the number of transactions.
+ */
+int modbus_sniff_feed(modbus_sniff_t* sniff, const uint8_t* data, int length, modbus_sniff_callback_t callback,
+                      void* user);
+
+/**
+ * @brief Receive from the line of ctx, set listen-only, and decode what was
+ * received. A silence of the response timeout ends the frame being received.
+ *
+ * @return the number of transactions, or -1 with errno set (ETIMEDOUT on
+ * silence).
+ */
+int modbus_sniff_receive(modbus_t* ctx, modbus_sniff_t* sniff, modbus_sniff_callback_t callback, void* user);
+
+#endif
@@ -0,0 +1,140 @@
+#include "light-modbus.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+void _modbus_trace_record(modbus_trace_t *trace, int type, int slave, int length, uint32_t arg)
+{
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    modbus_trace_event_t *event = &trace->events[head & trace->mask];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event->ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    event->type = type;
+    event->slave = slave;
+    event->length = length;
+    event->arg = arg;
+
+    /* Publish the event to dumpers running in other threads or in a signal handler */
+    __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Enables the trace ring with room for nb_events (rounded up to a power of
+ * two), or disables it when nb_events is 0. Not to be called while a
+ * transaction or a dump is running. */
+int modbus_set_trace(modbus_t *ctx, int nb_events)
+{
+    modbus_trace_t *trace = NULL;
+    uint32_t size = 1;
+
+    if (ctx == NULL || nb_events < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb_events > 0)
+    {
+        while (size < (uint32_t)nb_events)
+        {
+            size <<= 1;
+        }
+
+        trace = calloc(1, sizeof(modbus_trace_t) + size * sizeof(modbus_trace_event_t));
+        if (trace == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        trace->mask = size - 1;
+    }
+
+    free(ctx->trace);
+    ctx->trace = trace;
+    return 0;
+}
+
+/* Writes the events of the ring to fd, oldest first. Only uses write(2), so
+ * it can be called from a signal handler. Events recorded during the dump may
+ * overwrite the oldest ones being written. */
+int modbus_trace_dump(modbus_t *ctx, int fd)
+{
+    modbus_trace_dump_header_t header;
+    modbus_trace_t *trace;
+    uint64_t head, first, i;
+
+    if (ctx == NULL || ctx->trace == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    trace = ctx->trace;
+    head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    first = head > trace->mask + 1 ? head - (trace->mask + 1) : 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODBUS_TRACE_MAGIC, sizeof(header.magic));
+    header.version = MODBUS_TRACE_VERSION;
+    header.event_size = sizeof(modbus_trace_event_t);
+    header.count = head - first;
+    header.lost = first;
+
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        return -1;
+    }
+
+    /* At most two contiguous parts of the ring */
+    for (i = first; i < head;)
+    {
+        uint64_t index = i & trace->mask;
+        uint64_t n = head - i;
+        ssize_t size;
+
+        if (index + n > trace->mask + 1)
+        {
+            n = trace->mask + 1 - index;
+        }
+
+        size = n * sizeof(modbus_trace_event_t);
+        if (write(fd, &trace->events[index], size) != size)
+        {
+            return -1;
+        }
+        i += n;
+    }
+
+    return header.count;
+}
+
+const char *modbus_trace_type_name(int type)
+{
+    switch (type)
+    {
+    case MODBUS_TRACE_REQUEST_SENT:
+        return "REQUEST_SENT";
+    case MODBUS_TRACE_FIRST_BYTE:
+        return "FIRST_BYTE";
+    case MODBUS_TRACE_CHUNK:
+        return "CHUNK";
+    case MODBUS_TRACE_FRAME_COMPLETE:
+        return "FRAME_COMPLETE";
+    case MODBUS_TRACE_CRC_OK:
+        return "CRC_OK";
+    case MODBUS_TRACE_CRC_ERROR:
+        return "CRC_ERROR";
+    case MODBUS_TRACE_TIMEOUT:
+        return "TIMEOUT";
+    case MODBUS_TRACE_ERROR:
+        return "ERROR";
+    case MODBUS_TRACE_RECOVERY:
+        return "RECOVERY";
+    default:
+        return "UNKNOWN";
+    }
+}
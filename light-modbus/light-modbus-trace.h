@@ -0,0 +1,69 @@
+#ifndef LIGHT_MODBUS_TRACE_H
+#define LIGHT_MODBUS_TRACE_H
+
+#include <stdint.h>
+
+#define MODBUS_TRACE_MAGIC "MBTR"
+#define MODBUS_TRACE_VERSION 1
+#define MODBUS_TRACE_DEFAULT_EVENTS 4096
+
+typedef enum {
+    /* length: frame length, arg: function << 16 | address */
+    MODBUS_TRACE_REQUEST_SENT = 1,
+    /* arg: the byte */
+    MODBUS_TRACE_FIRST_BYTE,
+    /* length: bytes read, arg: receive step */
+    MODBUS_TRACE_CHUNK,
+    /* length: frame length, arg: function */
+    MODBUS_TRACE_FRAME_COMPLETE,
+    /* arg: received CRC */
+    MODBUS_TRACE_CRC_OK,
+    MODBUS_TRACE_CRC_ERROR,
+    /* length: bytes received before the timeout */
+    MODBUS_TRACE_TIMEOUT,
+    /* arg: errno */
+    MODBUS_TRACE_ERROR,
+    /* arg: modbus_trace_recovery_t */
+    MODBUS_TRACE_RECOVERY,
+    MODBUS_TRACE_MAX
+} modbus_trace_type_t;
+
+typedef enum {
+    MODBUS_TRACE_RECOVERY_SLEEP = 1,
+    MODBUS_TRACE_RECOVERY_FLUSH,
+    MODBUS_TRACE_RECOVERY_RECONNECT,
+    MODBUS_TRACE_RECOVERY_RETRY
+} modbus_trace_recovery_t;
+
+typedef struct _modbus_trace_event {
+    /* CLOCK_MONOTONIC */
+    uint64_t ts_ns;
+    uint8_t type;
+    uint8_t slave;
+    uint16_t length;
+    uint32_t arg;
+} modbus_trace_event_t;
+
+/* Header of a dump, followed by `count` events, oldest first */
+typedef struct _modbus_trace_dump_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t event_size;
+    uint32_t count;
+    uint32_t reserved;
+    /* Events overwritten before the dump */
+    uint64_t lost;
+} modbus_trace_dump_header_t;
+
+/* Single producer ring: only the thread doing the transactions writes it */
+typedef struct _modbus_trace {
+    uint32_t mask;
+    /* Number of events ever recorded */
+    uint64_t head;
+    modbus_trace_event_t events[];
+} modbus_trace_t;
+
+void _modbus_trace_record(modbus_trace_t* trace, int type, int slave, int length, uint32_t arg);
+const char* modbus_trace_type_name(int type);
+
+#endif
@@ -11,6 +11,25 @@
 
 #define MSG_LENGTH_UNDEFINED -1
 
+/* Statistics have a single writer, see modbus_stats_t */
+#define _STAT_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define _STAT_INC(field) _STAT_ADD(field, 1)
+
+#define _TRACE(ctx, type, length, arg)                                                 \
+    do                                                                                 \
+    {                                                                                  \
+        if ((ctx)->trace != NULL)                                                      \
+            _modbus_trace_record((ctx)->trace, (type), (ctx)->slave, (length), (arg)); \
+    } while (0)
+
+#define _CAPTURE(ctx, direction, flags, msg, length)                            \
+    do                                                                          \
+    {                                                                           \
+        if ((ctx)->capture_fd >= 0)                                             \
+            _modbus_capture_frame((ctx), (direction), (flags), (msg), (length)); \
+    } while (0)
+
 void _error_print(modbus_t *ctx, const char *context)
 {
     if (ctx->debug)
@@ -27,10 +46,76 @@ void _error_print(modbus_t *ctx, const char *context)
     }
 }
 
+static uint64_t _modbus_monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _stat_latency(modbus_histogram_t *histogram, uint64_t latency_us)
+{
+    int bucket = latency_us == 0 ? 0 : 64 - __builtin_clzll(latency_us);
+
+    if (bucket >= MODBUS_STATS_LATENCY_BUCKETS)
+    {
+        bucket = MODBUS_STATS_LATENCY_BUCKETS - 1;
+    }
+
+    _STAT_INC(histogram->count);
+    _STAT_ADD(histogram->sum_us, latency_us);
+    _STAT_ADD(histogram->sum_sq_us, latency_us * latency_us);
+    if (latency_us > histogram->max_us)
+    {
+        __atomic_store_n(&histogram->max_us, latency_us, __ATOMIC_RELAXED);
+    }
+    _STAT_INC(histogram->buckets[bucket]);
+}
+
+/* Splits the last transaction into wire time, slave turnaround and receive
+ * overhead (USB adapter latency, scheduling...) */
+static void _stat_timing(modbus_t *ctx)
+{
+    modbus_timing_t *timing = &ctx->timing;
+    int64_t turnaround_us, rx_overhead_us;
+
+    timing->tx_wire_us = ctx->onebyte_time * timing->req_length;
+    timing->rx_wire_us = ctx->onebyte_time * (timing->rsp_length - 1);
+    /* The first byte is only seen once it has been entirely received */
+    turnaround_us = ((int64_t)timing->first_byte_ns - (int64_t)timing->sent_ns) / 1000 - timing->tx_wire_us - ctx->onebyte_time;
+    timing->turnaround_us = turnaround_us;
+    timing->rx_us = (timing->complete_ns - timing->first_byte_ns) / 1000;
+    rx_overhead_us = (int64_t)timing->rx_us - timing->rx_wire_us;
+
+    _stat_latency(&ctx->stats.turnaround, turnaround_us > 0 ? turnaround_us : 0);
+    _stat_latency(&ctx->stats.rx_overhead, rx_overhead_us > 0 ? rx_overhead_us : 0);
+    _STAT_ADD(ctx->stats.tx_wire_us, timing->tx_wire_us);
+    _STAT_ADD(ctx->stats.rx_wire_us, timing->rx_wire_us);
+}
+
+static void _stat_errno(modbus_t *ctx)
+{
+    _TRACE(ctx, MODBUS_TRACE_ERROR, 0, errno);
+
+    if (errno > MODBUS_ENOBASE && errno < MODBUS_ENOBASE + MODBUS_STATS_MAX_EXCEPTION)
+    {
+        _STAT_INC(ctx->stats.exceptions[errno - MODBUS_ENOBASE]);
+    }
+    else if (errno == EMBBADCRC)
+    {
+        _STAT_INC(ctx->stats.crc_errors);
+    }
+    else if (errno == EMBBADDATA || errno == EMBBADEXC || errno == EMBBADSLAVE || errno == EMBMDATA)
+    {
+        _STAT_INC(ctx->stats.bad_data);
+    }
+}
+
 static void _sleep_response_timeout(modbus_t *ctx)
 {
     /* Response timeout is always positive */
     /* usleep source code */
+    _TRACE(ctx, MODBUS_TRACE_RECOVERY, 0, MODBUS_TRACE_RECOVERY_SLEEP);
     struct timespec request, remaining;
     request.tv_sec = ctx->response_timeout.tv_sec;
     request.tv_nsec = ((long int)ctx->response_timeout.tv_usec) * 1000;
@@ -67,16 +152,41 @@ int modbus_set_response_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec
     return 0;
 }
 
+/* Get the timeout interval between two consecutive bytes of a message */
+int modbus_get_byte_timeout(modbus_t *ctx, uint32_t *to_sec, uint32_t *to_usec)
+{
+    if (ctx == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *to_sec = ctx->byte_timeout.tv_sec;
+    *to_usec = ctx->byte_timeout.tv_usec;
+    return 0;
+}
+
+/* A byte timeout of 0 only waits for the response timeout */
+int modbus_set_byte_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec)
+{
+    if (ctx == NULL || to_usec > 999999)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->byte_timeout.tv_sec = to_sec;
+    ctx->byte_timeout.tv_usec = to_usec;
+    return 0;
+}
+
 /* Computes the length of the expected response */
 static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t *req, uint8_t size)
 {
     int length;
     const int offset = ctx->backend->header_length;
-
-    if (size % 2 == 1)
-    {
-        size++;
-    }
+    /* Not an uint8_t, 255 would be padded to 0 */
+    const int paddedSize = (size % 2 == 1) ? size + 1 : size;
 
     switch (req[offset])
     {
@@ -92,7 +202,7 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
     case MODBUS_FC_READ_HOLDING_REGISTERS:
     case MODBUS_FC_READ_INPUT_REGISTERS:
         /* Header + 2 * nb values */
-        length = 2 + size * (req[offset + 3] << 8 | req[offset + 4]);
+        length = 2 + paddedSize * (req[offset + 3] << 8 | req[offset + 4]);
         break;
     case MODBUS_FC_READ_EXCEPTION_STATUS:
         length = 3;
@@ -201,7 +311,7 @@ compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     return length;
 }
 
-static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, uint8_t size, int rsp_length)
+int _modbus_check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, uint8_t size, int rsp_length)
 {
     int rc;
     int rsp_length_computed;
@@ -279,7 +389,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, uint8_t
             return -1;
         }
 
-        uint8_t paddedSize = (size % 2 == 1) ? size + 1 : size;
+        int paddedSize = (size % 2 == 1) ? size + 1 : size;
 
         /* Check the number of values is corresponding to the request */
         switch (function)
@@ -454,6 +564,15 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         if (rc == -1)
         {
             _error_print(ctx, "select");
+            if (msg_length > 0)
+            {
+                _CAPTURE(ctx, MODBUS_CAPTURE_RX, MODBUS_CAPTURE_PARTIAL, msg, msg_length);
+            }
+            if (errno == ETIMEDOUT)
+            {
+                _STAT_INC(ctx->stats.timeouts);
+                _TRACE(ctx, MODBUS_TRACE_TIMEOUT, msg_length, step);
+            }
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK)
             {
                 int saved_errno = errno;
@@ -464,6 +583,8 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
                 }
                 else if (errno == EBADF)
                 {
+                    _STAT_INC(ctx->stats.reconnects);
+                    _TRACE(ctx, MODBUS_TRACE_RECOVERY, 0, MODBUS_TRACE_RECOVERY_RECONNECT);
                     modbus_close(ctx);
                     modbus_connect(ctx);
                 }
@@ -482,9 +603,15 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         if (rc == -1)
         {
             _error_print(ctx, "read");
+            if (msg_length > 0)
+            {
+                _CAPTURE(ctx, MODBUS_CAPTURE_RX, MODBUS_CAPTURE_PARTIAL, msg, msg_length);
+            }
             if ((ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) && (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP) && (errno == ECONNRESET || errno == ECONNREFUSED || errno == EBADF))
             {
                 int saved_errno = errno;
+                _STAT_INC(ctx->stats.reconnects);
+                _TRACE(ctx, MODBUS_TRACE_RECOVERY, 0, MODBUS_TRACE_RECOVERY_RECONNECT);
                 modbus_close(ctx);
                 modbus_connect(ctx);
                 /* Could be removed by previous calls */
@@ -501,8 +628,16 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
                 printf("<%.2X>", msg[msg_length + i]);
         }
 
+        if (msg_length == 0)
+        {
+            ctx->timing.first_byte_ns = _modbus_monotonic_ns();
+            _TRACE(ctx, MODBUS_TRACE_FIRST_BYTE, 1, msg[0]);
+        }
+        _TRACE(ctx, MODBUS_TRACE_CHUNK, rc, step);
+
         /* Sums bytes received */
         msg_length += rc;
+        _STAT_ADD(ctx->stats.bytes_rx, rc);
         /* Computes remaining bytes */
         length_to_read -= rc;
 
@@ -525,6 +660,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
                 {
                     errno = EMBBADDATA;
                     _error_print(ctx, "too many data");
+                    _CAPTURE(ctx, MODBUS_CAPTURE_RX, MODBUS_CAPTURE_PARTIAL, msg, msg_length);
                     return -1;
                 }
                 step = _STEP_DATA;
@@ -550,7 +686,19 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     if (ctx->debug)
         printf("\n");
 
-    return ctx->backend->check_integrity(ctx, msg, msg_length);
+    ctx->timing.complete_ns = _modbus_monotonic_ns();
+    ctx->timing.rsp_length = msg_length;
+    _CAPTURE(ctx, MODBUS_CAPTURE_RX, 0, msg, msg_length);
+    _TRACE(ctx, MODBUS_TRACE_FRAME_COMPLETE, msg_length, msg[ctx->backend->header_length]);
+
+    rc = ctx->backend->check_integrity(ctx, msg, msg_length);
+    if (ctx->trace != NULL && msg_length >= 2 && (rc > 0 || (rc == -1 && errno == EMBBADCRC)))
+    {
+        uint32_t crc = (msg[msg_length - 1] << 8) | msg[msg_length - 2];
+        _TRACE(ctx, rc > 0 ? MODBUS_TRACE_CRC_OK : MODBUS_TRACE_CRC_ERROR, msg_length, crc);
+    }
+
+    return rc;
 }
 
 /* Sends a request/response */
@@ -569,19 +717,25 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
     }
 
     /* In recovery mode, the write command will be issued until to be
-       successful! Disabled by default. */
+       successful! Disabled by default. A line that must not be written to
+       (EPERM, listen-only) won't recover. */
+    ctx->timing.sent_ns = 0;
     do
     {
         rc = ctx->backend->send(ctx, msg, msg_length);
         if (rc == -1)
         {
             _error_print(ctx, NULL);
-            if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK)
+            if ((ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) && errno != EPERM)
             {
                 int saved_errno = errno;
 
+                _STAT_INC(ctx->stats.retries);
+                _TRACE(ctx, MODBUS_TRACE_RECOVERY, 0, MODBUS_TRACE_RECOVERY_RETRY);
                 if ((errno == EBADF || errno == ECONNRESET || errno == EPIPE))
                 {
+                    _STAT_INC(ctx->stats.reconnects);
+                    _TRACE(ctx, MODBUS_TRACE_RECOVERY, 0, MODBUS_TRACE_RECOVERY_RECONNECT);
                     modbus_close(ctx);
                     _sleep_response_timeout(ctx);
                     modbus_connect(ctx);
@@ -594,7 +748,20 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
                 errno = saved_errno;
             }
         }
-    } while ((ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) && rc == -1);
+    } while ((ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) && rc == -1 && errno != EPERM);
+
+    if (rc > 0)
+    {
+        if (ctx->timing.sent_ns == 0)
+        {
+            ctx->timing.sent_ns = _modbus_monotonic_ns();
+        }
+        ctx->timing.req_length = rc;
+        _STAT_ADD(ctx->stats.bytes_tx, rc);
+        _CAPTURE(ctx, MODBUS_CAPTURE_TX, rc != msg_length ? MODBUS_CAPTURE_PARTIAL : 0, msg, rc);
+        _TRACE(ctx, MODBUS_TRACE_REQUEST_SENT, rc,
+               msg[ctx->backend->header_length] << 16 | msg[ctx->backend->header_length + 1] << 8 | msg[ctx->backend->header_length + 2]);
+    }
 
     if (rc > 0 && rc != msg_length)
     {
@@ -613,29 +780,46 @@ read_registers(modbus_t *ctx, int function, int addr, int nb, u_int8_t size, voi
     int req_length;
     uint8_t req[_MIN_REQ_LENGTH];
     uint8_t rsp[MAX_MESSAGE_LENGTH];
+    uint64_t start = _modbus_monotonic_ns();
 
+    _STAT_INC(ctx->stats.requests);
     req_length = ctx->backend->build_request_basis(ctx, function, addr, nb, size, req);
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0)
     {
         unsigned int offset;
+        uint64_t latency_us;
         int i;
 
         rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
         if (rc == -1)
+        {
+            _stat_errno(ctx);
             return -1;
+        }
 
-        rc = check_confirmation(ctx, req, rsp, size, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, size, rc);
         if (rc == -1)
+        {
+            _stat_errno(ctx);
             return -1;
+        }
+
+        latency_us = (_modbus_monotonic_ns() - start) / 1000;
+        _stat_latency(&ctx->stats.slave_latency[ctx->slave & 0xFF], latency_us);
+        if (function < MODBUS_STATS_MAX_FUNCTION)
+        {
+            _stat_latency(&ctx->stats.function_latency[function], latency_us);
+        }
+        _stat_timing(ctx);
 
         offset = ctx->backend->header_length;
-        uint8_t paddedSize = (size % 2 == 1) ? size + 1 : size;
+        int paddedSize = (size % 2 == 1) ? size + 1 : size;
 
         for (i = 0; i < rc; i++)
         {
-            memcpy((char *)dest + i, rsp + offset + 2 + i * paddedSize, size);
+            memcpy((char *)dest + i * size, rsp + offset + 2 + i * paddedSize, size);
         }
     }
 
@@ -693,6 +877,17 @@ int modbus_set_slave(modbus_t *ctx, int slave)
     return ctx->backend->set_slave(ctx, slave);
 }
 
+int modbus_get_slave(modbus_t *ctx)
+{
+    if (ctx == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->slave;
+}
+
 int modbus_connect(modbus_t *ctx)
 {
     if (ctx == NULL)
@@ -717,6 +912,7 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    free(ctx->trace);
     ctx->backend->free(ctx);
 }
 
@@ -755,6 +951,8 @@ int modbus_flush(modbus_t *ctx)
         return -1;
     }
 
+    _STAT_INC(ctx->stats.flushes);
+    _TRACE(ctx, MODBUS_TRACE_RECOVERY, 0, MODBUS_TRACE_RECOVERY_FLUSH);
     rc = ctx->backend->flush(ctx);
     if (rc != -1 && ctx->debug)
     {
@@ -769,13 +967,149 @@ int modbus_read_input_registers(
 {
     int status;
 
-    if (ctx == NULL)
+    if (ctx == NULL || size == 0 || nb < 1)
     {
         errno = EINVAL;
         return -1;
     }
 
+    /* The values must fit in the byte count of the response, nb bounded
+       first as the product can overflow */
+    if (nb > (ctx->backend->max_adu_length - ctx->backend->header_length - ctx->backend->checksum_length - 2) /
+                 (size + size % 2))
+    {
+        errno = EMBMDATA;
+        return -1;
+    }
+
     status = read_registers(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, size, dest);
 
     return status;
+}
+
+/* Sends a request built by the caller, slave and PDU, e.g. forwarded by a
+   gateway. The backend adds its framing. */
+int modbus_send_raw_request(modbus_t *ctx, const uint8_t *raw_req, int raw_req_length)
+{
+    uint8_t req[MAX_MESSAGE_LENGTH];
+
+    if (ctx == NULL || raw_req_length < 2 || raw_req_length > MAX_MESSAGE_LENGTH - ctx->backend->checksum_length)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _STAT_INC(ctx->stats.requests);
+    memcpy(req, raw_req, raw_req_length);
+    return send_msg(ctx, req, raw_req_length);
+}
+
+/* Receives the response to modbus_send_raw_request(), unchecked: an exception
+   response is returned as it was received */
+int modbus_receive_confirmation(modbus_t *ctx, uint8_t *rsp)
+{
+    int rc;
+
+    if (ctx == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+    if (rc == 0)
+    {
+        /* Filtered out by the backend */
+        errno = EMBBADSLAVE;
+        rc = -1;
+    }
+    if (rc == -1)
+    {
+        _stat_errno(ctx);
+    }
+    return rc;
+}
+
+static void _stats_copy_histogram(modbus_histogram_t *dest, modbus_histogram_t *src)
+{
+    int i;
+
+    dest->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dest->sum_us = __atomic_load_n(&src->sum_us, __ATOMIC_RELAXED);
+    dest->sum_sq_us = __atomic_load_n(&src->sum_sq_us, __ATOMIC_RELAXED);
+    dest->max_us = __atomic_load_n(&src->max_us, __ATOMIC_RELAXED);
+    for (i = 0; i < MODBUS_STATS_LATENCY_BUCKETS; i++)
+    {
+        dest->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Copies the statistics of the context. Can be called from any thread while
+ * transactions are running; each counter is read atomically but the copy as a
+ * whole isn't a snapshot. */
+int modbus_get_stats(modbus_t *ctx, modbus_stats_t *stats)
+{
+    modbus_stats_t *src;
+    int i;
+
+    if (ctx == NULL || stats == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    src = &ctx->stats;
+    stats->requests = __atomic_load_n(&src->requests, __ATOMIC_RELAXED);
+    stats->bytes_tx = __atomic_load_n(&src->bytes_tx, __ATOMIC_RELAXED);
+    stats->bytes_rx = __atomic_load_n(&src->bytes_rx, __ATOMIC_RELAXED);
+    stats->crc_errors = __atomic_load_n(&src->crc_errors, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&src->timeouts, __ATOMIC_RELAXED);
+    stats->bad_data = __atomic_load_n(&src->bad_data, __ATOMIC_RELAXED);
+    for (i = 0; i < MODBUS_STATS_MAX_EXCEPTION; i++)
+    {
+        stats->exceptions[i] = __atomic_load_n(&src->exceptions[i], __ATOMIC_RELAXED);
+    }
+    stats->retries = __atomic_load_n(&src->retries, __ATOMIC_RELAXED);
+    stats->flushes = __atomic_load_n(&src->flushes, __ATOMIC_RELAXED);
+    stats->reconnects = __atomic_load_n(&src->reconnects, __ATOMIC_RELAXED);
+    for (i = 0; i < MODBUS_STATS_MAX_SLAVE; i++)
+    {
+        _stats_copy_histogram(&stats->slave_latency[i], &src->slave_latency[i]);
+    }
+    for (i = 0; i < MODBUS_STATS_MAX_FUNCTION; i++)
+    {
+        _stats_copy_histogram(&stats->function_latency[i], &src->function_latency[i]);
+    }
+    _stats_copy_histogram(&stats->turnaround, &src->turnaround);
+    _stats_copy_histogram(&stats->rx_overhead, &src->rx_overhead);
+    stats->tx_wire_us = __atomic_load_n(&src->tx_wire_us, __ATOMIC_RELAXED);
+    stats->rx_wire_us = __atomic_load_n(&src->rx_wire_us, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* Timing of the last successful transaction */
+int modbus_get_last_timing(modbus_t *ctx, modbus_timing_t *timing)
+{
+    if (ctx == NULL || timing == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *timing = ctx->timing;
+    return 0;
+}
+
+/* Must be called from the thread doing the transactions */
+int modbus_reset_stats(modbus_t *ctx)
+{
+    if (ctx == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&ctx->stats, 0, sizeof(modbus_stats_t));
+    return 0;
 }
\ No newline at end of file
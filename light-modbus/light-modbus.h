@@ -1,9 +1,15 @@
+#ifndef LIGHT_MODBUS_H
+#define LIGHT_MODBUS_H
+
 #include <bits/types.h>
 #include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
 
+#include "light-modbus-capture.h"
+#include "light-modbus-trace.h"
+
 #define MODBUS_ENOBASE 112345378
 
 typedef struct _modbus modbus_t;
@@ -23,6 +29,73 @@ typedef __ssize_t ssize_t;
 
 typedef long int __fd_mask;
 
+/* Latency histograms use log2 buckets of microseconds: bucket 0 counts
+ * latencies below 1 us, bucket i latencies in [2^(i-1), 2^i) us and the last
+ * bucket everything above. */
+#define MODBUS_STATS_LATENCY_BUCKETS 24
+#define MODBUS_STATS_MAX_SLAVE 256
+/* Function codes up to MODBUS_FC_WRITE_AND_READ_REGISTERS */
+#define MODBUS_STATS_MAX_FUNCTION 0x18
+/* Indexed by exception code, see MODBUS_EXCEPTION_* */
+#define MODBUS_STATS_MAX_EXCEPTION 12
+
+typedef struct _modbus_histogram {
+    uint64_t count;
+    uint64_t sum_us;
+    /* For the jitter (standard deviation) */
+    uint64_t sum_sq_us;
+    uint64_t max_us;
+    uint32_t buckets[MODBUS_STATS_LATENCY_BUCKETS];
+} modbus_histogram_t;
+
+/* Statistics are only written by the thread doing the transactions, with
+ * relaxed atomic stores, so that modbus_get_stats() can be called from any
+ * thread without locking. */
+typedef struct _modbus_stats {
+    /* Transactions started */
+    uint64_t requests;
+    uint64_t bytes_tx;
+    uint64_t bytes_rx;
+    uint64_t crc_errors;
+    uint64_t timeouts;
+    /* Responses not matching the request (length, function, slave...) */
+    uint64_t bad_data;
+    uint64_t exceptions[MODBUS_STATS_MAX_EXCEPTION];
+    /* Write attempts repeated by the link error recovery */
+    uint64_t retries;
+    uint64_t flushes;
+    uint64_t reconnects;
+    /* Latency of successful transactions, from the request to the checked response */
+    modbus_histogram_t slave_latency[MODBUS_STATS_MAX_SLAVE];
+    modbus_histogram_t function_latency[MODBUS_STATS_MAX_FUNCTION];
+    /* Breakdown of successful transactions, see modbus_timing_t */
+    modbus_histogram_t turnaround;
+    modbus_histogram_t rx_overhead;
+    uint64_t tx_wire_us;
+    uint64_t rx_wire_us;
+} modbus_stats_t;
+
+/* Timestamps (CLOCK_MONOTONIC) of the last transaction, and their breakdown
+ * against the theoretical wire time derived from the line settings */
+typedef struct _modbus_timing {
+    /* When the write of the request returned. A backend that waits after it
+       (RTS toggled from userspace) stamps it itself */
+    uint64_t sent_ns;
+    uint64_t first_byte_ns;
+    uint64_t complete_ns;
+    int req_length;
+    int rsp_length;
+    /* Time to shift the request out, from the line settings */
+    uint32_t tx_wire_us;
+    /* Time to shift the response in after its first byte */
+    uint32_t rx_wire_us;
+    /* Time the slave took to start answering once the request was on the
+       wire: first byte - sent - request and first byte wire time */
+    int32_t turnaround_us;
+    /* Time from the first to the last byte of the response */
+    int32_t rx_us;
+} modbus_timing_t;
+
 typedef struct _modbus_backend {
     unsigned int backend_type;
     unsigned int header_length;
@@ -63,6 +136,14 @@ struct _modbus {
     struct timeval indication_timeout;
     const modbus_backend_t* backend;
     void* backend_data;
+    modbus_stats_t stats;
+    /* Binary event ring, NULL unless enabled with modbus_set_trace() */
+    modbus_trace_t* trace;
+    /* Estimated time in microseconds to send one byte, 0 if unknown */
+    unsigned int onebyte_time;
+    modbus_timing_t timing;
+    /* Raw frames are recorded there, -1 unless set with modbus_set_capture() */
+    int capture_fd;
 };
 
 #ifndef FALSE
@@ -89,7 +170,10 @@ typedef enum {
 
 typedef enum {
     _MODBUS_BACKEND_TYPE_RTU = 0,
-    _MODBUS_BACKEND_TYPE_TCP
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_BACKEND_TYPE_LOOPBACK,
+    _MODBUS_BACKEND_TYPE_FAULT,
+    _MODBUS_BACKEND_TYPE_REPLAY
 } modbus_backend_type_t;
 
 #define _MODBUS_RTU_HEADER_LENGTH 1
@@ -179,6 +263,7 @@ typedef enum {
 
 const char* modbus_strerror(int errnum);
 int modbus_set_slave(modbus_t* ctx, int slave);
+int modbus_get_slave(modbus_t* ctx);
 int modbus_connect(modbus_t* ctx);
 void modbus_close(modbus_t* ctx);
 void modbus_free(modbus_t* ctx);
@@ -186,6 +271,21 @@ int modbus_set_debug(modbus_t* ctx, int flag);
 int modbus_set_error_recovery(modbus_t* ctx, modbus_error_recovery_mode error_recovery);
 int modbus_flush(modbus_t* ctx);
 int modbus_read_input_registers(modbus_t* ctx, int addr, int nb, __uint8_t size, void* dest);
+int modbus_send_raw_request(modbus_t* ctx, const uint8_t* raw_req, int raw_req_length);
+int modbus_receive_confirmation(modbus_t* ctx, uint8_t* rsp);
 int modbus_get_response_timeout(modbus_t *ctx, uint32_t *to_sec, uint32_t *to_usec);
 int modbus_set_response_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec);
-int _modbus_receive_msg(modbus_t* ctx, uint8_t* msg, msg_type_t msg_type);
\ No newline at end of file
+int modbus_get_byte_timeout(modbus_t* ctx, uint32_t* to_sec, uint32_t* to_usec);
+int modbus_set_byte_timeout(modbus_t* ctx, uint32_t to_sec, uint32_t to_usec);
+int modbus_get_stats(modbus_t* ctx, modbus_stats_t* stats);
+int modbus_reset_stats(modbus_t* ctx);
+int modbus_get_last_timing(modbus_t* ctx, modbus_timing_t* timing);
+int modbus_set_trace(modbus_t* ctx, int nb_events);
+int modbus_trace_dump(modbus_t* ctx, int fd);
+int modbus_set_capture(modbus_t* ctx, int fd);
+void _modbus_capture_frame(modbus_t* ctx, int direction, int flags, const uint8_t* msg, int length);
+void _modbus_init_common(modbus_t* ctx);
+int _modbus_receive_msg(modbus_t* ctx, uint8_t* msg, msg_type_t msg_type);
+int _modbus_check_confirmation(modbus_t* ctx, uint8_t* req, uint8_t* rsp, uint8_t size, int rsp_length);
+
+#endif
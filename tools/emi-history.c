@@ -0,0 +1,64 @@
+/* Prints the samples of a series kept by emi-read --history, e.g. the voltage
+ * of the last hour:
+ *
+ *     build/emi-history /var/lib/emi-read/history 1 L1/voltage $(($(date +%s) - 3600))
+ *
+ * one "<UTC time> <value>" line per sample. The store is opened read-only,
+ * next to emi-read: the samples it hasn't flushed yet aren't shown */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../emi-tsdb.h"
+
+static int printSample(int64_t ts, double value, void *user)
+{
+    time_t seconds = ts / 1000;
+    struct tm tm;
+    char date[32];
+
+    gmtime_r(&seconds, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%03dZ %.3f\n", date, (int)(ts % 1000), value);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    emi_tsdb_t *history;
+    int64_t from = 0, to = INT64_MAX;
+    int rc;
+
+    if (argc < 4 || argc > 6)
+    {
+        fprintf(stderr, "Usage: %s <dir> <slave> <series, e.g. L1/voltage> [from s] [to s]\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 5)
+    {
+        from = strtoll(argv[4], NULL, 10) * 1000;
+    }
+    if (argc == 6)
+    {
+        to = strtoll(argv[5], NULL, 10) * 1000;
+    }
+
+    history = emi_tsdb_open_readonly(argv[1]);
+    if (history == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    rc = emi_tsdb_query(history, atoi(argv[2]), argv[3], from, to, printSample, NULL);
+    if (rc == -1)
+    {
+        fprintf(stderr, "Could not read %s: %s\n", argv[3], strerror(errno));
+    }
+
+    emi_tsdb_close(history);
+    return rc == -1;
+}
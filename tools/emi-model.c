@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emi-model.h"
+
+/* Average active power of slave 1, in W */
+#define BASE_POWER 2300
+
+void emi_model_init(emi_model_t *model, int nb_slaves, unsigned int seed)
+{
+    memset(model, 0, sizeof(*model));
+    model->nb_slaves = nb_slaves;
+    model->start = time(NULL);
+    model->seed = seed;
+}
+
+int emi_model_register_size(uint16_t address)
+{
+    switch (address)
+    {
+    /* Clock, emi_clock_t (packed) */
+    case 0x0001:
+        return 12;
+    /* Device ID 1 (serial number) */
+    case 0x0002:
+        return 10;
+    /* Device ID 2, activity calendar active name */
+    case 0x0003:
+    case 0x0006:
+        return 6;
+    /* Core and application firmware IDs */
+    case 0x0004:
+    case 0x0005:
+        return 5;
+    /* Currently active tariff, voltage, current, power factor, frequency */
+    case 0x000b:
+    case 0x006c:
+    case 0x006d:
+    case 0x007B:
+    case 0x007F:
+        return 2;
+    /* Apparent power threshold, energy registers, active power */
+    case 0x0012:
+    case 0x0016:
+    case 0x0026:
+    case 0x0027:
+    case 0x0028:
+    case 0x002C:
+    case 0x0079:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static void put16(uint8_t *dest, uint16_t value)
+{
+    dest[0] = value >> 8;
+    dest[1] = value & 0xFF;
+}
+
+static void put32(uint8_t *dest, uint32_t value)
+{
+    put16(dest, value >> 16);
+    put16(dest + 2, value & 0xFFFF);
+}
+
+static int noise(emi_model_t *model, int amplitude)
+{
+    return rand_r(&model->seed) % (2 * amplitude + 1) - amplitude;
+}
+
+/* Writes the big endian value of a register, returns its size */
+static int writeRegister(emi_model_t *model, int slave, uint16_t address, uint8_t *dest)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    /* Each slave draws a bit more than the previous one */
+    uint32_t power = BASE_POWER + 100 * (slave - 1);
+    /* Wh since start, on top of a per slave offset */
+    uint32_t energy = 1000000 * slave + (uint32_t)((now - model->start) * power / 3600);
+    char string[11];
+
+    switch (address)
+    {
+    case 0x0001:
+        gmtime_r(&now, &tm);
+        put16(dest, tm.tm_year + 1900);
+        dest[2] = tm.tm_mon + 1;
+        dest[3] = tm.tm_mday;
+        dest[4] = tm.tm_wday == 0 ? 7 : tm.tm_wday;
+        dest[5] = tm.tm_hour;
+        dest[6] = tm.tm_min;
+        dest[7] = tm.tm_sec;
+        dest[8] = 0;
+        put16(dest + 9, 0);
+        dest[11] = 0;
+        break;
+    case 0x0002:
+        snprintf(string, sizeof(string), "EMI%07d", slave);
+        memcpy(dest, string, 10);
+        break;
+    case 0x0003:
+        memcpy(dest, "SIM001", 6);
+        break;
+    case 0x0004:
+    case 0x0005:
+        memcpy(dest, "1.0.0", 5);
+        break;
+    case 0x0006:
+        memcpy(dest, "STDCAL", 6);
+        break;
+    case 0x000b:
+        gmtime_r(&now, &tm);
+        /* Day and night rates */
+        put16(dest, tm.tm_hour >= 7 && tm.tm_hour < 22 ? 1 : 2);
+        break;
+    case 0x0012:
+        /* 0.001 kVA */
+        put32(dest, 17250);
+        break;
+    case 0x0016:
+    case 0x002C:
+        put32(dest, energy);
+        break;
+    case 0x0026:
+        put32(dest, energy / 10 * 6);
+        break;
+    case 0x0027:
+        put32(dest, energy - energy / 10 * 6);
+        break;
+    case 0x0028:
+        put32(dest, 0);
+        break;
+    case 0x006c:
+        /* 0.1 V */
+        put16(dest, 2300 + noise(model, 30));
+        break;
+    case 0x006d:
+        /* 0.1 A */
+        put16(dest, power / 23 + noise(model, 3));
+        break;
+    case 0x0079:
+        put32(dest, power + noise(model, 50));
+        break;
+    case 0x007B:
+        /* 0.001 */
+        put16(dest, 970 + noise(model, 20));
+        break;
+    case 0x007F:
+        /* 0.1 Hz */
+        put16(dest, 500 + noise(model, 1));
+        break;
+    default:
+        return 0;
+    }
+
+    return emi_model_register_size(address);
+}
+
+static int exception(emi_model_t *model, const uint8_t *req, uint8_t *rsp, int code)
+{
+    model->exceptions++;
+    rsp[0] = req[0];
+    rsp[1] = req[1] | 0x80;
+    rsp[2] = code;
+    return 3;
+}
+
+int emi_model_answer(void *user, const uint8_t *req, int req_length, uint8_t *rsp)
+{
+    emi_model_t *model = user;
+    int slave = req[0];
+    int address, nb, length, i;
+
+    if (req_length < _MODBUS_RTU_PRESET_REQ_LENGTH || slave < 1 || slave > model->nb_slaves)
+    {
+        return 0;
+    }
+
+    model->requests++;
+    if (req[1] != MODBUS_FC_READ_INPUT_REGISTERS)
+    {
+        return exception(model, req, rsp, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+    }
+
+    address = req[2] << 8 | req[3];
+    nb = req[4] << 8 | req[5];
+    rsp[0] = slave;
+    rsp[1] = req[1];
+    length = 3;
+
+    for (i = 0; i < nb; i++)
+    {
+        int size = emi_model_register_size(address + i);
+
+        if (size == 0 || length + size + 1 > MODBUS_RTU_MAX_ADU_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH)
+        {
+            return exception(model, req, rsp, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+        }
+
+        memset(rsp + length, 0, size + 1);
+        writeRegister(model, slave, address + i, rsp + length);
+        length += size % 2 == 1 ? size + 1 : size;
+    }
+    rsp[2] = length - 3;
+
+    return length;
+}
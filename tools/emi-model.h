@@ -0,0 +1,44 @@
+#ifndef EMI_MODEL_H
+#define EMI_MODEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "../light-modbus/light-modbus.h"
+
+/* Model of the EMI meters polled by emi-read: the input registers read with
+ * FC 0x04, with their sizes. Like the meters, a request for nb values at addr
+ * is answered with registers addr..addr+nb-1, each padded to an even size. */
+
+#define EMI_MODEL_MAX_SLAVES 247
+
+typedef struct {
+    /* Slaves 1..nb_slaves answer, the others stay silent */
+    int nb_slaves;
+    /* Energy counters start here */
+    time_t start;
+    /* Noise on the instant values */
+    unsigned int seed;
+    uint64_t requests;
+    uint64_t exceptions;
+} emi_model_t;
+
+void emi_model_init(emi_model_t* model, int nb_slaves, unsigned int seed);
+
+/**
+ * @brief Size in bytes of a register, 0 if the meter does not have it.
+ */
+int emi_model_register_size(uint16_t address);
+
+/**
+ * @brief Answer a request (slave, function, address, nb) without its CRC.
+ *
+ * Has the signature of a modbus_loopback_slave_t, model being the
+ * emi_model_t.
+ *
+ * @return the response length without CRC (exceptions included), 0 when the
+ * request isn't for one of the slaves.
+ */
+int emi_model_answer(void* model, const uint8_t* req, int req_length, uint8_t* rsp);
+
+#endif
@@ -0,0 +1,57 @@
+/* Reads registers through emi-read --query, e.g. from scripts:
+ *
+ *     build/emi-query /run/emi-read.sock 1 0x006c 2 2
+ *
+ * prints the answer line, "OK <hex>" or "ERR <reason>" */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un sun;
+    char line[512];
+    ssize_t n;
+    int length = 0;
+    int fd;
+
+    if (argc != 6)
+    {
+        fprintf(stderr, "Usage: %s <socket> <slave> <address> <count> <size>\n", argv[0]);
+        return 1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", argv[1]);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    snprintf(line, sizeof(line), "READ %s %s %s %s\n", argv[2], argv[3], argv[4], argv[5]);
+    if (write(fd, line, strlen(line)) == -1)
+    {
+        perror("write");
+        return 1;
+    }
+
+    while (length < (int)sizeof(line) - 1 && (n = read(fd, line + length, sizeof(line) - 1 - length)) > 0)
+    {
+        length += n;
+        if (line[length - 1] == '\n')
+        {
+            break;
+        }
+    }
+    line[length] = '\0';
+    fputs(line, stdout);
+    close(fd);
+
+    return strncmp(line, "OK ", 3) == 0 ? 0 : 2;
+}
@@ -0,0 +1,76 @@
+/* Prints the shadow image of a meter kept by emi-read --shadow, once or every
+ * interval: a reader of the shared memory segment, as a local consumer would
+ * be */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../emi-shadow.h"
+
+static void printImage(const emi_shadow_t *shadow)
+{
+    emi_shadow_value_t value;
+    struct timespec now;
+    int64_t nowMs;
+    uint32_t i, j;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    nowMs = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    for (i = 0; i < __atomic_load_n(&shadow->nbValues, __ATOMIC_ACQUIRE); i++)
+    {
+        emi_shadow_read(shadow, i, &value);
+        printf("%-36s 0x%04x ", value.name, value.registerAddress);
+        for (j = 0; j < EMI_SHADOW_MAX_RAW; j++)
+        {
+            printf(j < value.size ? "%02x" : "  ", value.raw[j]);
+        }
+        if (value.timestamp == 0)
+        {
+            printf(" never read\n");
+        }
+        else
+        {
+            printf(" %14.3f  %lld ms ago\n", value.value, (long long)(nowMs - value.timestamp));
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const emi_shadow_t *shadow;
+    int interval = 0;
+
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: %s <segment, e.g. /emi-1> [interval s]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3)
+    {
+        interval = atoi(argv[2]);
+    }
+
+    shadow = emi_shadow_open(argv[1]);
+    if (shadow == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    printf("slave %d\n", shadow->slave);
+    printImage(shadow);
+    while (interval > 0)
+    {
+        sleep(interval);
+        printf("\n");
+        printImage(shadow);
+    }
+
+    emi_shadow_close(shadow, NULL);
+    return 0;
+}
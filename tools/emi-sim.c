@@ -0,0 +1,320 @@
+/* Simulates EMI meters on a pseudo-terminal, to run emi-read end to end
+ * without hardware: emi-read /dev/pts/N ... */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../light-modbus/light-modbus-rtu.h"
+#include "emi-model.h"
+
+/* Requests are 8 bytes: slave, function, address, count, CRC */
+#define REQUEST_LENGTH (_MODBUS_RTU_PRESET_REQ_LENGTH + _MODBUS_RTU_CHECKSUM_LENGTH)
+
+typedef enum {
+    FAULT_SILENCE,
+    FAULT_BAD_CRC,
+    FAULT_BUSY,
+    FAULT_TRUNCATED,
+    FAULT_MAX
+} fault_t;
+
+static const char *faultNames[FAULT_MAX] = {"silence", "bad CRC", "busy", "truncated"};
+
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t faults[FAULT_MAX];
+static uint64_t ignored = 0;
+
+static const struct option longOptions[] = {
+    {"slaves", required_argument, NULL, 'n'},
+    {"latency", required_argument, NULL, 'l'},
+    {"jitter", required_argument, NULL, 'j'},
+    {"baud", required_argument, NULL, 'b'},
+    {"errors", required_argument, NULL, 'e'},
+    {"link", required_argument, NULL, 'L'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  -n, --slaves N      answer for slaves 1..N (default 1)\n");
+    fprintf(stderr, "  -l, --latency US    turnaround before answering (default 2000)\n");
+    fprintf(stderr, "  -j, --jitter US     random extra turnaround, up to US\n");
+    fprintf(stderr, "  -b, --baud BAUD     send the responses at the pace of BAUD 8N1 (default: at once)\n");
+    fprintf(stderr, "  -e, --errors RATE   fraction of requests answered with a fault (silence, bad CRC,\n");
+    fprintf(stderr, "                      busy exception or truncated frame)\n");
+    fprintf(stderr, "  -L, --link PATH     symlink PATH to the pseudo-terminal\n");
+}
+
+static void onSignal(int signum)
+{
+    stop = 1;
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t deadline)
+{
+    struct timespec ts = {deadline / 1000000000, deadline % 1000000000};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+    {
+    }
+}
+
+/* Writes the response, one byte at a time at the pace of the line when byteNs
+ * is set */
+static void sendResponse(int fd, const uint8_t *rsp, int length, uint64_t start, uint64_t byteNs)
+{
+    int i;
+
+    if (byteNs == 0)
+    {
+        sleepUntil(start);
+        if (write(fd, rsp, length) != length)
+        {
+            perror("write");
+        }
+        return;
+    }
+
+    for (i = 0; i < length; i++)
+    {
+        sleepUntil(start + (i + 1) * byteNs);
+        if (write(fd, rsp + i, 1) != 1)
+        {
+            perror("write");
+            return;
+        }
+    }
+}
+
+static void answer(emi_model_t *model, int fd, const uint8_t *req, int latency, int jitter, double errorRate,
+                   uint64_t byteNs, unsigned int *seed)
+{
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint64_t start = nowNs() + latency * 1000ULL;
+    int length;
+
+    if (jitter > 0)
+    {
+        start += (uint64_t)(rand_r(seed) % (jitter + 1)) * 1000;
+    }
+
+    length = emi_model_answer(model, req, REQUEST_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH, rsp);
+    if (length == 0)
+    {
+        ignored++;
+        return;
+    }
+
+    if (errorRate > 0 && rand_r(seed) < errorRate * RAND_MAX)
+    {
+        fault_t fault = rand_r(seed) % FAULT_MAX;
+
+        faults[fault]++;
+        switch (fault)
+        {
+        case FAULT_SILENCE:
+            return;
+        case FAULT_BUSY:
+            rsp[1] = req[1] | 0x80;
+            rsp[2] = MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+            length = 3;
+            break;
+        default:
+            break;
+        }
+
+        length = _modbus_rtu_send_msg_pre(rsp, length);
+        if (fault == FAULT_BAD_CRC)
+        {
+            rsp[length - 1] ^= 0xFF;
+        }
+        else if (fault == FAULT_TRUNCATED)
+        {
+            length /= 2;
+        }
+    }
+    else
+    {
+        length = _modbus_rtu_send_msg_pre(rsp, length);
+    }
+
+    sendResponse(fd, rsp, length, start, byteNs);
+}
+
+int main(int argc, char *argv[])
+{
+    emi_model_t model;
+    const char *link = NULL;
+    int nbSlaves = 1, latency = 2000, jitter = 0, baud = 0;
+    double errorRate = 0;
+    unsigned int seed = 1;
+    uint8_t buffer[MODBUS_RTU_MAX_ADU_LENGTH];
+    int length = 0;
+    uint64_t byteNs;
+    struct termios tios;
+    int master, slave, opt, i;
+
+    while ((opt = getopt_long(argc, argv, "n:l:j:b:e:L:h", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            nbSlaves = atoi(optarg);
+            break;
+        case 'l':
+            latency = atoi(optarg);
+            break;
+        case 'j':
+            jitter = atoi(optarg);
+            break;
+        case 'b':
+            baud = atoi(optarg);
+            break;
+        case 'e':
+            errorRate = atof(optarg);
+            break;
+        case 'L':
+            link = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (nbSlaves < 1 || nbSlaves > EMI_MODEL_MAX_SLAVES || latency < 0 || jitter < 0 || baud < 0 ||
+        errorRate < 0 || errorRate > 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        fprintf(stderr, "Could not create a pseudo-terminal: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* Keep the slave side open so that emi-read can reconnect without the
+       master getting EIO, and make it raw until emi-read configures it */
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", ptsname(master), strerror(errno));
+        return 1;
+    }
+    tcgetattr(slave, &tios);
+    cfmakeraw(&tios);
+    tcsetattr(slave, TCSANOW, &tios);
+
+    if (link != NULL)
+    {
+        unlink(link);
+        if (symlink(ptsname(master), link) == -1)
+        {
+            fprintf(stderr, "Could not link %s: %s\n", link, strerror(errno));
+            return 1;
+        }
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    emi_model_init(&model, nbSlaves, seed);
+    byteNs = baud > 0 ? 10000000000ULL / baud : 0;
+    printf("Simulating %d slave(s) on %s\n", nbSlaves, ptsname(master));
+    fflush(stdout);
+
+    while (!stop)
+    {
+        fd_set rset;
+        /* A silence of 3.5 characters ends a frame, use 5 ms without a baud rate */
+        struct timeval tv = {0, byteNs > 0 ? byteNs * 35 / 10000 + 1 : 5000};
+        int rc;
+
+        FD_ZERO(&rset);
+        FD_SET(master, &rset);
+        rc = select(master + 1, &rset, NULL, NULL, length > 0 ? &tv : NULL);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("select");
+            break;
+        }
+        if (rc == 0)
+        {
+            /* End of a frame too short to be a request */
+            length = 0;
+            continue;
+        }
+
+        rc = read(master, buffer + length, sizeof(buffer) - length);
+        if (rc <= 0)
+        {
+            if (rc == -1 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        length += rc;
+
+        /* Answer the valid requests, resynchronize on garbage */
+        while (length >= REQUEST_LENGTH)
+        {
+            uint16_t crc = _modbus_rtu_crc16(buffer, REQUEST_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH);
+
+            if (buffer[REQUEST_LENGTH - 2] == (crc & 0xFF) && buffer[REQUEST_LENGTH - 1] == crc >> 8)
+            {
+                answer(&model, master, buffer, latency, jitter, errorRate, byteNs, &seed);
+                i = REQUEST_LENGTH;
+            }
+            else
+            {
+                i = 1;
+            }
+            length -= i;
+            memmove(buffer, buffer + i, length);
+        }
+    }
+
+    printf("%llu requests, %llu exceptions, %llu for other slaves\n", (unsigned long long)model.requests,
+           (unsigned long long)model.exceptions, (unsigned long long)ignored);
+    for (i = 0; i < FAULT_MAX; i++)
+    {
+        printf("%llu %s faults\n", (unsigned long long)faults[i], faultNames[i]);
+    }
+
+    if (link != NULL)
+    {
+        unlink(link);
+    }
+    close(slave);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,241 @@
+/* Measures the throughput and the recovery time of the library under each
+ * fault profile, against the EMI model behind a loopback backend */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../light-modbus/light-modbus-fault.h"
+#include "../light-modbus/light-modbus-loopback.h"
+#include "emi-model.h"
+
+typedef struct {
+    const char *name;
+    uint64_t injected;
+    int ok;
+    int failed;
+    double seconds;
+    /* From the start of a faulty or failed transaction to the end of the
+       next successful one, which is the same when the library recovered */
+    int recoveries;
+    double recovery_sum;
+    double recovery_max;
+} result_t;
+
+static const struct option longOptions[] = {
+    {"transactions", required_argument, NULL, 'n'},
+    {"rate", required_argument, NULL, 'r'},
+    {"baud", required_argument, NULL, 'b'},
+    {"turnaround", required_argument, NULL, 'u'},
+    {"timeout", required_argument, NULL, 't'},
+    {"byte-timeout", required_argument, NULL, 'B'},
+    {"delay", required_argument, NULL, 'd'},
+    {"recovery", required_argument, NULL, 'm'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  -n, --transactions N  transactions per profile (default 1000)\n");
+    fprintf(stderr, "  -r, --rate P          fault probability per transaction (default 0.05)\n");
+    fprintf(stderr, "  -b, --baud BAUD       simulated line speed, 0 for none (default 115200)\n");
+    fprintf(stderr, "  -u, --turnaround US   slave turnaround (default 1000)\n");
+    fprintf(stderr, "  -t, --timeout MS      response timeout (default 100)\n");
+    fprintf(stderr, "  -B, --byte-timeout MS byte timeout (default 20)\n");
+    fprintf(stderr, "  -d, --delay MS        delay of the delay fault (default: 2 x timeout)\n");
+    fprintf(stderr, "  -m, --recovery MODE   none, link, protocol or all (default all)\n");
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t countInjected(modbus_t *ctx)
+{
+    uint64_t injected[MODBUS_FAULT_MAX], total = 0;
+    int i;
+
+    modbus_fault_get_injected(ctx, injected);
+    for (i = MODBUS_FAULT_NONE + 1; i < MODBUS_FAULT_MAX; i++)
+    {
+        total += injected[i];
+    }
+    return total;
+}
+
+static void run(modbus_t *ctx, const modbus_fault_profile_t *profile, int nbTransactions, result_t *result)
+{
+    uint16_t values[2];
+    double start, failedAt = 0;
+    uint64_t injected = countInjected(ctx), first = injected;
+    int i;
+
+    modbus_fault_set_profile(ctx, profile);
+    modbus_flush(ctx);
+
+    start = now();
+    for (i = 0; i < nbTransactions; i++)
+    {
+        double begin = now();
+        /* The hot read of burst mode, voltage and current */
+        int rc = modbus_read_input_registers(ctx, 0x006c, 2, 2, values);
+        uint64_t previous = injected;
+
+        injected = countInjected(ctx);
+        if (failedAt == 0 && (injected != previous || rc != 2))
+        {
+            failedAt = begin;
+        }
+
+        if (rc == 2)
+        {
+            result->ok++;
+            if (failedAt > 0)
+            {
+                double recovery = now() - failedAt;
+
+                result->recoveries++;
+                result->recovery_sum += recovery;
+                if (recovery > result->recovery_max)
+                {
+                    result->recovery_max = recovery;
+                }
+                failedAt = 0;
+            }
+        }
+        else
+        {
+            result->failed++;
+        }
+    }
+    result->seconds = now() - start;
+    result->injected = injected - first;
+}
+
+int main(int argc, char *argv[])
+{
+    emi_model_t model;
+    modbus_fault_profile_t profile;
+    result_t results[MODBUS_FAULT_MAX + 1];
+    int nbTransactions = 1000, baud = 115200, turnaround = 1000, timeoutMs = 100, byteTimeoutMs = 20, delayMs = -1;
+    int recovery = MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL;
+    double rate = 0.05;
+    modbus_t *loopback, *ctx;
+    int opt, i, j;
+
+    while ((opt = getopt_long(argc, argv, "n:r:b:u:t:B:d:m:h", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            nbTransactions = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'b':
+            baud = atoi(optarg);
+            break;
+        case 'u':
+            turnaround = atoi(optarg);
+            break;
+        case 't':
+            timeoutMs = atoi(optarg);
+            break;
+        case 'B':
+            byteTimeoutMs = atoi(optarg);
+            break;
+        case 'd':
+            delayMs = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "none") == 0)
+                recovery = MODBUS_ERROR_RECOVERY_NONE;
+            else if (strcmp(optarg, "link") == 0)
+                recovery = MODBUS_ERROR_RECOVERY_LINK;
+            else if (strcmp(optarg, "protocol") == 0)
+                recovery = MODBUS_ERROR_RECOVERY_PROTOCOL;
+            else if (strcmp(optarg, "all") != 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (nbTransactions <= 0 || rate < 0 || rate > 1 || timeoutMs <= 0 || timeoutMs >= 1000 || byteTimeoutMs < 0 ||
+        byteTimeoutMs >= 1000)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    emi_model_init(&model, 1, 1);
+    loopback = modbus_new_loopback(emi_model_answer, &model);
+    if (loopback == NULL || modbus_loopback_set_line(loopback, baud, turnaround) == -1)
+    {
+        fprintf(stderr, "Could not create the loopback context: %s\n", modbus_strerror(errno));
+        return 1;
+    }
+
+    memset(&profile, 0, sizeof(profile));
+    profile.delay_us = (delayMs >= 0 ? delayMs : 2 * timeoutMs) * 1000;
+    ctx = modbus_new_fault(loopback, &profile, 1);
+    if (ctx == NULL || modbus_set_slave(ctx, 1) == -1 || modbus_connect(ctx) == -1)
+    {
+        fprintf(stderr, "Could not create the fault context: %s\n", modbus_strerror(errno));
+        return 1;
+    }
+    modbus_set_response_timeout(ctx, 0, timeoutMs * 1000);
+    modbus_set_byte_timeout(ctx, 0, byteTimeoutMs * 1000);
+    modbus_set_error_recovery(ctx, recovery);
+
+    /* Baseline, one profile per fault, then all of them */
+    memset(results, 0, sizeof(results));
+    for (i = 0; i <= MODBUS_FAULT_MAX; i++)
+    {
+        memset(&profile.rates, 0, sizeof(profile.rates));
+        if (i == MODBUS_FAULT_MAX)
+        {
+            results[i].name = "mixed";
+            for (j = MODBUS_FAULT_NONE + 1; j < MODBUS_FAULT_MAX; j++)
+            {
+                profile.rates[j] = rate / (MODBUS_FAULT_MAX - 1);
+            }
+        }
+        else
+        {
+            results[i].name = modbus_fault_name(i);
+            profile.rates[i] = i == MODBUS_FAULT_NONE ? 0 : rate;
+        }
+        run(ctx, &profile, nbTransactions, &results[i]);
+    }
+
+    printf("# %d transactions per profile, fault rate %.3f, %d baud, timeouts %d/%d ms\n", nbTransactions, rate, baud,
+           timeoutMs, byteTimeoutMs);
+    printf("%-10s %8s %8s %8s %10s %14s %14s\n", "profile", "injected", "ok", "failed", "ok/s", "recovery (ms)",
+           "max (ms)");
+    for (i = 0; i <= MODBUS_FAULT_MAX; i++)
+    {
+        result_t *r = &results[i];
+
+        printf("%-10s %8llu %8d %8d %10.1f %14.2f %14.2f\n", r->name, (unsigned long long)r->injected, r->ok,
+               r->failed, r->ok / r->seconds, r->recoveries > 0 ? r->recovery_sum / r->recoveries * 1000 : 0,
+               r->recovery_max * 1000);
+    }
+
+    modbus_free(ctx);
+    return 0;
+}
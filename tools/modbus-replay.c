@@ -0,0 +1,178 @@
+/* Replays a capture written by modbus_set_capture() (emi-read --capture)
+ * through the receive and check path of the library */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../light-modbus/light-modbus-replay.h"
+#include "emi-model.h"
+
+static const struct option longOptions[] = {
+    {"realtime", no_argument, NULL, 'r'},
+    {"loops", required_argument, NULL, 'n'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] <capture>\n", name);
+    fprintf(stderr, "  -r, --realtime   keep the recorded timing instead of replaying as fast as possible\n");
+    fprintf(stderr, "  -n, --loops N    replay the capture N times (default 1)\n");
+    fprintf(stderr, "  -v, --verbose    print every transaction\n");
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint8_t values[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint64_t ts, first, start, loopStart, elapsed;
+    uint64_t transactions = 0, ok = 0, timeouts = 0, crcErrors = 0, exceptions = 0, others = 0, mismatches = 0;
+    int realtime = FALSE, verbose = FALSE, loops = 1;
+    int opt, loop, length;
+
+    while ((opt = getopt_long(argc, argv, "rn:vh", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            realtime = TRUE;
+            break;
+        case 'n':
+            loops = atoi(optarg);
+            break;
+        case 'v':
+            verbose = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || loops < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    start = nowNs();
+    for (loop = 0; loop < loops; loop++)
+    {
+        modbus_t *ctx = modbus_new_replay(argv[optind], realtime);
+
+        first = 0;
+        loopStart = nowNs();
+
+        if (ctx == NULL || modbus_connect(ctx) == -1)
+        {
+            fprintf(stderr, "Could not replay %s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+
+        while ((length = modbus_replay_next_request(ctx, req, &ts)) > 0)
+        {
+            int address = req[2] << 8 | req[3];
+            int nb = req[4] << 8 | req[5];
+            /* Requests don't tell the size of the values, the register map does */
+            int size = emi_model_register_size(address);
+            int rc;
+
+            if (size == 0 || nb > 1)
+            {
+                size = 2;
+            }
+
+            if (first == 0)
+            {
+                first = ts;
+            }
+
+            if (realtime)
+            {
+                struct timespec deadline;
+                uint64_t at;
+
+                at = loopStart + (ts - first);
+                deadline.tv_sec = at / 1000000000;
+                deadline.tv_nsec = at % 1000000000;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+            }
+
+            /* emi-read only sends FC 0x04 requests */
+            if (length < 8 || req[1] != MODBUS_FC_READ_INPUT_REGISTERS)
+            {
+                fprintf(stderr, "Can't replay function 0x%02X, stopping\n", req[1]);
+                break;
+            }
+
+            modbus_set_slave(ctx, req[0]);
+            rc = modbus_read_input_registers(ctx, address, nb, size, values);
+            transactions++;
+
+            if (rc == nb)
+            {
+                ok++;
+            }
+            else if (errno == ETIMEDOUT)
+            {
+                timeouts++;
+            }
+            else if (errno == EMBBADCRC)
+            {
+                crcErrors++;
+            }
+            else if (errno > MODBUS_ENOBASE && errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)
+            {
+                exceptions++;
+            }
+            else
+            {
+                others++;
+            }
+
+            if (verbose)
+            {
+                int i;
+
+                printf("%12.3f slave %3d 0x%04X x%d: ", (ts - first) / 1e9, req[0], address, nb);
+                if (rc == nb)
+                {
+                    for (i = 0; i < nb * size; i++)
+                    {
+                        printf("%02X", values[i]);
+                    }
+                    printf("\n");
+                }
+                else
+                {
+                    printf("%s\n", modbus_strerror(errno));
+                }
+            }
+        }
+
+        mismatches += modbus_replay_get_mismatches(ctx);
+        modbus_free(ctx);
+    }
+    elapsed = nowNs() - start;
+
+    printf("%llu transactions in %.3f s (%.0f/s): %llu ok, %llu timeouts, %llu CRC errors, %llu exceptions, "
+           "%llu other errors, %llu requests differing from the capture\n",
+           (unsigned long long)transactions, elapsed / 1e9, transactions / (elapsed / 1e9), (unsigned long long)ok,
+           (unsigned long long)timeouts, (unsigned long long)crcErrors, (unsigned long long)exceptions,
+           (unsigned long long)others, (unsigned long long)mismatches);
+
+    return 0;
+}
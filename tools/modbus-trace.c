@@ -0,0 +1,103 @@
+/* Decodes a trace ring dump written by modbus_trace_dump() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../light-modbus/light-modbus.h"
+
+static const char *recoveryName(uint32_t action)
+{
+    switch (action)
+    {
+    case MODBUS_TRACE_RECOVERY_SLEEP:
+        return "sleep";
+    case MODBUS_TRACE_RECOVERY_FLUSH:
+        return "flush";
+    case MODBUS_TRACE_RECOVERY_RECONNECT:
+        return "reconnect";
+    case MODBUS_TRACE_RECOVERY_RETRY:
+        return "retry";
+    default:
+        return "?";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_trace_dump_header_t header;
+    modbus_trace_event_t event;
+    uint64_t first = 0, previous = 0;
+    FILE *file;
+    uint32_t i;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+        return 1;
+    }
+
+    file = fopen(argv[1], "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, MODBUS_TRACE_MAGIC, 4) != 0 ||
+        header.version != MODBUS_TRACE_VERSION || header.event_size != sizeof(modbus_trace_event_t))
+    {
+        fprintf(stderr, "%s is not a trace dump\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    printf("# %u events, %llu lost\n", header.count, (unsigned long long)header.lost);
+    printf("# time (us)  delta (us)  slave  event\n");
+
+    for (i = 0; i < header.count && fread(&event, sizeof(event), 1, file) == 1; i++)
+    {
+        if (i == 0)
+        {
+            first = previous = event.ts_ns;
+        }
+
+        printf("%12.1f %11.1f  %5d  %-14s", (event.ts_ns - first) / 1000.0, (event.ts_ns - previous) / 1000.0,
+               event.slave, modbus_trace_type_name(event.type));
+
+        switch (event.type)
+        {
+        case MODBUS_TRACE_REQUEST_SENT:
+            printf(" length=%u function=0x%02X address=0x%04X", event.length, event.arg >> 16, event.arg & 0xFFFF);
+            break;
+        case MODBUS_TRACE_FIRST_BYTE:
+            printf(" byte=0x%02X", event.arg);
+            break;
+        case MODBUS_TRACE_CHUNK:
+            printf(" length=%u step=%u", event.length, event.arg);
+            break;
+        case MODBUS_TRACE_FRAME_COMPLETE:
+            printf(" length=%u function=0x%02X", event.length, event.arg);
+            break;
+        case MODBUS_TRACE_CRC_OK:
+        case MODBUS_TRACE_CRC_ERROR:
+            printf(" length=%u crc=0x%04X", event.length, event.arg);
+            break;
+        case MODBUS_TRACE_TIMEOUT:
+            printf(" received=%u step=%u", event.length, event.arg);
+            break;
+        case MODBUS_TRACE_ERROR:
+            printf(" %s", modbus_strerror(event.arg));
+            break;
+        case MODBUS_TRACE_RECOVERY:
+            printf(" %s", recoveryName(event.arg));
+            break;
+        }
+        printf("\n");
+
+        previous = event.ts_ns;
+    }
+
+    fclose(file);
+    return 0;
+}